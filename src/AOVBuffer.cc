@@ -0,0 +1,59 @@
+#include <algorithm>
+#include <functional>
+
+#include "AOVBuffer.h"
+#include "ImageWriter.h"
+
+void PathAOVs::add(const PathAOVs &other) {
+    albedo = albedo + other.albedo;
+    normal = normal + other.normal;
+    depth += other.depth;
+    if (object_id < 0) object_id = other.object_id;
+    length += other.length;
+    lum2 += other.lum2;
+}
+
+AOVBuffer::AOVBuffer(int width, int height):
+    width{width}, height{height}, albedo(width * height, Color(0)), normal(width * height, Vec3d(0)),
+    depth(width * height, 0), object_id(width * height, -1), samples(width * height, 0),
+    path_length(width * height, 0), time(width * height, 0), variance(width * height, 0) {}
+
+void AOVBuffer::set(int i, const PathAOVs &sum, const Color &color_sum, int n, double seconds) {
+    samples[i] = n;
+    time[i] = seconds;
+    if (n <= 0) return;
+    albedo[i] = sum.albedo * (1.0 / n);
+    depth[i] = sum.depth / n;
+    normal[i] = sum.normal;
+    if (normal[i].sqrNorm() > 0) normal[i].normalize();
+    object_id[i] = sum.object_id;
+    path_length[i] = double(sum.length) / n;
+
+    double mean = luminance(color_sum) / n;
+    variance[i] = n > 1 ? std::max(0.0, sum.lum2 / n - mean * mean) / (n - 1) : 0;
+}
+
+bool write_aovs(const std::string &filename, const std::vector<Color> &beauty, const AOVBuffer &aovs) {
+    size_t n = beauty.size();
+    std::vector<ImageChannel> channels;
+    auto add = [&](const char *name, std::function<double(size_t)> value) {
+        channels.push_back(ImageChannel{name, std::vector<float>(n)});
+        for (size_t i = 0; i < n; ++i) channels.back().data[i] = value(i);
+    };
+
+    const char *rgb[3] = {"R", "G", "B"};
+    const char *albedo[3] = {"albedo.R", "albedo.G", "albedo.B"};
+    const char *normal[3] = {"normal.X", "normal.Y", "normal.Z"};
+    for (int c = 0; c < 3; ++c) {
+        add(rgb[c], [&](size_t i) { return beauty[i][c]; });
+        add(albedo[c], [&](size_t i) { return aovs.albedo[i][c]; });
+        add(normal[c], [&](size_t i) { return aovs.normal[i][c]; });
+    }
+    add("Z", [&](size_t i) { return aovs.depth[i]; });
+    add("id", [&](size_t i) { return aovs.object_id[i]; });
+    add("samples", [&](size_t i) { return aovs.samples[i]; });
+    add("path_length", [&](size_t i) { return aovs.path_length[i]; });
+    add("time", [&](size_t i) { return aovs.time[i]; });
+
+    return write_exr_channels(filename, aovs.width, aovs.height, channels);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include "MathUtils.h"
+
+// First hit data of one path, or its sum over the samples of a pixel.
+struct PathAOVs {
+    Color albedo = 0; // through mirrors and glass up to the first rough surface
+    Vec3d normal = 0; // 0 when the camera ray missed
+    double depth = 0;
+    int object_id = -1; // of the first sample that hit anything
+    int length = 0;     // bounces
+    double lum2 = 0;    // squared luminance of the path's radiance
+
+    void add(const PathAOVs &other);
+};
+
+// Arbitrary output variables: per pixel channels recorded alongside the
+// beauty pass, for compositing, the denoiser and finding expensive pixels.
+struct AOVBuffer {
+    int width = 0, height = 0;
+    std::vector<Color> albedo;
+    std::vector<Vec3d> normal; // unit length, or 0 where nothing was hit
+    std::vector<double> depth;
+    std::vector<int> object_id;
+    std::vector<uint32_t> samples;
+    std::vector<double> path_length; // mean bounces
+    std::vector<double> time;        // seconds spent rendering the pixel
+    std::vector<double> variance;    // of the pixel's mean luminance
+
+    AOVBuffer() {}
+    AOVBuffer(int width, int height);
+
+    // pixel i from the sums over n samples, color_sum is their radiance
+    void set(int i, const PathAOVs &sum, const Color &color_sum, int n, double seconds);
+};
+
+// Float EXR with the beauty pass in R, G, B and the AOVs as the channels
+// albedo.{R,G,B}, normal.{X,Y,Z}, Z, id, samples, path_length and time
+bool write_aovs(const std::string &filename, const std::vector<Color> &beauty, const AOVBuffer &aovs);
@@ -0,0 +1,65 @@
+#include <algorithm>
+
+#include "AliasTable.h"
+
+AliasTable::AliasTable(const std::vector<double> &weights):
+    prob(weights.size()), alias(weights.size()), pmfs(weights.size())
+{
+    int n = weights.size();
+    for (double w : weights) total += w;
+    if (n == 0 || total <= 0) {
+        prob.clear();
+        alias.clear();
+        pmfs.clear();
+        return;
+    }
+
+    // scaled so the average bucket is 1, then pair small buckets with large ones
+    std::vector<double> scaled(n);
+    std::vector<int> small, large;
+    for (int i = 0; i < n; ++i) {
+        pmfs[i] = weights[i] / total;
+        scaled[i] = pmfs[i] * n;
+        (scaled[i] < 1 ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+        int s = small.back(), l = large.back();
+        small.pop_back();
+        prob[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // leftovers are 1 up to rounding
+    for (int i : large) { prob[i] = 1; alias[i] = i; }
+    for (int i : small) { prob[i] = 1; alias[i] = i; }
+}
+
+int AliasTable::sample(double u, double &pmf) const {
+    double u_remapped;
+    return sample(u, pmf, u_remapped);
+}
+
+int AliasTable::sample(double u, double &pmf, double &u_remapped) const {
+    int n = prob.size();
+    double scaled = u * n;
+    int i = scaled;
+    if (i >= n) i = n - 1;
+    double frac = scaled - i;
+
+    int res;
+    if (frac < prob[i]) {
+        res = i;
+        u_remapped = frac / prob[i];
+    } else {
+        res = alias[i];
+        u_remapped = (frac - prob[i]) / (1 - prob[i]);
+    }
+    u_remapped = std::min(u_remapped, 1 - 1e-12);
+    pmf = pmfs[res];
+    return res;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <vector>
+
+// Walker's alias method: O(1) sampling of a discrete distribution with a
+// single uniform number, after an O(n) build.
+class AliasTable {
+    std::vector<double> prob;   // chance of keeping bucket i
+    std::vector<int> alias;     // where bucket i redirects to otherwise
+    std::vector<double> pmfs;
+    double total = 0;
+
+public:
+    AliasTable() {}
+    AliasTable(const std::vector<double> &weights);
+
+    bool empty() const { return pmfs.empty(); }
+    int size() const { return pmfs.size(); }
+    double weight_sum() const { return total; }
+    double pmf(int i) const { return pmfs[i]; }
+
+    // u in [0, 1)
+    int sample(double u, double &pmf) const;
+    // also returns the leftover randomness of u as a fresh uniform number,
+    // e.g. for jittering inside the picked bucket
+    int sample(double u, double &pmf, double &u_remapped) const;
+};
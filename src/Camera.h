@@ -19,8 +19,12 @@ public:
     void move_from_to(const Vec3d &from, const Vec3d &to);
     Vec3d ray_dir_at_pixel(double x, double y) const;
     const Vec3d &get_origin() const { return origin; }
+    const Vec3d &get_dir() const { return dir; }
+    double get_fov() const { return fov * 180.0 / M_PI; } // degrees, as passed in
     int get_width() const { return width; }
     int get_height() const { return height; }
+    // angle one pixel spans at the centre of the frame
+    double pixel_angle() const { return 2 * angle * inv_height; }
 private:
     void calc_axes();
 };
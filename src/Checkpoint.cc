@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <vector>
+
+#include "Checkpoint.h"
+#include "MathUtils.h"
+
+static const char checkpoint_magic[8] = {'C', 'R', 'A', 'Y', 'C', 'K', 'P', 'T'};
+constexpr uint32_t checkpoint_version = 2;
+
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; ++i) h = hash64(h ^ bytes[i]);
+    return h;
+}
+
+uint64_t checkpoint_render_id(const std::string &scene_name, const Camera &cam, const std::string &options) {
+    const Vec3d &o = cam.get_origin(), &d = cam.get_dir();
+    double view[9] = {double(cam.get_width()), double(cam.get_height()), cam.get_fov(), o[0], o[1], o[2], d[0], d[1], d[2]};
+    uint64_t h = hash_bytes(0, scene_name.data(), scene_name.size());
+    h = hash_bytes(h, view, sizeof(view));
+    return hash_bytes(h, options.data(), options.size());
+}
+
+bool save_checkpoint(const std::string &path, const RenderBuffer &buf, SamplerType sampler, uint64_t render_id) {
+    size_t n = buf.sum.size();
+    std::vector<float> sums(3 * n);
+    for (size_t i = 0; i < n; ++i) {
+        for (int c = 0; c < 3; ++c) sums[3 * i + c] = buf.sum[i][c];
+    }
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Cannot write checkpoint " << tmp_path << std::endl;
+        return false;
+    }
+
+    uint32_t header[4] = {checkpoint_version, uint32_t(sampler), uint32_t(buf.width), uint32_t(buf.height)};
+    bool ok = fwrite(checkpoint_magic, sizeof(checkpoint_magic), 1, file) == 1
+        && fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(&render_id, sizeof(render_id), 1, file) == 1
+        && fwrite(sums.data(), sizeof(float), sums.size(), file) == sums.size()
+        && fwrite(buf.samples.data(), sizeof(uint32_t), n, file) == n;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write checkpoint " << path << std::endl;
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_checkpoint(const std::string &path, RenderBuffer &buf, SamplerType sampler, uint64_t render_id) {
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file) return false;
+
+    char magic[8];
+    uint32_t header[4];
+    uint64_t file_id = 0;
+    if (fread(magic, sizeof(magic), 1, file) != 1 || memcmp(magic, checkpoint_magic, sizeof(magic))
+        || fread(header, sizeof(header), 1, file) != 1
+        || (header[0] == checkpoint_version && fread(&file_id, sizeof(file_id), 1, file) != 1)) {
+        std::cerr << path << " is not a checkpoint" << std::endl;
+        fclose(file);
+        return false;
+    }
+    if (header[0] != checkpoint_version || header[1] != uint32_t(sampler)
+        || int(header[2]) != buf.width || int(header[3]) != buf.height) {
+        std::cerr << "Checkpoint " << path << " is from a different render (" << header[2] << "x" << header[3]
+            << ", sampler " << header[1] << ")" << std::endl;
+        fclose(file);
+        return false;
+    }
+    if (file_id != render_id) {
+        std::cerr << "Checkpoint " << path << " is from a different scene or camera" << std::endl;
+        fclose(file);
+        return false;
+    }
+
+    size_t n = buf.sum.size();
+    std::vector<float> sums(3 * n);
+    std::vector<uint32_t> samples(n);
+    bool ok = fread(sums.data(), sizeof(float), sums.size(), file) == sums.size()
+        && fread(samples.data(), sizeof(uint32_t), n, file) == n;
+    fclose(file);
+    if (!ok) {
+        std::cerr << "Checkpoint " << path << " is truncated" << std::endl;
+        return false;
+    }
+
+    for (size_t i = 0; i < n; ++i) buf.sum[i] = {sums[3 * i], sums[3 * i + 1], sums[3 * i + 2]};
+    buf.samples = std::move(samples);
+    return true;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+
+#include "RenderBuffer.h"
+#include "Camera.h"
+#include "Sampler.h"
+
+// Binary snapshot of a render in progress: float radiance sums and per-pixel
+// sample counts. Samples are seeded from (pixel, sample index), so the counts
+// are all the sampler state needed to continue exactly where the render
+// stopped, or to add more samples to a finished one.
+//
+// layout: "CRAYCKPT", u32 version, u32 sampler, u32 width, u32 height,
+//         u64 render id, width * height * 3 f32 sums, width * height u32 sample counts
+
+// Hash of what the samples estimate: the scene name, the camera and options
+// that change the image (e.g. "radiance_cache=1"). spp is left out, so a
+// finished render can still be continued with more samples.
+uint64_t checkpoint_render_id(const std::string &scene_name, const Camera &cam, const std::string &options);
+
+// writes to a temporary file first and renames it over path, so a kill in
+// the middle of a save never leaves a torn checkpoint behind
+bool save_checkpoint(const std::string &path, const RenderBuffer &buf, SamplerType sampler, uint64_t render_id);
+// false if the file is missing, damaged or from an incompatible render.
+// Resuming with a different sampler, scene or camera would mix two images.
+bool load_checkpoint(const std::string &path, RenderBuffer &buf, SamplerType sampler, uint64_t render_id);
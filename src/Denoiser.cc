@@ -0,0 +1,107 @@
+#include <algorithm>
+
+#include "Denoiser.h"
+#include "Profiler.h"
+
+// keeps black albedo (and the demodulation) finite
+constexpr double albedo_eps = 0.02;
+
+// B3 spline
+static const double kernel[5] = {1 / 16.0, 1 / 4.0, 3 / 8.0, 1 / 4.0, 1 / 16.0};
+
+std::vector<Color> denoise(const std::vector<Color> &color, const AOVBuffer &features,
+                           const DenoiseSettings &settings) {
+    ScopedTimer timer{"denoise"};
+    int width = features.width, height = features.height;
+    int n = width * height;
+
+    std::vector<Color> demod(n), next(n);
+    std::vector<double> var(n), next_var(n);
+    for (int i = 0; i < n; ++i) {
+        Color a = features.albedo[i] + albedo_eps;
+        demod[i] = Color(color[i][0] / a[0], color[i][1] / a[1], color[i][2] / a[2]);
+        double la = luminance(a);
+        var[i] = features.variance[i] / (la * la);
+    }
+
+    // the variance from a few samples is itself noisy, blur it a little before
+    // using it to scale the colour weight
+    std::vector<double> var_blur(n);
+    auto blur_variance = [&]() {
+        #pragma omp parallel for schedule(dynamic, 4)
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                double sum = 0, weight_sum = 0;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int qx = x + dx, qy = y + dy;
+                        if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                        double w = kernel[dx + 2] * kernel[dy + 2];
+                        sum += w * var[qy * width + qx];
+                        weight_sum += w;
+                    }
+                }
+                var_blur[y * width + x] = sum / weight_sum;
+            }
+        }
+    };
+
+    for (int it = 0; it < settings.iterations; ++it) {
+        int step = 1 << it;
+        blur_variance();
+
+        #pragma omp parallel for schedule(dynamic, 4)
+        for (int y = 0; y < height; ++y) {
+            for (int x = 0; x < width; ++x) {
+                int p = y * width + x;
+                double lum_p = luminance(demod[p]);
+                double color_scale = settings.sigma_color * sqrt(var_blur[p]) + 1e-4;
+                const Vec3d &n_p = features.normal[p];
+                const Color &a_p = features.albedo[p];
+                double d_p = features.depth[p];
+
+                Color sum = 0;
+                double weight_sum = 0, var_sum = 0;
+                for (int dy = -2; dy <= 2; ++dy) {
+                    int qy = y + dy * step;
+                    if (qy < 0 || qy >= height) continue;
+                    for (int dx = -2; dx <= 2; ++dx) {
+                        int qx = x + dx * step;
+                        if (qx < 0 || qx >= width) continue;
+                        int q = qy * width + qx;
+
+                        const Vec3d &n_q = features.normal[q];
+                        double w_normal;
+                        if (n_p.sqrNorm() == 0 || n_q.sqrNorm() == 0) {
+                            // background only blends with background
+                            w_normal = n_p.sqrNorm() == n_q.sqrNorm() ? 1 : 0;
+                        } else {
+                            w_normal = pow(std::max(0.0, n_p.dot(n_q)), settings.sigma_normal);
+                        }
+                        if (w_normal == 0) continue;
+
+                        double d_q = features.depth[q];
+                        double e_depth = fabs(d_p - d_q) / (settings.sigma_depth * step * std::max(d_p, d_q) + 1e-6);
+                        double e_color = fabs(lum_p - luminance(demod[q])) / color_scale;
+                        double e_albedo = (a_p - features.albedo[q]).norm() / settings.sigma_albedo;
+
+                        double w = kernel[dx + 2] * kernel[dy + 2] * w_normal * exp(-(e_color + e_depth + e_albedo));
+                        sum = sum + demod[q] * w;
+                        weight_sum += w;
+                        var_sum += w * w * var[q];
+                    }
+                }
+
+                // the centre always has a weight
+                next[p] = sum * (1.0 / weight_sum);
+                next_var[p] = var_sum / (weight_sum * weight_sum);
+            }
+        }
+        demod.swap(next);
+        var.swap(next_var);
+    }
+
+    std::vector<Color> out(n);
+    for (int i = 0; i < n; ++i) out[i] = demod[i] * (features.albedo[i] + albedo_eps);
+    return out;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <vector>
+
+#include "MathUtils.h"
+#include "AOVBuffer.h"
+
+// Edge avoiding a-trous wavelet filter (Dammertz et al. 2010) guided by the
+// first hit features. The colour is divided by the albedo before filtering so
+// texture and material edges survive, and the colour weight is measured in
+// units of each pixel's estimated noise (as in SVGF), so pixels that have
+// already converged are left mostly alone.
+struct DenoiseSettings {
+    int iterations = 5;        // the filter footprint doubles every iteration
+    double sigma_color = 1;    // in standard deviations of the pixel's noise
+    double sigma_normal = 64;  // exponent on the normals' dot product
+    double sigma_depth = 0.02; // relative depth difference, per pixel of step
+    double sigma_albedo = 0.1;
+};
+
+// runs on all OpenMP threads
+std::vector<Color> denoise(const std::vector<Color> &color, const AOVBuffer &features,
+                           const DenoiseSettings &settings = DenoiseSettings{});
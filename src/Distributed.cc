@@ -0,0 +1,421 @@
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+
+#include "Distributed.h"
+
+// wire format: a 4 byte message type, a 4 byte payload size, then the payload.
+// Workers and coordinator are assumed to share endianness.
+enum MsgType : uint32_t { MSG_SETUP = 1, MSG_TASK, MSG_RESULT, MSG_QUIT, MSG_ERROR };
+
+namespace {
+
+struct Packet {
+    std::vector<char> data;
+    size_t read_pos = 0;
+
+    template<typename T>
+    void put(const T &t) {
+        const char *p = reinterpret_cast<const char *>(&t);
+        data.insert(data.end(), p, p + sizeof(T));
+    }
+
+    void put_string(const std::string &s) {
+        put(uint32_t(s.size()));
+        data.insert(data.end(), s.begin(), s.end());
+    }
+
+    void put_bytes(const void *p, size_t n) {
+        const char *c = static_cast<const char *>(p);
+        data.insert(data.end(), c, c + n);
+    }
+
+    template<typename T>
+    bool get(T &t) { return get_bytes(&t, sizeof(T)); }
+
+    bool get_string(std::string &s) {
+        uint32_t n;
+        if (!get(n) || read_pos + n > data.size()) return false;
+        s.assign(data.begin() + read_pos, data.begin() + read_pos + n);
+        read_pos += n;
+        return true;
+    }
+
+    bool get_bytes(void *p, size_t n) {
+        if (read_pos + n > data.size()) return false;
+        memcpy(p, data.data() + read_pos, n);
+        read_pos += n;
+        return true;
+    }
+};
+
+bool write_all(int fd, const void *buf, size_t n) {
+    const char *p = static_cast<const char *>(buf);
+    while (n > 0) {
+        ssize_t w = write(fd, p, n);
+        if (w < 0 && errno == EINTR) continue;
+        if (w <= 0) return false;
+        p += w;
+        n -= w;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *buf, size_t n) {
+    char *p = static_cast<char *>(buf);
+    while (n > 0) {
+        ssize_t r = read(fd, p, n);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) return false;
+        p += r;
+        n -= r;
+    }
+    return true;
+}
+
+bool send_msg(int fd, MsgType type, const Packet &p) {
+    uint32_t header[2] = {type, uint32_t(p.data.size())};
+    return write_all(fd, header, sizeof(header)) && write_all(fd, p.data.data(), p.data.size());
+}
+
+bool recv_msg(int fd, MsgType &type, Packet &p) {
+    uint32_t header[2];
+    if (!read_all(fd, header, sizeof(header))) return false;
+    type = MsgType(header[0]);
+    p.data.resize(header[1]);
+    p.read_pos = 0;
+    return read_all(fd, p.data.data(), p.data.size());
+}
+
+void put_task(Packet &p, const RenderTask &t) {
+    p.put(t.id);
+    p.put(t.x0); p.put(t.y0); p.put(t.x1); p.put(t.y1);
+    p.put(t.first_sample); p.put(t.num_samples);
+}
+
+bool get_task(Packet &p, RenderTask &t) {
+    return p.get(t.id) && p.get(t.x0) && p.get(t.y0) && p.get(t.x1) && p.get(t.y1)
+        && p.get(t.first_sample) && p.get(t.num_samples);
+}
+
+void put_vec(Packet &p, const Vec3d &v) {
+    for (int i = 0; i < 3; ++i) p.put(v[i]);
+}
+
+bool get_vec(Packet &p, Vec3d &v) {
+    return p.get(v[0]) && p.get(v[1]) && p.get(v[2]);
+}
+
+// tasks not yet handed out, plus bookkeeping so a task from a dead worker
+// is picked up by one still alive
+struct TaskQueue {
+    std::deque<RenderTask> pending;
+    int unfinished;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    TaskQueue(const std::vector<RenderTask> &tasks):
+        pending(tasks.begin(), tasks.end()), unfinished(tasks.size()) {}
+
+    bool pop(RenderTask &t) {
+        std::unique_lock<std::mutex> lock{mtx};
+        cv.wait(lock, [this]{ return !pending.empty() || unfinished == 0; });
+        if (pending.empty()) return false;
+        t = pending.front();
+        pending.pop_front();
+        return true;
+    }
+
+    int done() {
+        std::lock_guard<std::mutex> lock{mtx};
+        --unfinished;
+        cv.notify_all();
+        return unfinished;
+    }
+
+    void failed(const RenderTask &t) {
+        std::lock_guard<std::mutex> lock{mtx};
+        pending.push_front(t);
+        cv.notify_all();
+    }
+};
+
+void serve_worker(WorkerConnection &w, const Packet &setup, TaskQueue &queue,
+                  RenderBuffer &out, std::mutex &out_mtx, int total_tasks) {
+    if (!send_msg(w.fd, MSG_SETUP, setup)) return;
+
+    RenderTask task;
+    while (queue.pop(task)) {
+        Packet req, res;
+        MsgType type = MSG_QUIT;
+        put_task(req, task);
+        if (!send_msg(w.fd, MSG_TASK, req) || !recv_msg(w.fd, type, res) || type != MSG_RESULT) {
+            if (type == MSG_ERROR) {
+                std::string msg;
+                res.get_string(msg);
+                std::cerr << "worker error: " << msg << std::endl;
+            }
+            std::cerr << "lost worker on fd " << w.fd << ", requeueing task " << task.id << std::endl;
+            queue.failed(task);
+            return;
+        }
+
+        int w_px = task.x1 - task.x0, h_px = task.y1 - task.y0;
+        RenderBuffer tile{w_px, h_px};
+        std::vector<double> sums(3 * w_px * h_px);
+        int id;
+        if (!res.get(id) || !res.get_bytes(sums.data(), sums.size() * sizeof(double))
+            || !res.get_bytes(tile.samples.data(), tile.samples.size() * sizeof(uint32_t))) {
+            std::cerr << "malformed result for task " << task.id << std::endl;
+            queue.failed(task);
+            return;
+        }
+        if (id != task.id) {
+            // the worker is out of step with us, nothing more it sends can be trusted
+            std::cerr << "result for task " << id << " while waiting for task " << task.id << ", requeueing it" << std::endl;
+            queue.failed(task);
+            return;
+        }
+        for (int i = 0; i < w_px * h_px; ++i) tile.sum[i] = {sums[3 * i], sums[3 * i + 1], sums[3 * i + 2]};
+
+        {
+            std::lock_guard<std::mutex> lock{out_mtx};
+            out.merge(tile, task.x0, task.y0);
+        }
+        int left = queue.done();
+        if (left % std::max(1, total_tasks / 10) == 0) std::cout << total_tasks - left << "/" << total_tasks << " tasks" << std::endl;
+    }
+}
+
+} // namespace
+
+std::vector<RenderTask> split_frame(int width, int height, int spp, int tile_size, int sample_chunk) {
+    if (sample_chunk <= 0) sample_chunk = spp;
+
+    std::vector<RenderTask> tasks;
+    for (int first = 0; first < spp; first += sample_chunk) {
+        for (int y = 0; y < height; y += tile_size) {
+            for (int x = 0; x < width; x += tile_size) {
+                RenderTask t;
+                t.id = tasks.size();
+                t.x0 = x;
+                t.y0 = y;
+                t.x1 = std::min(x + tile_size, width);
+                t.y1 = std::min(y + tile_size, height);
+                t.first_sample = first;
+                t.num_samples = std::min(sample_chunk, spp - first);
+                tasks.push_back(t);
+            }
+        }
+    }
+    return tasks;
+}
+
+int run_worker(int fd, const SceneRegistry &scenes) {
+    std::unique_ptr<Scene> scene;
+    std::unique_ptr<Camera> cam;
+
+    while (true) {
+        Packet msg;
+        MsgType type;
+        if (!recv_msg(fd, type, msg)) return 1; // coordinator went away
+
+        if (type == MSG_QUIT) {
+            return 0;
+        } else if (type == MSG_SETUP) {
+            std::string name;
+            int width, height, spp;
+            uint32_t sampler, radiance_cache, env_storage;
+            uint64_t texture_cache_bytes, mesh_budget_bytes;
+            double fov;
+            Vec3d origin, dir;
+            if (!msg.get_string(name) || !msg.get(width) || !msg.get(height) || !msg.get(fov)
+                || !msg.get(spp) || !msg.get(sampler) || !msg.get(radiance_cache)
+                || !msg.get(env_storage) || env_storage > uint32_t(EnvStorage::RGBE)
+                || !msg.get(texture_cache_bytes) || !msg.get(mesh_budget_bytes)
+                || !get_vec(msg, origin) || !get_vec(msg, dir)) return 1;
+
+            auto it = scenes.find(name);
+            if (it == scenes.end()) {
+                Packet err;
+                err.put_string("unknown scene " + name);
+                send_msg(fd, MSG_ERROR, err);
+                return 1;
+            }
+            scene.reset(new Scene(it->second(EnvStorage(env_storage))));
+            scene->samples = spp;
+            scene->sampler_type = SamplerType(sampler);
+            scene->textures->set_budget(texture_cache_bytes);
+            if (mesh_budget_bytes) scene->set_mesh_budget(mesh_budget_bytes);
+            cam.reset(new Camera(width, height, fov));
+            cam->move(origin, dir);
+            if (radiance_cache) {
+                scene->use_radiance_cache = true;
+                scene->build_radiance_cache(*cam);
+            }
+        } else if (type == MSG_TASK) {
+            RenderTask t;
+            if (!scene || !get_task(msg, t)) return 1;
+
+            RenderBuffer buf = scene->render_region(*cam, t.x0, t.y0, t.x1, t.y1, t.first_sample, t.num_samples);
+            std::vector<double> sums(3 * buf.sum.size());
+            for (size_t i = 0; i < buf.sum.size(); ++i) {
+                for (int c = 0; c < 3; ++c) sums[3 * i + c] = buf.sum[i][c];
+            }
+
+            Packet res;
+            res.put(t.id);
+            res.put_bytes(sums.data(), sums.size() * sizeof(double));
+            res.put_bytes(buf.samples.data(), buf.samples.size() * sizeof(uint32_t));
+            if (!send_msg(fd, MSG_RESULT, res)) return 1;
+        }
+    }
+}
+
+int run_worker_server(int port, const SceneRegistry &scenes) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        std::cerr << "cannot create socket: " << strerror(errno) << std::endl;
+        return 1;
+    }
+    int yes = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(sock, 1) < 0) {
+        std::cerr << "cannot listen on port " << port << ": " << strerror(errno) << std::endl;
+        close(sock);
+        return 1;
+    }
+    std::cout << "worker listening on port " << port << std::endl;
+
+    while (true) {
+        int fd = accept(sock, nullptr, nullptr);
+        if (fd < 0) continue;
+        run_worker(fd, scenes);
+        close(fd);
+    }
+}
+
+std::vector<WorkerConnection> spawn_local_workers(int n) {
+    std::vector<WorkerConnection> workers;
+    if (n <= 0) return workers;
+    // the workers share this machine, split the cores between them
+    std::string threads = std::to_string(std::max(1, int(std::thread::hardware_concurrency()) / n));
+
+    for (int i = 0; i < n; ++i) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) break;
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(fds[0]);
+            if (!getenv("OMP_NUM_THREADS")) setenv("OMP_NUM_THREADS", threads.c_str(), 1);
+            std::string fd_arg = std::to_string(fds[1]);
+            execl("/proc/self/exe", "main", "--worker-fd", fd_arg.c_str(), (char *)nullptr);
+            _exit(127);
+        }
+        close(fds[1]);
+        if (pid < 0) {
+            close(fds[0]);
+            break;
+        }
+        WorkerConnection conn;
+        conn.fd = fds[0];
+        conn.pid = pid;
+        workers.push_back(conn);
+    }
+    return workers;
+}
+
+bool connect_worker(const std::string &host_port, WorkerConnection &conn) {
+    size_t colon = host_port.rfind(':');
+    if (colon == std::string::npos) return false;
+    std::string host = host_port.substr(0, colon), port = host_port.substr(colon + 1);
+
+    addrinfo hints{}, *res;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) return false;
+
+    int fd = -1;
+    for (addrinfo *ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd >= 0 && connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd < 0) return false;
+
+    conn.fd = fd;
+    conn.pid = -1;
+    return true;
+}
+
+void close_workers(std::vector<WorkerConnection> &workers) {
+    for (auto &w : workers) {
+        send_msg(w.fd, MSG_QUIT, Packet{});
+        close(w.fd);
+        if (w.pid > 0) waitpid(w.pid, nullptr, 0);
+    }
+    workers.clear();
+}
+
+bool render_distributed(const std::string &scene_name, const Camera &cam, int spp, SamplerType sampler,
+                        bool radiance_cache, EnvStorage env_storage, size_t texture_cache_bytes, size_t mesh_budget_bytes,
+                        std::vector<WorkerConnection> &workers, RenderBuffer &out,
+                        int tile_size, int sample_chunk) {
+    // a dead worker should show up as a failed write, not kill the coordinator
+    signal(SIGPIPE, SIG_IGN);
+
+    int width = cam.get_width(), height = cam.get_height();
+    out = RenderBuffer{width, height};
+
+    Packet setup;
+    setup.put_string(scene_name);
+    setup.put(width);
+    setup.put(height);
+    setup.put(cam.get_fov());
+    setup.put(spp);
+    setup.put(uint32_t(sampler));
+    setup.put(uint32_t(radiance_cache));
+    setup.put(uint32_t(env_storage));
+    setup.put(uint64_t(texture_cache_bytes));
+    setup.put(uint64_t(mesh_budget_bytes));
+    put_vec(setup, cam.get_origin());
+    put_vec(setup, cam.get_dir());
+
+    std::vector<RenderTask> tasks = split_frame(width, height, spp, tile_size, sample_chunk);
+    TaskQueue queue{tasks};
+    std::mutex out_mtx;
+
+    std::vector<std::thread> threads;
+    for (auto &w : workers) {
+        threads.emplace_back(serve_worker, std::ref(w), std::cref(setup), std::ref(queue),
+                             std::ref(out), std::ref(out_mtx), int(tasks.size()));
+    }
+    for (auto &t : threads) t.join();
+
+    if (queue.unfinished) {
+        std::cerr << queue.unfinished << " tasks were not rendered, no workers left" << std::endl;
+        return false;
+    }
+    return true;
+}
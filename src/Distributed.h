@@ -0,0 +1,56 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+
+#include "Camera.h"
+#include "Raycaster.h"
+#include "RenderBuffer.h"
+
+// Splits frames across worker processes. A coordinator hands out tiles and
+// sample ranges, the workers send back double sums with sample counts and the
+// coordinator merges them. Workers are either forked locally (connected with a
+// socketpair) or started on other hosts with --worker-listen and connected
+// to over TCP; both look the same once the socket is open.
+
+// scenes are rebuilt by name inside each worker, with their environment
+// (if any) loaded in the given storage
+typedef std::map<std::string, Scene (*)(EnvStorage)> SceneRegistry;
+
+struct RenderTask {
+    int id;
+    int x0, y0, x1, y1;
+    int first_sample, num_samples;
+};
+
+struct WorkerConnection {
+    int fd;
+    pid_t pid = -1; // only set for local workers
+};
+
+// tiles of tile_size^2 pixels, each split into ranges of sample_chunk samples
+// (sample_chunk <= 0 keeps all samples of a tile in one task)
+std::vector<RenderTask> split_frame(int width, int height, int spp, int tile_size, int sample_chunk);
+
+// serves one coordinator on fd until it says quit, returns the exit code
+int run_worker(int fd, const SceneRegistry &scenes);
+// blocks until a coordinator connects to port, serves it, repeats
+int run_worker_server(int port, const SceneRegistry &scenes);
+
+// re-executes this binary n times with --worker-fd
+std::vector<WorkerConnection> spawn_local_workers(int n);
+// host:port of a worker started with --worker-listen
+bool connect_worker(const std::string &host_port, WorkerConnection &conn);
+// tells the workers to quit and reaps local ones
+void close_workers(std::vector<WorkerConnection> &workers);
+
+// false if the workers died before every task was rendered. With
+// radiance_cache every worker builds the same cache for the frame. The
+// texture cache and mesh residency budgets apply to each worker's scene
+// (a mesh budget of 0 keeps meshes resident).
+bool render_distributed(const std::string &scene_name, const Camera &cam, int spp, SamplerType sampler,
+                        bool radiance_cache, EnvStorage env_storage, size_t texture_cache_bytes, size_t mesh_budget_bytes,
+                        std::vector<WorkerConnection> &workers, RenderBuffer &out,
+                        int tile_size = 64, int sample_chunk = 0);
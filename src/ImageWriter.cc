@@ -0,0 +1,283 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <algorithm>
+#include <iostream>
+
+#include "ImageWriter.h"
+#include "Profiler.h"
+
+ImageFormat image_format_from_filename(const std::string &filename) {
+    std::string ext = filename.substr(filename.find_last_of('.') + 1);
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext == "pfm") return ImageFormat::PFM;
+    if (ext == "exr") return ImageFormat::EXR;
+    return ImageFormat::BMP;
+}
+
+// Exposure and gamma over a flat array, into floats for the float formats
+// and doubles for BMP. Plain loops over contiguous values so the compiler
+// can vectorize them.
+template<typename T>
+static void tone_map_span(const double *src, T *out, int n, const ToneMap &tm) {
+    T exposure = tm.exposure;
+    for (int i = 0; i < n; ++i) out[i] = src[i] * exposure;
+
+    if (tm.gamma != 1) {
+        T inv_gamma = 1.0 / tm.gamma;
+        for (int i = 0; i < n; ++i) out[i] = std::pow(std::max(out[i], T(0)), inv_gamma);
+    }
+}
+
+static std::vector<float> tone_map_pixels(const Color *pixels, int n, const ToneMap &tm) {
+    std::vector<float> out(3 * n);
+    tone_map_span(&pixels[0][0], out.data(), 3 * n, tm); // Color is 3 packed doubles
+    return out;
+}
+
+static void put16(std::vector<unsigned char> &buf, uint16_t v) {
+    buf.push_back(v & 0xff);
+    buf.push_back(v >> 8);
+}
+
+static void put32(std::vector<unsigned char> &buf, uint32_t v) {
+    for (int i = 0; i < 4; ++i) buf.push_back((v >> (8 * i)) & 0xff);
+}
+
+static void put_str(std::vector<unsigned char> &buf, const char *s) {
+    buf.insert(buf.end(), s, s + strlen(s) + 1); // with the null terminator
+}
+
+static void put_bytes(std::vector<unsigned char> &buf, const void *data, size_t n) {
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    buf.insert(buf.end(), p, p + n);
+}
+
+static std::vector<unsigned char> encode_bmp(int width, int height, const Color *pixels, const ToneMap &tm) {
+    // rows must be a multiple of 4 bytes
+    int row_size = (width * 3 + 3) & ~3;
+    int paddedsize = row_size * height;
+
+    std::vector<unsigned char> buf;
+    buf.reserve(54 + paddedsize);
+    buf.push_back('B');
+    buf.push_back('M');
+    put32(buf, paddedsize + 54); // bfSize (whole file size)
+    put32(buf, 0);               // bfReserved (both)
+    put32(buf, 54);              // bfOffbits
+    put32(buf, 40);              // biSize
+    put32(buf, width);           // biWidth
+    put32(buf, height);          // biHeight
+    put16(buf, 1);               // biPlanes
+    put16(buf, 24);              // biBitCount
+    put32(buf, 0);               // biCompression
+    put32(buf, paddedsize);      // biSizeImage
+    put32(buf, 0);               // biXPelsPerMeter
+    put32(buf, 0);               // biYPelsPerMeter
+    put32(buf, 0);               // biClrUsed
+    put32(buf, 0);               // biClrImportant
+
+    buf.resize(54 + paddedsize);
+    std::vector<double> rgb(3 * width);
+    std::vector<unsigned char> q(3 * width);
+
+    unsigned char *row = buf.data() + 54;
+    // BMP image format is written from bottom to top, in (b,g,r) order
+    for (int y = height - 1; y >= 0; --y, row += row_size) {
+        tone_map_span(&pixels[y * width][0], rgb.data(), 3 * width, tm);
+        // quantize the whole row at once, in double and truncating like the old
+        // per-pixel writer did, so the bytes are the same
+        for (int i = 0; i < 3 * width; ++i) q[i] = std::min(std::max(rgb[i] * 255, 0.), 255.);
+        for (int x = 0; x < width; ++x) {
+            row[3 * x + 0] = q[3 * x + 2];
+            row[3 * x + 1] = q[3 * x + 1];
+            row[3 * x + 2] = q[3 * x + 0];
+        }
+        std::fill(row + 3 * width, row + row_size, 0);
+    }
+    return buf;
+}
+
+static std::vector<unsigned char> encode_pfm(int width, int height, const std::vector<float> &rgb) {
+    char header[64];
+    // negative scale means little endian
+    int header_len = snprintf(header, sizeof(header), "PF\n%d %d\n-1.0\n", width, height);
+
+    std::vector<unsigned char> buf;
+    buf.reserve(header_len + rgb.size() * sizeof(float));
+    put_bytes(buf, header, header_len);
+    // also stored bottom to top
+    for (int y = height - 1; y >= 0; --y) put_bytes(buf, &rgb[3 * y * width], 3 * width * sizeof(float));
+    return buf;
+}
+
+static void put_attr(std::vector<unsigned char> &buf, const char *name, const char *type, uint32_t size) {
+    put_str(buf, name);
+    put_str(buf, type);
+    put32(buf, size);
+}
+
+// a channel of interleaved pixel data
+struct ExrChannel {
+    std::string name;
+    const float *data;
+    int stride;
+};
+
+// Uncompressed scanline OpenEXR, half or full float
+static std::vector<unsigned char> encode_exr(int width, int height, std::vector<ExrChannel> channels, bool half) {
+    // channels have to be listed alphabetically
+    std::sort(channels.begin(), channels.end(),
+              [](const ExrChannel &a, const ExrChannel &b) { return a.name < b.name; });
+
+    std::vector<unsigned char> buf;
+    put32(buf, 20000630); // magic
+    put32(buf, 2);        // version 2, single part scanline
+
+    uint32_t chlist_size = 1;
+    for (auto &c : channels) chlist_size += c.name.size() + 1 + 16;
+    put_attr(buf, "channels", "chlist", chlist_size);
+    for (auto &c : channels) {
+        put_str(buf, c.name.c_str());
+        put32(buf, half ? 1 : 2); // HALF or FLOAT
+        put32(buf, 0); // pLinear + reserved
+        put32(buf, 1); // x sampling
+        put32(buf, 1); // y sampling
+    }
+    buf.push_back(0);
+
+    put_attr(buf, "compression", "compression", 1);
+    buf.push_back(0); // NO_COMPRESSION
+
+    for (const char *window : {"dataWindow", "displayWindow"}) {
+        put_attr(buf, window, "box2i", 16);
+        put32(buf, 0);
+        put32(buf, 0);
+        put32(buf, width - 1);
+        put32(buf, height - 1);
+    }
+
+    put_attr(buf, "lineOrder", "lineOrder", 1);
+    buf.push_back(0); // INCREASING_Y
+
+    float one = 1, zero = 0;
+    put_attr(buf, "pixelAspectRatio", "float", 4);
+    put_bytes(buf, &one, 4);
+    put_attr(buf, "screenWindowCenter", "v2f", 8);
+    put_bytes(buf, &zero, 4);
+    put_bytes(buf, &zero, 4);
+    put_attr(buf, "screenWindowWidth", "float", 4);
+    put_bytes(buf, &one, 4);
+    buf.push_back(0); // end of header
+
+    // offset table, one scanline per block without compression
+    uint32_t line_bytes = channels.size() * width * (half ? 2 : 4);
+    uint64_t first_block = buf.size() + 8 * uint64_t(height);
+    for (int y = 0; y < height; ++y) {
+        uint64_t offset = first_block + y * uint64_t(8 + line_bytes);
+        put32(buf, offset & 0xffffffff);
+        put32(buf, offset >> 32);
+    }
+
+    buf.reserve(buf.size() + height * (8 + line_bytes));
+    for (int y = 0; y < height; ++y) {
+        put32(buf, y);
+        put32(buf, line_bytes);
+        for (auto &c : channels) {
+            const float *row = c.data + size_t(y) * width * c.stride;
+            for (int x = 0; x < width; ++x) {
+                if (half) put16(buf, float_to_half(row[x * c.stride]));
+                else put_bytes(buf, &row[x * c.stride], 4);
+            }
+        }
+    }
+    return buf;
+}
+
+static bool write_file(const std::string &filename, const std::vector<unsigned char> &file) {
+    FILE *outfile = fopen(filename.c_str(), "wb");
+    if (!outfile) {
+        std::cerr << "Cannot open " << filename << " for writing" << std::endl;
+        return false;
+    }
+    bool ok = fwrite(file.data(), 1, file.size(), outfile) == file.size();
+    ok = fclose(outfile) == 0 && ok;
+    if (!ok) std::cerr << "Cannot write " << filename << std::endl;
+    return ok;
+}
+
+bool write_image(const std::string &filename, int width, int height,
+                 const Color *pixels, const ToneMap &tone_map) {
+    ScopedTimer timer{"write image"};
+    ImageFormat format = image_format_from_filename(filename);
+
+    std::vector<unsigned char> file;
+    if (format == ImageFormat::BMP) {
+        file = encode_bmp(width, height, pixels, tone_map);
+    } else {
+        // float formats keep linear radiance, only the exposure is applied
+        ToneMap linear{tone_map.exposure, 1};
+        std::vector<float> rgb = tone_map_pixels(pixels, width * height, linear);
+        if (format == ImageFormat::PFM) {
+            file = encode_pfm(width, height, rgb);
+        } else {
+            file = encode_exr(width, height, {{"R", &rgb[0], 3}, {"G", &rgb[1], 3}, {"B", &rgb[2], 3}}, true);
+        }
+    }
+    return write_file(filename, file);
+}
+
+bool write_exr_channels(const std::string &filename, int width, int height,
+                        const std::vector<ImageChannel> &channels) {
+    std::vector<ExrChannel> exr;
+    for (auto &c : channels) exr.push_back(ExrChannel{c.name, c.data.data(), 1});
+    return write_file(filename, encode_exr(width, height, exr, false));
+}
+
+AsyncImageWriter::AsyncImageWriter(): worker{&AsyncImageWriter::run, this} {}
+
+AsyncImageWriter::~AsyncImageWriter() {
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        stopping = true;
+    }
+    cv.notify_all();
+    worker.join();
+    if (!failed.empty()) {
+        std::cerr << failed.size() << " images were not written, the first was " << failed[0] << std::endl;
+    }
+}
+
+void AsyncImageWriter::submit(const std::string &filename, int width, int height,
+                              std::vector<Color> pixels, const ToneMap &tone_map) {
+    {
+        std::lock_guard<std::mutex> lock{mtx};
+        jobs.push(Job{filename, width, height, std::move(pixels), tone_map});
+        ++in_flight;
+    }
+    cv.notify_all();
+}
+
+bool AsyncImageWriter::flush() {
+    std::unique_lock<std::mutex> lock{mtx};
+    cv.wait(lock, [this]{ return in_flight == 0; });
+    return failed.empty();
+}
+
+void AsyncImageWriter::run() {
+    std::unique_lock<std::mutex> lock{mtx};
+    while (true) {
+        cv.wait(lock, [this]{ return stopping || !jobs.empty(); });
+        if (jobs.empty()) return; // stopping and drained
+
+        Job job = std::move(jobs.front());
+        jobs.pop();
+        lock.unlock();
+        bool ok = write_image(job.filename, job.width, job.height, job.pixels.data(), job.tone_map);
+        lock.lock();
+        if (!ok) failed.push_back(job.filename);
+
+        --in_flight;
+        cv.notify_all();
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+#include "MathUtils.h"
+
+// BMP is 8 bit and tone mapped, PFM and EXR keep the raw float radiance so the
+// exposure can be changed without re-rendering
+enum class ImageFormat { BMP, PFM, EXR };
+
+struct ToneMap {
+    double exposure = 1;
+    double gamma = 1;
+};
+
+// picks the format from the file extension, defaults to BMP
+ImageFormat image_format_from_filename(const std::string &filename);
+
+// encodes the whole file into memory, then writes it with a single fwrite
+bool write_image(const std::string &filename, int width, int height,
+                 const Color *pixels, const ToneMap &tone_map = ToneMap{});
+
+// one float channel of a multi channel EXR
+struct ImageChannel {
+    std::string name;
+    std::vector<float> data; // width * height, top row first
+};
+
+// Uncompressed 32 bit float EXR with any set of channels, e.g. a beauty pass
+// in R, G, B with extra layers named like "albedo.R"
+bool write_exr_channels(const std::string &filename, int width, int height,
+                        const std::vector<ImageChannel> &channels);
+
+// Encodes and writes images on a background thread so the render threads don't
+// wait on the disk. The pixels are moved into the queue.
+class AsyncImageWriter {
+    struct Job {
+        std::string filename;
+        int width, height;
+        std::vector<Color> pixels;
+        ToneMap tone_map;
+    };
+
+    std::queue<Job> jobs;
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool stopping = false;
+    int in_flight = 0;
+    std::vector<std::string> failed; // files write_image returned false for
+    std::thread worker;
+
+public:
+    AsyncImageWriter();
+    ~AsyncImageWriter(); // flushes remaining jobs, reports any failed writes
+
+    void submit(const std::string &filename, int width, int height,
+                std::vector<Color> pixels, const ToneMap &tone_map = ToneMap{});
+    // blocks until the queue is empty, false if any write so far failed
+    bool flush();
+
+private:
+    void run();
+};
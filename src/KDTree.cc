@@ -3,10 +3,14 @@
 #include <memory>
 #include <algorithm>
 #include <queue>
+#include <iostream>
 
 #include "MathUtils.h"
 #include "Object.h"
 #include "KDTree.h"
+#include "MeshPager.h"
+#include "TraversalStats.h"
+#include "Profiler.h"
 
 BBox::BBox(const std::vector<Vec3d> &points) {
     min = points.at(0);
@@ -20,7 +24,12 @@ BBox::BBox(const std::vector<Vec3d> &points) {
     }
 }
 
-bool BBox::intersect(const Vec3d &ray_orig, const Vec3d &ray_dir, double &dist){
+double BBox::surface_area() const {
+    Vec3d d = max - min;
+    return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+}
+
+bool BBox::intersect(const Vec3d &ray_orig, const Vec3d &ray_dir, double &dist) const {
     double tmin = (min[0] - ray_orig[0]) / ray_dir[0]; 
     double tmax = (max[0] - ray_orig[0]) / ray_dir[0]; 
 
@@ -59,45 +68,59 @@ bool BBox::intersect(const Vec3d &ray_orig, const Vec3d &ray_dir, double &dist){
     return true; 
 }
 
-KDTree::KDTree(std::vector<Vec3d> *mesh_verts, std::vector<std::array<int, 3>> *mesh_tris):
+KDTree::KDTree(const PositionArray *mesh_verts, ArrayView<std::array<int, 3>> mesh_tris):
     mesh_verts{mesh_verts}, mesh_tris{mesh_tris}
 {
-    centroids.reserve(mesh_tris->size());
-    for(uint i = 0; i < mesh_tris->size(); i++){
+    ScopedTimer timer{"kd build"};
+    centroids.reserve(mesh_tris.size());
+    for(uint i = 0; i < mesh_tris.size(); i++){
         Vec3d centroid = {0,0,0};
-        for(int j = 0; j < 3; j++) centroid = centroid + (*mesh_verts)[(*mesh_tris)[i][j]];
+        for(int j = 0; j < 3; j++) centroid = centroid + (*mesh_verts)[mesh_tris[i][j]];
         centroid = centroid * (1. / 3.);
         
         centroids.push_back(centroid);
     }
 
     
-    std::vector<int> tri_indices(mesh_tris->size());
-    for(uint i = 0; i < mesh_tris->size(); i++) tri_indices[i] = i;
-    root = build_tree(tri_indices, 0);
+    std::vector<int> tri_indices(mesh_tris.size());
+    for(uint i = 0; i < mesh_tris.size(); i++) tri_indices[i] = i;
+    build_tree(tri_indices, 0);
+    std::vector<Vec3d>().swap(centroids);
+    node_storage.shrink_to_fit();
+    leaf_tri_storage.shrink_to_fit();
+    nodes = node_storage;
+    leaf_tris = leaf_tri_storage;
 }
 
+KDTree::KDTree(const PositionArray *mesh_verts, ArrayView<std::array<int, 3>> mesh_tris,
+               ArrayView<Node> nodes, ArrayView<int> leaf_tris):
+    mesh_verts{mesh_verts}, mesh_tris{mesh_tris}, nodes{nodes}, leaf_tris{leaf_tris} {}
+
 BBox KDTree::build_bbox(const std::vector<int> &tri_indices){
     std::vector<Vec3d> points;
     points.reserve(tri_indices.size() * 3);
     for(int i : tri_indices){
-        for(int j = 0; j < 3; ++j) points.push_back((*mesh_verts)[(*mesh_tris)[i][j]]);
+        for(int j = 0; j < 3; ++j) points.push_back((*mesh_verts)[mesh_tris[i][j]]);
     }
 
     return BBox(points);
 }
 
-std::unique_ptr<KDTree::Node> KDTree::build_tree(std::vector<int> &tri_indices, int depth){
+// index of the new node, -1 for no triangles
+int KDTree::build_tree(std::vector<int> &tri_indices, int depth){
     int axis = depth % 3;
 
-    if(tri_indices.size() == 0) return nullptr;
+    if(tri_indices.size() == 0) return -1;
     
     // create node
-    std::unique_ptr<Node> node = std::make_unique<Node>(build_bbox(tri_indices));
+    int node = node_storage.size();
+    node_storage.emplace_back(build_bbox(tri_indices));
 
     // if leaf node
     if(tri_indices.size() <= leaf_node_size){
-        node->tri_indices = tri_indices;
+        node_storage[node].first = leaf_tri_storage.size();
+        node_storage[node].count = tri_indices.size();
+        leaf_tri_storage.insert(leaf_tri_storage.end(), tri_indices.begin(), tri_indices.end());
         return node;
     }
 
@@ -105,15 +128,17 @@ std::unique_ptr<KDTree::Node> KDTree::build_tree(std::vector<int> &tri_indices,
     std::sort(tri_indices.begin(), tri_indices.end(), 
         [&](const int &a, const int &b)
         { 
-        return centroids[a][axis] > centroids[a][axis]; 
+        return centroids[a][axis] > centroids[b][axis]; 
         });
 
     int midpoint = tri_indices.size() / 2;
     std::vector<int> lower = std::vector<int>(tri_indices.begin(), tri_indices.begin() + midpoint);
     std::vector<int> upper = std::vector<int>(tri_indices.begin() + midpoint, tri_indices.end());
 
-    node->left = build_tree(lower, depth + 1);
-    node->right = build_tree(upper, depth + 1);
+    int left = build_tree(lower, depth + 1);
+    int right = build_tree(upper, depth + 1);
+    node_storage[node].left = left;
+    node_storage[node].right = right;
 
     return node;
 }
@@ -125,9 +150,9 @@ bool KDTree::ray_triangle_intersection(const Vec3d &ray_orig,
                                      Vec3d &hit_loc) const
 {
     // Möller–Trumbore intersection algorithm from Wikipedia
-    const Vec3d &vertex0 = (*mesh_verts)[(*mesh_tris)[tri_index][0]];
-    const Vec3d &vertex1 = (*mesh_verts)[(*mesh_tris)[tri_index][1]];  
-    const Vec3d &vertex2 = (*mesh_verts)[(*mesh_tris)[tri_index][2]];
+    const Vec3d vertex0 = (*mesh_verts)[mesh_tris[tri_index][0]];
+    const Vec3d vertex1 = (*mesh_verts)[mesh_tris[tri_index][1]];  
+    const Vec3d vertex2 = (*mesh_verts)[mesh_tris[tri_index][2]];
     Vec3d edge1 = vertex1 - vertex0, edge2 = vertex2 - vertex0;
     Vec3d h, s, q;
     double a,f,u,v;
@@ -161,7 +186,7 @@ int KDTree::ray_intersect(const Vec3d &ray_orig,
                           double &dist,
                           Vec3d &hit_loc) const
 {
-    return ray_intersect_recursive(ray_orig, ray_dir, dist, hit_loc, root);
+    return ray_intersect_recursive(ray_orig, ray_dir, dist, hit_loc, nodes.empty() ? -1 : 0);
 }
 
 
@@ -172,17 +197,18 @@ int KDTree::ray_intersect_iterative(const Vec3d &ray_orig,
                                     Vec3d &hit_loc) const
 {
     double tmp_dist = 0;
-    if(!root || !(root->bbox.intersect(ray_orig, ray_dir, tmp_dist))) return -1;
+    if(nodes.empty() || !(nodes[0].bbox.intersect(ray_orig, ray_dir, tmp_dist))) return -1;
     std::priority_queue<QueueElement, std::vector<QueueElement>> heap;
-    heap.emplace(root.get(), tmp_dist);
+    heap.emplace(0, tmp_dist);
 
     while (!heap.empty()) {
-        const Node *n = heap.top().n; 
+        const Node *n = &nodes[heap.top().n]; 
         heap.pop();
 
-        if (n->tri_indices.size()) {
+        if (n->count) {
             int closest_tri = -1;
-            for (int tri_index : n->tri_indices) {
+            for (int i = n->first; i < n->first + n->count; ++i) {
+                int tri_index = leaf_tris[i];
                 double tmp_dist;
                 Vec3d tmp_hit_loc;
                 if(ray_triangle_intersection(ray_orig, ray_dir, tri_index, tmp_dist, tmp_hit_loc)){
@@ -196,11 +222,11 @@ int KDTree::ray_intersect_iterative(const Vec3d &ray_orig,
             if (closest_tri != -1) return closest_tri;
         } else {
             double tmp_dist;
-            if (n->left && n->left->bbox.intersect(ray_orig, ray_dir, tmp_dist)) {
-                heap.emplace(n->left.get(), tmp_dist);
+            if (n->left != -1 && nodes[n->left].bbox.intersect(ray_orig, ray_dir, tmp_dist)) {
+                heap.emplace(n->left, tmp_dist);
             }
-            if (n->right && n->right->bbox.intersect(ray_orig, ray_dir, tmp_dist)) {
-                heap.emplace(n->right.get(), tmp_dist);
+            if (n->right != -1 && nodes[n->right].bbox.intersect(ray_orig, ray_dir, tmp_dist)) {
+                heap.emplace(n->right, tmp_dist);
             }
         }
     }
@@ -211,15 +237,23 @@ int KDTree::ray_intersect_recursive(const Vec3d &ray_orig,
                              const Vec3d &ray_dir,
                              double &dist,
                              Vec3d &hit_loc,
-                             const std::unique_ptr<Node> &node) const
+                             int node_index,
+                             int depth) const
 {
     double tmp_dist = 0;
-    if(!node || !(node->bbox.intersect(ray_orig, ray_dir, tmp_dist))) return -1;
+    if(node_index == -1) return -1;
+    if(pager && depth == pager->depth()) pager->enter(node_index);
+    const Node *node = &nodes[node_index];
+    if(traversal_stats_enabled) traversal_stats.box_tests++;
+    if(!(node->bbox.intersect(ray_orig, ray_dir, tmp_dist))) return -1;
+    if(traversal_stats_enabled) traversal_stats.nodes++;
 
     // set dist, hit_loc and return index
-    if(node->tri_indices.size()){
+    if(node->count){
         int closest_tri = -1;
-        for (int tri_index : node->tri_indices) {
+        if(traversal_stats_enabled) traversal_stats.tri_tests += node->count;
+        for (int i = node->first; i < node->first + node->count; ++i) {
+            int tri_index = leaf_tris[i];
             double tmp_dist;
             Vec3d tmp_hit_loc;
             if(ray_triangle_intersection(ray_orig, ray_dir, tri_index, tmp_dist, tmp_hit_loc)){
@@ -235,8 +269,8 @@ int KDTree::ray_intersect_recursive(const Vec3d &ray_orig,
 
     double dist1 = INF, dist2 = INF;
     Vec3d hit_loc1, hit_loc2;
-    int left_tri = ray_intersect_recursive(ray_orig, ray_dir, dist1, hit_loc1, node->left);
-    int right_tri = ray_intersect_recursive(ray_orig, ray_dir, dist2, hit_loc2, node->right);
+    int left_tri = ray_intersect_recursive(ray_orig, ray_dir, dist1, hit_loc1, node->left, depth + 1);
+    int right_tri = ray_intersect_recursive(ray_orig, ray_dir, dist2, hit_loc2, node->right, depth + 1);
 
     if(left_tri == -1 && right_tri == -1) return -1;
     else if(dist1 < dist2){
@@ -250,3 +284,48 @@ int KDTree::ray_intersect_recursive(const Vec3d &ray_orig,
     }
 }
 
+
+TreeQuality KDTree::quality() const
+{
+    TreeQuality q;
+    if (nodes.empty()) return q;
+    const int size_buckets = 4 * leaf_node_size;
+    q.leaves_of_size.assign(size_buckets + 1, 0);
+    double root_area = std::max(nodes[0].bbox.surface_area(), 1e-300);
+
+    // depth first, with the depth of each node on the stack
+    std::vector<std::pair<int, int>> stack{{0, 0}};
+    while (!stack.empty()) {
+        int n = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        const Node &node = nodes[n];
+        double p = node.bbox.surface_area() / root_area;
+        q.nodes++;
+        q.max_depth = std::max(q.max_depth, depth);
+        if (node.count) {
+            q.leaves++;
+            q.sah_cost += p * node.count;
+            if (int(q.leaves_at_depth.size()) <= depth) q.leaves_at_depth.resize(depth + 1, 0);
+            q.leaves_at_depth[depth]++;
+            q.leaves_of_size[std::min(node.count, size_buckets)]++;
+        } else {
+            q.sah_cost += p;
+            if (node.left != -1) stack.push_back({node.left, depth + 1});
+            if (node.right != -1) stack.push_back({node.right, depth + 1});
+        }
+    }
+    return q;
+}
+
+void TreeQuality::print(const std::string &name) const
+{
+    std::cout << name << ": " << nodes << " nodes, " << leaves << " leaves, depth " << max_depth
+        << ", SAH cost " << sah_cost << std::endl;
+    std::cout << "  leaves at depth:";
+    for (size_t d = 0; d < leaves_at_depth.size(); ++d)
+        if (leaves_at_depth[d]) std::cout << " " << d << ":" << leaves_at_depth[d];
+    std::cout << std::endl << "  leaves with n triangles:";
+    for (size_t n = 0; n < leaves_of_size.size(); ++n)
+        if (leaves_of_size[n]) std::cout << " " << n << (n + 1 == leaves_of_size.size() ? "+:" : ":") << leaves_of_size[n];
+    std::cout << std::endl;
+}
@@ -3,8 +3,11 @@
 #include <vector>
 #include <array>
 #include <memory>
+#include <string>
 
 #include "MathUtils.h"
+#include "MappedFile.h"
+#include "MeshStorage.h"
 
 constexpr int leaf_node_size = 5;
 
@@ -12,41 +15,76 @@ class BBox{
     Vec3d min, max;
 
 public:
+    BBox() {}
     BBox(Vec3d min, Vec3d max): min{min}, max{max} {}
     BBox(const std::vector<Vec3d> &points);
-    bool intersect(const Vec3d &ray_orig, const Vec3d &ray_dir, double &dist);
+    bool intersect(const Vec3d &ray_orig, const Vec3d &ray_dir, double &dist) const;
+    double surface_area() const;
 };
 
+// Shape of a built tree. sah_cost is the expected work for a ray that hits
+// the root's box: each node is reached with the ratio of its surface area
+// to the root's, and costs 1 per internal node and 1 per triangle in a leaf.
+struct TreeQuality {
+    int nodes = 0, leaves = 0, max_depth = 0;
+    double sah_cost = 0;
+    std::vector<int> leaves_at_depth;
+    std::vector<int> leaves_of_size; // by triangle count, the last bucket holds the larger ones
+    void print(const std::string &name) const;
+};
+
+class TreeletPager;
+
 class KDTree {
+public:
+    // Nodes live in one array, children by index (-1 for none). Leaves hold
+    // count triangles from leaf_tris, starting at first. Plain data, so the
+    // arrays can be written to a file and mapped back.
     struct Node{
         BBox bbox;
-        std::unique_ptr<Node> left = nullptr, right = nullptr;
-        std::vector<int> tri_indices;
+        int left = -1, right = -1;
+        int first = 0, count = 0;
 
-        Node(const BBox &bbox): bbox{bbox}, left{nullptr}, right{nullptr} {}
+        Node(const BBox &bbox): bbox{bbox} {}
     };
 
+private:
     struct QueueElement 
     { 
-        const Node *n; // octree node held by this node in the tree 
+        int n; // octree node held by this node in the tree 
         double t; // used as key 
-        QueueElement(const Node *n, double thit) : n(n), t(thit) {} 
+        QueueElement(int n, double thit) : n(n), t(thit) {} 
         // comparator is > instead of < so priority_queue behaves like a min-heap
         friend bool operator < (const QueueElement &a, const QueueElement &b) { return a.t > b.t; } 
     }; 
 
-    std::vector<Vec3d> *mesh_verts;
-    std::vector<std::array<int, 3>> *mesh_tris;
+    const PositionArray *mesh_verts = nullptr;
+    ArrayView<std::array<int, 3>> mesh_tris;
+    std::vector<Vec3d> centroids; // only while building
 
-    std::vector<Vec3d> centroids;
-    std::unique_ptr<Node> root;
+    // built here, or views into a mapped file
+    std::vector<Node> node_storage;
+    std::vector<int> leaf_tri_storage;
+    ArrayView<Node> nodes;
+    ArrayView<int> leaf_tris;
+    TreeletPager *pager = nullptr;
 
 public:
-    KDTree(): root{nullptr} {}
-    KDTree(std::vector<Vec3d> *mesh_verts, std::vector<std::array<int, 3>> *mesh_tris);
+    KDTree() {}
+    KDTree(const PositionArray *mesh_verts, ArrayView<std::array<int, 3>> mesh_tris);
+    // a tree built before, over the same triangles
+    KDTree(const PositionArray *mesh_verts, ArrayView<std::array<int, 3>> mesh_tris,
+           ArrayView<Node> nodes, ArrayView<int> leaf_tris);
+
+    ArrayView<Node> get_nodes() const { return nodes; }
+    ArrayView<int> get_leaf_tris() const { return leaf_tris; }
+    // told about every treelet a ray enters
+    void set_pager(TreeletPager *p) { pager = p; }
+    size_t memory_bytes() const { return nodes.size() * sizeof(Node) + leaf_tris.size() * sizeof(int); }
+    TreeQuality quality() const;
 
     BBox build_bbox(const std::vector<int> &tri_indices);
-    std::unique_ptr<Node> build_tree(std::vector<int> &tri_indices, int depth);
+    int build_tree(std::vector<int> &tri_indices, int depth);
 
 
     bool ray_triangle_intersection(const Vec3d &ray_orig,
@@ -66,6 +104,6 @@ public:
                              const Vec3d &ray_dir,
                              double &dist,
                              Vec3d &hit_loc,
-                             const std::unique_ptr<Node> &node) const;
+                             int node_index,
+                             int depth = 0) const;
 };
-
@@ -0,0 +1,27 @@
+#include "LightList.h"
+
+void LightList::add(const Object *obj, const Color &emission) {
+    double radiance = luminance(emission);
+    if (radiance <= 0) return;
+
+    int n = obj->emitter_count();
+    if (n == 0) return;
+    for (int i = 0; i < n; ++i) {
+        emitters.push_back({obj, i});
+        powers.push_back(radiance * obj->emitter_area(i));
+    }
+    table_built.reset(new std::once_flag);
+}
+
+const AliasTable &LightList::built_table() const {
+    // renders look lights up from many threads at once
+    std::call_once(*table_built, [this] { table = AliasTable(powers); });
+    return table;
+}
+
+double LightList::pdf(const Object *obj, const Color &emission, const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const {
+    if (empty() || !obj->emitter_count()) return 0;
+    double radiance = luminance(emission);
+    if (radiance <= 0) return 0;
+    return radiance / built_table().weight_sum() * obj->emitter_pdf(ref, point, normal);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "AliasTable.h"
+#include "Object.h"
+
+// Every emissive piece in the scene (spheres, finite planes, individual mesh
+// triangles), picked proportionally to emitted power for next event estimation.
+// The alias table is built once, by the first lookup after the last add, so
+// building a scene stays linear in its emitters.
+class LightList {
+public:
+    struct Emitter {
+        const Object *obj;
+        int prim;
+    };
+
+private:
+    std::vector<Emitter> emitters;
+    std::vector<double> powers;
+    mutable AliasTable table;
+    mutable std::unique_ptr<std::once_flag> table_built{new std::once_flag};
+
+    const AliasTable &built_table() const;
+
+public:
+    // appends the emitters of obj if it is emissive. Not safe alongside
+    // lookups, only while the scene is being set up.
+    void add(const Object *obj, const Color &emission);
+
+    bool empty() const { return built_table().empty(); }
+    int size() const { return emitters.size(); }
+    const Emitter &sample(double u, double &pmf) const { return emitters[built_table().sample(u, pmf)]; }
+
+    // probability per solid angle of picking the emitter piece of obj at
+    // point and then sampling that point from ref. Pieces are picked in
+    // proportion to their area, so the piece itself doesn't need to be known.
+    double pdf(const Object *obj, const Color &emission, const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const;
+};
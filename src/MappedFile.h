@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A whole file mapped read only, unmapped when this goes away.
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    MappedFile() {}
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool open(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size > 0) {
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                data = (const uint8_t *) p;
+                size = st.st_size;
+            }
+        }
+        ::close(fd);
+        return data != nullptr;
+    }
+    ~MappedFile() { if (data) munmap((void *) data, size); }
+};
+
+// Read only view of count T's, either in a vector or in a mapped file.
+template <typename T>
+struct ArrayView {
+    using value_type = T;
+
+    const T *data = nullptr;
+    size_t count = 0;
+
+    ArrayView() {}
+    ArrayView(const T *data, size_t count): data{data}, count{count} {}
+    ArrayView(const std::vector<T> &v): data{v.data()}, count{v.size()} {}
+
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const T &operator[](size_t i) const { return data[i]; }
+    const T *begin() const { return data; }
+    const T *end() const { return data + count; }
+};
@@ -1,4 +1,7 @@
+#include <algorithm>
+
 #include "Material.h"
+#include "Sampling.h"
 
 Color Material::calculate_color(const Vec3d &ray_dir,
                                 const Vec3d &hit_loc,
@@ -38,58 +41,256 @@ Vec3d Material::reflected_ray(const Vec3d &ray_dir,
     return r;
 }
 
-Vec3d Mat2::sample(const Vec3d &ray_dir,
-                   const Vec3d &hit_norm) const
-{
-    if (type == Mat2::Diffuse) {
-        return (hit_norm + random_in_unit_sphere()).normalize();
-    } else if (type == Mat2::Metal) {
-        Vec3d refl = reflect(ray_dir, hit_norm);
-        return refl + random_in_unit_sphere() * roughness;
-    } else if (type == Mat2::Dielectric) {
-        Vec3d outward_normal;
-        Vec3d reflected = reflect(ray_dir, hit_norm);
-        Vec3d refracted;
-
-        float ni_over_nt;
-        float reflect_prob;
-        float cosine;
-        
-        // when ray shoot through object back into vacuum,
-        // ni_over_nt = refract_ind, surface normal has to be inverted.
-        if (ray_dir.dot(hit_norm) > 0){
-            outward_normal = hit_norm * -1;
-            ni_over_nt = refract_ind;
-            cosine = ray_dir.dot(hit_norm);
-        }
-        // when ray shoots into object,
-        // ni_over_nt = 1 / refract_ind.
-        else{
-            outward_normal = hit_norm;
-            ni_over_nt = 1.0 / refract_ind;
-            cosine = -ray_dir.dot(hit_norm);
-        }
-        
+// normal on the side the ray came from
+static Vec3d facing_normal(const Vec3d &ray_dir, const Vec3d &hit_norm)
+{
+    return hit_norm.dot(ray_dir) < 0 ? hit_norm : hit_norm * -1;
+}
+
+// Density (per solid angle) of normalize(center + radius * p) for p uniform
+// in the unit ball and unit length center, which is how rough metal picks its
+// direction. Integrates t^2 / volume along the chord of dir through the ball.
+static double fuzz_pdf(const Vec3d &center, double radius, const Vec3d &dir)
+{
+    double c = center.dot(dir);
+    double h2 = radius * radius - (1 - c * c);
+    if (h2 <= 0) return 0;
+    double h = sqrt(h2);
+    double t_far = c + h, t_near = std::max(0.0, c - h);
+    if (t_far <= 0) return 0;
+    return (t_far * t_far * t_far - t_near * t_near * t_near) / (4 * M_PI * radius * radius * radius);
+}
+
+// Diffuse: cosine weighted around the normal facing the ray
+
+static bool diffuse_is_delta(const Mat2 &m) { return false; }
+
+static Vec3d diffuse_sample(const Mat2 &m, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                            double u_lobe, double u1, double u2)
+{
+    double pdf;
+    return sample_cosine_hemisphere(facing_normal(ray_dir, hit_norm), u1, u2, pdf);
+}
+
+static void diffuse_eval(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                         Vec3d &reflectance, double &pdf)
+{
+    double cos_theta = wi.dot(facing_normal(ray_dir, hit_norm));
+    if (cos_theta <= 0) return;
+    reflectance = m.albedo * (cos_theta * M_1_PI);
+    pdf = cos_theta * M_1_PI;
+}
+
+static Vec3d diffuse_weight(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm)
+{
+    return m.albedo;
+}
+
+// one over the peak pdf
+static double diffuse_lobe_solid_angle(const Mat2 &m) { return M_PI; }
+
+static void diffuse_sample_batch(const MaterialTable &table, ShadeBatch &b, int begin, int end)
+{
+    #pragma omp simd
+    for (int i = begin; i < end; ++i) {
+        double sign = b.dir_x[i] * b.norm_x[i] + b.dir_y[i] * b.norm_y[i] + b.dir_z[i] * b.norm_z[i] < 0 ? 1 : -1;
+        double nx = b.norm_x[i] * sign, ny = b.norm_y[i] * sign, nz = b.norm_z[i] * sign;
+
+        // orthonormal_basis, written out on the columns
+        double s = std::copysign(1.0, nz);
+        double a = -1.0 / (s + nz);
+        double c = nx * ny * a;
+        double tx = 1 + s * nx * nx * a, ty = s * c, tz = -s * nx;
+        double bx = c, by = s + ny * ny * a, bz = -ny;
+
+        double r = sqrt(b.u1[i]);
+        double z = sqrt(std::max(0.0, 1 - b.u1[i]));
+        double sin_phi, cos_phi;
+        sincos_2pi(b.u2[i], sin_phi, cos_phi);
+        double x = r * cos_phi, y = r * sin_phi;
 
-        // refracted ray exists
-        if(refract(ray_dir, outward_normal, ni_over_nt, refracted)){
-            reflect_prob = schlick(cosine, refract_ind);
-        }
-        // refracted ray does not exist
-        else{
-            // total reflection
-            reflect_prob = 1.0;
-        }
-
-        if(random_double_01() < reflect_prob) {
-            return reflected.normalize();
-        }
-        else {
-            return refracted.normalize();
-        }
+        b.wi_x[i] = tx * x + bx * y + nx * z;
+        b.wi_y[i] = ty * x + by * y + ny * z;
+        b.wi_z[i] = tz * x + bz * y + nz * z;
+        int id = b.material[i];
+        b.weight_r[i] = table.albedo_r[id];
+        b.weight_g[i] = table.albedo_g[id];
+        b.weight_b[i] = table.albedo_b[id];
     }
+}
+
+// Metal: the mirror direction pushed by a point in a ball of radius roughness
+
+static bool metal_is_delta(const Mat2 &m) { return m.roughness == 0; }
+
+static Vec3d metal_sample(const Mat2 &m, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                          double u_lobe, double u1, double u2)
+{
+    // the lobe dimension is the radius in the fuzz ball
+    double pdf;
+    Vec3d refl = reflect(ray_dir, hit_norm);
+    return (refl + sample_uniform_ball(u1, u2, u_lobe, pdf) * m.roughness).normalize();
+}
+
+static void metal_eval(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                       Vec3d &reflectance, double &pdf)
+{
+    if (metal_is_delta(m)) return;
+    // defined so that the sampled direction's weight is just albedo,
+    // directions below the surface are absorbed
+    pdf = fuzz_pdf(reflect(ray_dir, hit_norm), m.roughness, wi);
+    if (wi.dot(facing_normal(ray_dir, hit_norm)) > 0) reflectance = m.albedo * pdf;
+}
+
+static Vec3d metal_weight(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm)
+{
+    // fuzzed below the surface
+    if (wi.dot(facing_normal(ray_dir, hit_norm)) <= 0) return 0;
+    return m.albedo;
+}
 
-    return 0;
+// the cone the fuzz ball subtends
+static double metal_lobe_solid_angle(const Mat2 &m) { return std::min(M_PI * m.roughness * m.roughness, 2 * M_PI); }
+
+static void metal_sample_batch(const MaterialTable &table, ShadeBatch &b, int begin, int end)
+{
+    #pragma omp simd
+    for (int i = begin; i < end; ++i) {
+        double d_n = b.dir_x[i] * b.norm_x[i] + b.dir_y[i] * b.norm_y[i] + b.dir_z[i] * b.norm_z[i];
+        double rx = b.dir_x[i] - 2 * d_n * b.norm_x[i];
+        double ry = b.dir_y[i] - 2 * d_n * b.norm_y[i];
+        double rz = b.dir_z[i] - 2 * d_n * b.norm_z[i];
+
+        // sample_uniform_ball(u1, u2, u_lobe)
+        int id = b.material[i];
+        double z = 1 - 2 * b.u1[i];
+        double r = sqrt(std::max(0.0, 1 - z * z));
+        double sin_phi, cos_phi;
+        sincos_2pi(b.u2[i], sin_phi, cos_phi);
+        double radius = cbrt(b.u_lobe[i]) * table.roughness[id];
+        double x = rx + r * cos_phi * radius, y = ry + r * sin_phi * radius;
+        z = rz + z * radius;
+        double inv_len = 1 / sqrt(x * x + y * y + z * z);
+        x *= inv_len;
+        y *= inv_len;
+        z *= inv_len;
+
+        // facing the ray means the opposite side from it
+        double side = (x * b.norm_x[i] + y * b.norm_y[i] + z * b.norm_z[i]) * d_n;
+        double keep = side < 0 ? 1 : 0;
+        b.wi_x[i] = x;
+        b.wi_y[i] = y;
+        b.wi_z[i] = z;
+        b.weight_r[i] = table.albedo_r[id] * keep;
+        b.weight_g[i] = table.albedo_g[id] * keep;
+        b.weight_b[i] = table.albedo_b[id] * keep;
+    }
+}
+
+// Dielectric: reflection or refraction, picked by the Fresnel term
+
+static bool dielectric_is_delta(const Mat2 &m) { return true; }
+
+static Vec3d dielectric_sample(const Mat2 &m, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                               double u_lobe, double u1, double u2)
+{
+    Vec3d outward_normal;
+    Vec3d reflected = reflect(ray_dir, hit_norm);
+    Vec3d refracted;
+
+    float ni_over_nt;
+    float reflect_prob;
+    float cosine;
+    
+    // when ray shoot through object back into vacuum,
+    // ni_over_nt = refract_ind, surface normal has to be inverted.
+    if (ray_dir.dot(hit_norm) > 0){
+        outward_normal = hit_norm * -1;
+        ni_over_nt = m.refract_ind;
+        cosine = ray_dir.dot(hit_norm);
+    }
+    // when ray shoots into object,
+    // ni_over_nt = 1 / refract_ind.
+    else{
+        outward_normal = hit_norm;
+        ni_over_nt = 1.0 / m.refract_ind;
+        cosine = -ray_dir.dot(hit_norm);
+    }
+    
+
+    // refracted ray exists
+    if(refract(ray_dir, outward_normal, ni_over_nt, refracted)){
+        reflect_prob = schlick(cosine, m.refract_ind);
+    }
+    // refracted ray does not exist
+    else{
+        // total reflection
+        reflect_prob = 1.0;
+    }
+
+    if(u_lobe < reflect_prob) {
+        return reflected.normalize();
+    }
+    else {
+        return refracted.normalize();
+    }
+}
+
+static void dielectric_eval(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                            Vec3d &reflectance, double &pdf) {}
+
+static Vec3d dielectric_weight(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm)
+{
+    return 1;
+}
+
+static double dielectric_lobe_solid_angle(const Mat2 &m) { return 0; }
+
+// the Fresnel branch doesn't vectorize, so this just loops the scalar kernel
+static void dielectric_sample_batch(const MaterialTable &table, ShadeBatch &b, int begin, int end)
+{
+    for (int i = begin; i < end; ++i) {
+        Vec3d wi = dielectric_sample(table[b.material[i]], Vec3d(b.dir_x[i], b.dir_y[i], b.dir_z[i]),
+                                     Vec3d(b.norm_x[i], b.norm_y[i], b.norm_z[i]), b.u_lobe[i], b.u1[i], b.u2[i]);
+        b.wi_x[i] = wi[0];
+        b.wi_y[i] = wi[1];
+        b.wi_z[i] = wi[2];
+        b.weight_r[i] = b.weight_g[i] = b.weight_b[i] = 1;
+    }
+}
+
+// A new material type is a new entry here (and in Mat2::MatType), nothing
+// else branches on the type.
+struct MaterialKernels {
+    bool (*is_delta)(const Mat2 &m);
+    Vec3d (*sample)(const Mat2 &m, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                    double u_lobe, double u1, double u2);
+    // reflectance and pdf start out 0
+    void (*eval)(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm,
+                 Vec3d &reflectance, double &pdf);
+    Vec3d (*weight)(const Mat2 &m, const Vec3d &wi, const Vec3d &ray_dir, const Vec3d &hit_norm);
+    double (*lobe_solid_angle)(const Mat2 &m);
+    // hits [begin, end) of a batch sorted by type
+    void (*sample_batch)(const MaterialTable &table, ShadeBatch &batch, int begin, int end);
+};
+
+static const MaterialKernels kernels[Mat2::NumTypes] = {
+    {diffuse_is_delta, diffuse_sample, diffuse_eval, diffuse_weight, diffuse_lobe_solid_angle, diffuse_sample_batch},
+    {metal_is_delta, metal_sample, metal_eval, metal_weight, metal_lobe_solid_angle, metal_sample_batch},
+    {dielectric_is_delta, dielectric_sample, dielectric_eval, dielectric_weight, dielectric_lobe_solid_angle,
+     dielectric_sample_batch},
+};
+
+bool Mat2::is_delta() const
+{
+    return kernels[type].is_delta(*this);
+}
+
+Vec3d Mat2::sample(const Vec3d &ray_dir,
+                   const Vec3d &hit_norm,
+                   double u_lobe, double u1, double u2) const
+{
+    return kernels[type].sample(*this, ray_dir, hit_norm, u_lobe, u1, u2);
 }
 
 void Mat2::eval(const Vec3d &wi,
@@ -98,30 +299,21 @@ void Mat2::eval(const Vec3d &wi,
                 Vec3d &reflectance,
                 double &pdf) const
 {
-    if (type == Mat2::Diffuse) {
-        reflectance = albedo * M_1_PI;
-        pdf = M_1_PI * 0.5; // equally likely to go in any direction in hemisphere (1/2pi)
-    } else if (type == Mat2::Metal) {
-        reflectance = albedo;
-        pdf = 1; // this is not physically accurate. Change to a proper BRDF later
-    } else if (type == Mat2::Dielectric) {
-        reflectance = 1;
-        pdf = 1;
-    }
+    reflectance = 0;
+    pdf = 0;
+    kernels[type].eval(*this, wi, ray_dir, hit_norm, reflectance, pdf);
 }
 
 Vec3d Mat2::eval(const Vec3d &wi,
                 const Vec3d &ray_dir,
                 const Vec3d &hit_norm) const
 {
-    if (type == Mat2::Diffuse) {
-        return albedo;// * (wi.dot(hit_norm) * 2);
-    } else if (type == Mat2::Metal) {
-        return albedo;
-    } else if (type == Mat2::Dielectric) {
-        return 1;
-    }
-    return 0;
+    return kernels[type].weight(*this, wi, ray_dir, hit_norm);
+}
+
+double Mat2::lobe_solid_angle() const
+{
+    return kernels[type].lobe_solid_angle(*this);
 }
 
 bool Mat2::scatter(const Vec3d &ray_dir,
@@ -131,70 +323,64 @@ bool Mat2::scatter(const Vec3d &ray_dir,
                     Vec3d &scattered_ray,
                     bool &include_emission) const
 {
-    if (type == Mat2::Diffuse) {
-        attenuation = albedo;
-        scattered_ray = (hit_norm + random_in_unit_sphere()).normalize();
-        include_emission = false;
-        return true;
-    } else if (type == Mat2::Metal) {
-        attenuation = albedo;
-        Vec3d refl = reflect(ray_dir, hit_norm);
-        // reflected ray, and random inside of sphere based on roughness
-        scattered_ray = refl + random_in_unit_sphere() * roughness;
-        
+    double u_lobe = random_double_01(), u1 = random_double_01(), u2 = random_double_01();
+    scattered_ray = sample(ray_dir, hit_norm, u_lobe, u1, u2);
+    attenuation = eval(scattered_ray, ray_dir, hit_norm);
+    // trace2 light samples diffuse hits itself
+    if (type == Mat2::Diffuse) include_emission = false;
+    return attenuation[0] > 0 || attenuation[1] > 0 || attenuation[2] > 0;
+}
 
-        // if ray is in hemisphere
-        if (scattered_ray.dot(hit_norm) > 0) {
-            scattered_ray.normalize();
-            return true;
-        } else {
-            return false;
-        }
-    } else if (type == Mat2::Dielectric) {
-        attenuation = Vec3d(1.0,1.0,1.0);
-
-        Vec3d outward_normal;
-        Vec3d reflected = reflect(ray_dir, hit_norm);
-        Vec3d refracted;
-
-        float ni_over_nt;
-        float reflect_prob;
-        float cosine;
-        
-        // when ray shoot through object back into vacuum,
-        // ni_over_nt = refract_ind, surface normal has to be inverted.
-        if (ray_dir.dot(hit_norm) > 0){
-            outward_normal = hit_norm * -1;
-            ni_over_nt = refract_ind;
-            cosine = ray_dir.dot(hit_norm);
-        }
-        // when ray shoots into object,
-        // ni_over_nt = 1 / refract_ind.
-        else{
-            outward_normal = hit_norm;
-            ni_over_nt = 1.0 / refract_ind;
-            cosine = -ray_dir.dot(hit_norm);
-        }
-        
+void ShadeBatch::resize(int n)
+{
+    for (auto *v : {&dir_x, &dir_y, &dir_z, &norm_x, &norm_y, &norm_z, &u_lobe, &u1, &u2,
+                    &wi_x, &wi_y, &wi_z, &weight_r, &weight_g, &weight_b}) {
+        v->resize(n);
+    }
+    material.resize(n);
+    origin.resize(n);
+    for (int i = 0; i < n; ++i) origin[i] = i;
+}
+
+int MaterialTable::add(const Mat2 &mat)
+{
+    records.push_back(mat);
+    type.push_back(mat.type);
+    albedo_r.push_back(mat.albedo[0]);
+    albedo_g.push_back(mat.albedo[1]);
+    albedo_b.push_back(mat.albedo[2]);
+    roughness.push_back(mat.roughness);
+    refract_ind.push_back(mat.refract_ind);
+    return records.size() - 1;
+}
+
+void MaterialTable::sample(ShadeBatch &batch) const
+{
+    int n = batch.size();
+
+    // counting sort by type, stable so hits keep their order within a type
+    int start[Mat2::NumTypes + 1] = {};
+    for (int i = 0; i < n; ++i) start[type[batch.material[i]] + 1]++;
+    for (int t = 0; t < Mat2::NumTypes; ++t) start[t + 1] += start[t];
+
+    int next[Mat2::NumTypes];
+    std::copy(start, start + Mat2::NumTypes, next);
+    std::vector<int> order(n);
+    for (int i = 0; i < n; ++i) order[next[type[batch.material[i]]]++] = i;
+
+    auto permute = [&](auto &v) {
+        auto sorted = v;
+        for (int i = 0; i < n; ++i) sorted[i] = v[order[i]];
+        v.swap(sorted);
+    };
+    permute(batch.material);
+    permute(batch.origin);
+    for (auto *v : {&batch.dir_x, &batch.dir_y, &batch.dir_z, &batch.norm_x, &batch.norm_y, &batch.norm_z,
+                    &batch.u_lobe, &batch.u1, &batch.u2}) {
+        permute(*v);
+    }
 
-        // refracted ray exists
-        if(refract(ray_dir, outward_normal, ni_over_nt, refracted)){
-            reflect_prob = schlick(cosine, refract_ind);
-        }
-        // refracted ray does not exist
-        else{
-            // total reflection
-            reflect_prob = 1.0;
-        }
-
-        if(random_double_01() < reflect_prob) {
-            scattered_ray = reflected.normalize();
-        }
-        else {
-            scattered_ray = refracted.normalize();
-        }
-        return true;
-    } else {
-        return false;
+    for (int t = 0; t < Mat2::NumTypes; ++t) {
+        if (start[t] < start[t + 1]) kernels[t].sample_batch(*this, batch, start[t], start[t + 1]);
     }
 }
@@ -2,6 +2,7 @@
 
 #include <cmath>
 #include <vector>
+#include <cstdint>
 
 #include "MathUtils.h"
 #include "Light.h"
@@ -20,15 +21,21 @@ struct Material{
 };
 
 
-// refactor to be polymorphic
+// Parameters of one material, an entry of the scene's MaterialTable.
+// Behaviour per type lives in the kernels in Material.cc, which the member
+// functions below dispatch to.
 struct Mat2{
-    enum MatType {Diffuse, Metal, Dielectric};
+    enum MatType : uint8_t {Diffuse, Metal, Dielectric, NumTypes};
     MatType type;
     Vec3d albedo;
     Vec3d emissive;
     double roughness;
     double refract_ind;
+    // from Scene::add_texture, scales albedo by the texture where it's hit.
+    // Only trace_iterative reads it.
+    int albedo_texture = -1;
 
+    // sample() and eval() with fresh random numbers, for trace2
     bool scatter(const Vec3d &ray_dir,
                  const Vec3d &hit_loc,
                  const Vec3d &hit_norm,
@@ -36,16 +43,67 @@ struct Mat2{
                  Vec3d &scattered_dir,
                  bool &include_emission) const;
 
+    // perfectly sharp reflection or refraction, can't be light sampled
+    bool is_delta() const;
+
+    // u_lobe picks reflection or refraction for glass (and is the radius in
+    // the fuzz ball for metal), u1 and u2 pick the direction
     Vec3d sample(const Vec3d &ray_dir,
-                 const Vec3d &hit_norm) const;
+                 const Vec3d &hit_norm,
+                 double u_lobe, double u1, double u2) const;
 
+    // BSDF times cosine for direction wi, and the pdf of sample() returning
+    // wi (per solid angle). Both 0 for delta materials.
     void eval(const Vec3d &wi,
                const Vec3d &ray_dir,
                const Vec3d &hit_norm,
                Vec3d &reflectance,
                double &pdf) const;
     
+    // throughput weight (BSDF * cos / pdf) of a direction returned by sample()
     Vec3d eval(const Vec3d &wi,
                const Vec3d &ray_dir,
                const Vec3d &hit_norm) const;
-};
\ No newline at end of file
+
+    // rough size of the reflection lobe in steradians, 0 for delta materials
+    double lobe_solid_angle() const;
+};
+
+// A batch of hits to scatter, structure of arrays so the per type kernels
+// run plain loops over contiguous ranges. Fill the inputs, then
+// MaterialTable::sample reorders the whole batch by material type; origin
+// keeps where each hit was before that.
+struct ShadeBatch {
+    // inputs
+    std::vector<int> material;
+    std::vector<double> dir_x, dir_y, dir_z;    // incoming ray direction
+    std::vector<double> norm_x, norm_y, norm_z; // unit geometric normal
+    std::vector<double> u_lobe, u1, u2;
+    std::vector<int> origin;
+
+    // outputs, as Mat2::sample and the throughput weight of Mat2::eval
+    std::vector<double> wi_x, wi_y, wi_z;
+    std::vector<double> weight_r, weight_g, weight_b;
+
+    int size() const { return material.size(); }
+    void resize(int n);
+};
+
+// Every material of a scene, referenced by index from the objects. Entries
+// are kept as records for the one-path-at-a-time tracer and as columns for
+// the batched kernels.
+class MaterialTable {
+    std::vector<Mat2> records;
+
+public:
+    std::vector<uint8_t> type;
+    std::vector<double> albedo_r, albedo_g, albedo_b;
+    std::vector<double> roughness, refract_ind;
+
+    int add(const Mat2 &mat);
+    int size() const { return records.size(); }
+    const Mat2 &operator[](int id) const { return records[id]; }
+
+    // scatters every hit in the batch, one kernel call per material type
+    void sample(ShadeBatch &batch) const;
+};
@@ -5,6 +5,8 @@
 #include <iostream>
 #include <cstdlib>
 #include <limits>
+#include <cstdint>
+#include <cstring>
 
 constexpr double INF = 1e10;
 constexpr double EPSILON = 1e-6;
@@ -96,9 +98,33 @@ const Color white{1, 1, 1};
 const Color background{160/255.0, 1, 1};
 
 // RNG
-static uint64_t rng_seed = 1;
+// per-thread state so frames and pixels can be rendered concurrently. Kept in
+// an inline function so every translation unit shares the same state.
+inline uint64_t &rng_state()
+{
+    static thread_local uint64_t rng_seed = 1;
+    return rng_seed;
+}
+
+// splitmix64 finalizer, decorrelates nearby seeds (e.g. neighbouring pixels)
+inline uint64_t hash64(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+inline void seed_rng(uint64_t seed)
+{
+    uint64_t &rng_seed = rng_state();
+    rng_seed = hash64(seed);
+    if (rng_seed == 0) rng_seed = 1; // xorshift gets stuck on 0
+}
+
 inline uint64_t xorshift64()
 {
+    uint64_t &rng_seed = rng_state();
     uint64_t x = rng_seed;
 	x ^= x << 13;
 	x ^= x >> 7;
@@ -111,12 +137,13 @@ inline double random_double_01()
     return xorshift64() / static_cast<double>(std::numeric_limits<uint64_t>::max());
 }
 
+// uniform in the unit ball: a direction from two numbers and the cube root
+// of a third as the radius, always three draws (see Sampling.h)
 inline Vec3d random_in_unit_sphere() {
-    Vec3d p;
-    do {
-        p = Vec3d(random_double_01(),random_double_01(),random_double_01()) * 2.0 - Vec3d(1,1,1);
-    } while (p.sqrNorm() >= 1.0);
-    return p;
+    double z = 1 - 2 * random_double_01();
+    double r = sqrt(std::max(0.0, 1 - z * z));
+    double phi = 2 * M_PI * random_double_01();
+    return Vec3d(r * cos(phi), r * sin(phi), z) * cbrt(random_double_01());
 }
 
 inline Vec3d reflect(const Vec3d &in, const Vec3d &n) {
@@ -154,10 +181,70 @@ inline double schlick(double c, double refract_ind) {
     return r0 + (1-r0)*pow(1-c, 5);
 }
 
+// MIS weight for a sample drawn with pdf a, when pdf b could also have drawn it
+inline double power_heuristic(double a, double b) {
+    return a * a / (a * a + b * b);
+}
+
+inline double luminance(const Color &c) {
+    return 0.2126 * c[0] + 0.7152 * c[1] + 0.0722 * c[2];
+}
+
 inline double contrast_tone_map(double in) {
     return in / (in + 1);
 }
 
 inline double gamma_compression(double in, double a, double gamma) {
     return a * pow(in, gamma);
-}
\ No newline at end of file
+}
+// atan2 to within 2e-8 rad (Abramowitz & Stegun 4.4.49 on [0, 1], then
+// reflected into the right octant), without branches or library calls
+inline double fast_atan2(double y, double x) {
+    double ax = std::abs(x), ay = std::abs(y);
+    double hi = std::max(ax, ay), lo = std::min(ax, ay);
+    double a = hi > 0 ? lo / hi : 0;
+    double s = a * a;
+    double r = a * (1 + s * (-0.3333314528 + s * (0.1999355085 + s * (-0.1420889944 + s * (0.1065626393
+               + s * (-0.0752896400 + s * (0.0429096138 + s * (-0.0161657367 + s * 0.0028662257))))))));
+    r = ay > ax ? M_PI_2 - r : r;
+    r = x < 0 ? M_PI - r : r;
+    return y < 0 ? -r : r;
+}
+
+// round to nearest even, overflow goes to inf
+inline uint16_t float_to_half(float f) {
+    uint32_t x;
+    memcpy(&x, &f, 4);
+    uint32_t sign = (x >> 16) & 0x8000;
+    uint32_t mant = x & 0x7fffff;
+    int exp = (x >> 23) & 0xff;
+
+    if (exp == 255) return sign | 0x7c00 | (mant ? 0x200 : 0); // inf / nan
+
+    int e = exp - 127 + 15;
+    if (e >= 31) return sign | 0x7c00;
+    if (e <= 0) { // subnormal half
+        if (e < -10) return sign;
+        mant |= 0x800000;
+        int shift = 14 - e;
+        uint32_t h = mant >> shift;
+        uint32_t rem = mant & ((1u << shift) - 1), halfway = 1u << (shift - 1);
+        if (rem > halfway || (rem == halfway && (h & 1))) h++;
+        return sign | h;
+    }
+
+    uint32_t h = sign | (e << 10) | (mant >> 13);
+    uint32_t rem = mant & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1))) h++; // a carry correctly bumps the exponent
+    return h;
+}
+
+// Zero and subnormal halves come out as 0, inf and nan as huge numbers.
+// Adding (127 - 15) << 10 moves the exponent to float's bias.
+inline float half_to_float(uint16_t h) {
+    uint32_t x = (h & 0x8000u) << 16;
+    if (h & 0x7c00) x |= ((h & 0x7fffu) + 0x1c000u) << 13;
+    float f;
+    memcpy(&f, &x, 4);
+    return f;
+}
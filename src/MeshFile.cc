@@ -0,0 +1,131 @@
+#include <stdio.h>
+#include <string.h>
+#include <iostream>
+#include <type_traits>
+
+#include "MeshFile.h"
+
+static const char mesh_magic[8] = {'C', 'R', 'A', 'Y', 'M', 'E', 'S', 'H'};
+constexpr uint32_t mesh_version = 2;
+constexpr size_t mesh_alignment = 64;
+
+static_assert(sizeof(Vec3d) == 24 && std::is_trivially_copyable<Vec3d>::value, "Vec3d is stored as is");
+static_assert(std::is_trivially_copyable<KDTree::Node>::value, "KD nodes are stored as is");
+
+struct SectionEntry {
+    uint64_t offset, count, elem_size;
+};
+
+struct MeshHeader {
+    char magic[8];
+    uint32_t version, num_sections;
+    SectionEntry sections[NumMeshSections];
+};
+
+// the sections in MeshSection order, as raw bytes
+static void section_views(const MeshArrays &a, const void *data[], SectionEntry entries[]) {
+    auto set = [&](MeshSection s, const void *p, size_t count, size_t elem_size) {
+        data[s] = p;
+        entries[s] = {0, count, elem_size};
+    };
+    set(MeshPositions, a.positions.data, a.positions.size(), sizeof(Vec3d));
+    set(MeshTris, a.tris.data, a.tris.size(), sizeof(std::array<int, 3>));
+    set(MeshFaceNormals, a.face_normals.data, a.face_normals.size(), sizeof(Vec3d));
+    set(MeshNormals, a.normals.data, a.normals.size(), sizeof(Vec3d));
+    set(MeshUVs, a.uvs.data, a.uvs.size(), sizeof(std::array<double, 2>));
+    set(MeshTriNormals, a.tri_normals.data, a.tri_normals.size(), sizeof(std::array<int, 3>));
+    set(MeshTriUVs, a.tri_uvs.data, a.tri_uvs.size(), sizeof(std::array<int, 3>));
+    set(MeshKDNodes, a.kd_nodes.data, a.kd_nodes.size(), sizeof(KDTree::Node));
+    set(MeshKDLeafTris, a.kd_leaf_tris.data, a.kd_leaf_tris.size(), sizeof(int));
+    set(MeshTreelets, a.treelets.data, a.treelets.size(), sizeof(TreeletRecord));
+}
+
+bool save_mesh_file(const std::string &path, const MeshArrays &arrays) {
+    MeshHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, mesh_magic, sizeof(mesh_magic));
+    header.version = mesh_version;
+    header.num_sections = NumMeshSections;
+
+    const void *data[NumMeshSections];
+    section_views(arrays, data, header.sections);
+    uint64_t offset = sizeof(header);
+    for (SectionEntry &s : header.sections) {
+        offset = (offset + mesh_alignment - 1) / mesh_alignment * mesh_alignment;
+        s.offset = offset;
+        offset += s.count * s.elem_size;
+    }
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Cannot write mesh " << tmp_path << std::endl;
+        return false;
+    }
+
+    static const char zeros[mesh_alignment] = {};
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint64_t written = sizeof(header);
+    for (int i = 0; i < NumMeshSections && ok; ++i) {
+        const SectionEntry &s = header.sections[i];
+        ok = fwrite(zeros, 1, s.offset - written, file) == s.offset - written
+            && fwrite(data[i], s.elem_size, s.count, file) == s.count;
+        written = s.offset + s.count * s.elem_size;
+    }
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::cerr << "Failed to write mesh " << path << std::endl;
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool load_mesh_file(const std::string &path, MappedFile &file, MeshArrays &arrays) {
+    if (!file.open(path.c_str())) {
+        std::cerr << path << ": cannot open" << std::endl;
+        return false;
+    }
+    MeshHeader header;
+    if (file.size < sizeof(header) || memcmp(file.data, mesh_magic, sizeof(mesh_magic))) {
+        std::cerr << path << ": not a mesh file" << std::endl;
+        return false;
+    }
+    memcpy(&header, file.data, sizeof(header));
+    if (header.version != mesh_version || header.num_sections != NumMeshSections) {
+        std::cerr << path << ": mesh file version " << header.version << ", expected " << mesh_version << std::endl;
+        return false;
+    }
+
+    // element sizes must match this build's, so the arrays can be used as is
+    const void *unused[NumMeshSections];
+    SectionEntry expected[NumMeshSections];
+    section_views(MeshArrays{}, unused, expected);
+    const void *data[NumMeshSections];
+    for (int i = 0; i < NumMeshSections; ++i) {
+        const SectionEntry &s = header.sections[i];
+        if (s.elem_size != expected[i].elem_size || s.offset % mesh_alignment
+            || s.offset > file.size || s.count > (file.size - s.offset) / s.elem_size) {
+            std::cerr << path << ": bad section " << i << std::endl;
+            return false;
+        }
+        data[i] = file.data + s.offset;
+    }
+
+    auto view = [&](MeshSection s, auto &out) {
+        using T = typename std::remove_reference<decltype(out)>::type::value_type;
+        out = {(const T *) data[s], header.sections[s].count};
+    };
+    view(MeshPositions, arrays.positions);
+    view(MeshTris, arrays.tris);
+    view(MeshFaceNormals, arrays.face_normals);
+    view(MeshNormals, arrays.normals);
+    view(MeshUVs, arrays.uvs);
+    view(MeshTriNormals, arrays.tri_normals);
+    view(MeshTriUVs, arrays.tri_uvs);
+    view(MeshKDNodes, arrays.kd_nodes);
+    view(MeshKDLeafTris, arrays.kd_leaf_tris);
+    view(MeshTreelets, arrays.treelets);
+    return true;
+}
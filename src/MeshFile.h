@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <string>
+
+#include "KDTree.h"
+#include "MappedFile.h"
+#include "MathUtils.h"
+
+// Binary mesh file (.cmesh): the arrays of a Mesh, in native byte order, each
+// starting on a 64 byte boundary so they can be used in place once the file
+// is mapped. Loading is a map and a header check; nothing is parsed or
+// copied, and arrays that are never read never get paged in.
+//
+// layout: "CRAYMESH", u32 version, u32 section count,
+//         per section u64 offset, u64 element count, u64 element size,
+//         then the sections in MeshSection order
+//
+// Only the header is validated. Indices are trusted, so only load files
+// written by save_mesh_file.
+
+enum MeshSection {
+    MeshPositions, MeshTris, MeshFaceNormals,  // face normals are unnormalized
+    MeshNormals, MeshUVs, MeshTriNormals, MeshTriUVs,
+    MeshKDNodes, MeshKDLeafTris,               // optional, built on load if missing
+    MeshTreelets,                              // optional, see MeshPager.h
+    NumMeshSections
+};
+
+// Subtree under node root at depth, nodes [root, node_end), triangles and
+// leaf triangle slots [tri_first, tri_end), and the vertices its triangles
+// use first [vert_first, vert_end).
+struct TreeletRecord {
+    int depth, root, node_end;
+    int tri_first, tri_end;
+    int vert_first, vert_end;
+    int unused = 0;
+};
+
+struct MeshArrays {
+    ArrayView<Vec3d> positions, face_normals, normals;
+    ArrayView<std::array<double, 2>> uvs;
+    ArrayView<std::array<int, 3>> tris, tri_normals, tri_uvs;
+    ArrayView<KDTree::Node> kd_nodes;
+    ArrayView<int> kd_leaf_tris;
+    ArrayView<TreeletRecord> treelets;
+};
+
+// writes to a temporary file first and renames it over path
+bool save_mesh_file(const std::string &path, const MeshArrays &arrays);
+// maps path into file and points arrays into it; errors are printed
+bool load_mesh_file(const std::string &path, MappedFile &file, MeshArrays &arrays);
@@ -0,0 +1,134 @@
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "MeshPager.h"
+
+template <typename T>
+static void add_range(const T *data, int first, int end, const uint8_t *&begin_out, const uint8_t *&end_out) {
+    begin_out = (const uint8_t *) (data + first);
+    end_out = (const uint8_t *) (data + end);
+}
+
+TreeletPager::TreeletPager(const MeshArrays &arrays, size_t budget): budget{budget}
+{
+    size_t n = arrays.treelets.size();
+    treelets.reset(new Treelet[n]);
+    roots.resize(n);
+    for (size_t i = 0; i < n; ++i) {
+        const TreeletRecord &r = arrays.treelets[i];
+        root_depth = r.depth;
+        roots[i] = r.root;
+        Treelet &t = treelets[i];
+        add_range(arrays.kd_nodes.data, r.root, r.node_end, t.ranges[0].begin, t.ranges[0].end);
+        add_range(arrays.kd_leaf_tris.data, r.tri_first, r.tri_end, t.ranges[1].begin, t.ranges[1].end);
+        add_range(arrays.tris.data, r.tri_first, r.tri_end, t.ranges[2].begin, t.ranges[2].end);
+        add_range(arrays.face_normals.data, r.tri_first, r.tri_end, t.ranges[3].begin, t.ranges[3].end);
+        add_range(arrays.positions.data, r.vert_first, r.vert_end, t.ranges[4].begin, t.ranges[4].end);
+        for (const Range &range : t.ranges) t.bytes += range.end - range.begin;
+    }
+}
+
+void TreeletPager::set_resident(Treelet &t, bool resident)
+{
+    static const uintptr_t page = sysconf(_SC_PAGESIZE);
+    for (const Range &range : t.ranges) {
+        if (range.begin == range.end) continue;
+        uintptr_t begin = uintptr_t(range.begin) / page * page;
+        uintptr_t end = (uintptr_t(range.end) + page - 1) / page * page;
+        madvise((void *) begin, end - begin, resident ? MADV_WILLNEED : MADV_DONTNEED);
+    }
+    t.resident.store(resident, std::memory_order_release);
+}
+
+void TreeletPager::fault(int index)
+{
+    std::lock_guard<std::mutex> lock{mutex};
+    Treelet &t = treelets[index];
+    if (t.resident.load(std::memory_order_relaxed)) {
+        t.hits.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    t.faults.fetch_add(1, std::memory_order_relaxed);
+    t.last_used.store(clock.fetch_add(1, std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    set_resident(t, true);
+    resident_bytes += t.bytes;
+
+    // the least recently entered go first, never the one just paged in
+    while (resident_bytes > budget) {
+        int victim = -1;
+        uint64_t oldest = UINT64_MAX;
+        for (size_t i = 0; i < roots.size(); ++i) {
+            const Treelet &c = treelets[i];
+            if (int(i) != index && c.resident.load(std::memory_order_relaxed) && c.last_used < oldest) {
+                victim = i;
+                oldest = c.last_used;
+            }
+        }
+        if (victim == -1) break;
+        set_resident(treelets[victim], false);
+        resident_bytes -= treelets[victim].bytes;
+        evictions++;
+    }
+    peak_bytes = std::max(peak_bytes, resident_bytes);
+}
+
+void TreeletPager::print_stats(const std::string &name) const
+{
+    uint64_t hits = 0, faults = 0;
+    for (size_t i = 0; i < roots.size(); ++i) {
+        hits += treelets[i].hits;
+        faults += treelets[i].faults;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    std::cout << name << ": " << roots.size() << " treelets, " << faults << " faults, " << hits << " hits ("
+        << 100.0 * hits / std::max<uint64_t>(hits + faults, 1) << "%), " << evictions << " evictions, peak "
+        << peak_bytes / 1e6 << " of " << budget / 1e6 << " MB resident; " << usage.ru_majflt
+        << " major page faults in the process" << std::endl;
+}
+
+// depth first down to the treelet roots
+static void collect_roots(ArrayView<KDTree::Node> nodes, int node, int depth, int root_depth, std::vector<int> &roots)
+{
+    if (node == -1) return;
+    if (depth == root_depth) {
+        roots.push_back(node);
+        return;
+    }
+    if (nodes[node].count) return; // a leaf above the treelets stays resident
+    collect_roots(nodes, nodes[node].left, depth + 1, root_depth, roots);
+    collect_roots(nodes, nodes[node].right, depth + 1, root_depth, roots);
+}
+
+std::vector<TreeletRecord> build_treelets(ArrayView<KDTree::Node> nodes, const std::vector<int> &vert_start,
+                                          size_t bytes_per_tri, size_t target_bytes)
+{
+    std::vector<TreeletRecord> treelets;
+    size_t tris = vert_start.size() - 1;
+    double count = double(tris) * bytes_per_tri / target_bytes;
+    if (nodes.empty() || count < 2) return treelets;
+    int root_depth = int(ceil(log2(count)));
+
+    std::vector<int> roots;
+    collect_roots(nodes, 0, 0, root_depth, roots);
+    for (int root : roots) {
+        // preorder: the subtree ends with its right most leaf
+        int first = root, last = root;
+        while (!nodes[first].count) first = nodes[first].left != -1 ? nodes[first].left : nodes[first].right;
+        while (!nodes[last].count) last = nodes[last].right != -1 ? nodes[last].right : nodes[last].left;
+        TreeletRecord r;
+        r.depth = root_depth;
+        r.root = root;
+        r.node_end = last + 1;
+        r.tri_first = nodes[first].first;
+        r.tri_end = nodes[last].first + nodes[last].count;
+        r.vert_first = vert_start[r.tri_first];
+        r.vert_end = vert_start[r.tri_end];
+        treelets.push_back(r);
+    }
+    return treelets;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "MeshFile.h"
+
+// Out of core meshes: a .cmesh keeps triangles in the order of the KD tree's
+// leaves and vertices in the order those triangles first use them, so the
+// subtree under each node at one depth (a treelet) owns one contiguous run
+// of nodes, triangles, face normals and vertices in the file. The levels
+// above stay resident.
+//
+// The pager tracks which treelets are resident. A treelet is paged in as a
+// whole when a ray first enters it, and the least recently entered ones are
+// dropped once more than the budget is resident. The mapping is read only
+// and backed by the file, so a dropped page that another thread is still
+// reading is simply read again. The budget bounds what the pager asks for;
+// the kernel may still map cached pages next to a fault (fault-around), which
+// cost no I/O and are reclaimed under pressure.
+class TreeletPager {
+    struct Range {
+        const uint8_t *begin, *end;
+    };
+    struct Treelet {
+        Range ranges[5];
+        size_t bytes = 0;
+        std::atomic<bool> resident{false};
+        std::atomic<uint64_t> last_used{0};
+        std::atomic<uint64_t> hits{0}, faults{0};
+    };
+
+    int root_depth = -1;
+    std::vector<int> roots; // node index of every treelet, ascending
+    std::unique_ptr<Treelet[]> treelets;
+    size_t budget;
+
+    std::mutex mutex; // held to page in or out
+    std::atomic<uint64_t> clock{0};
+    size_t resident_bytes = 0, peak_bytes = 0;
+    uint64_t evictions = 0;
+
+    void fault(int t);
+    void set_resident(Treelet &t, bool resident);
+
+public:
+    TreeletPager(const MeshArrays &arrays, size_t budget);
+
+    int depth() const { return root_depth; }
+    size_t treelet_count() const { return roots.size(); }
+
+    // called when a ray enters the node at depth(), before it reads it
+    void enter(int node) {
+        auto it = std::lower_bound(roots.begin(), roots.end(), node);
+        if (it == roots.end() || *it != node) return;
+        Treelet &t = treelets[it - roots.begin()];
+        if (t.resident.load(std::memory_order_acquire)) {
+            t.hits.fetch_add(1, std::memory_order_relaxed);
+            t.last_used.store(clock.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        } else {
+            fault(it - roots.begin());
+        }
+    }
+
+    void print_stats(const std::string &name) const;
+};
+
+// Treelets of about target_bytes each, over a mesh already in leaf order.
+// vert_start[i] is how many vertices triangles before i use first, with
+// vert_start[tris] the vertex count.
+std::vector<TreeletRecord> build_treelets(ArrayView<KDTree::Node> nodes, const std::vector<int> &vert_start,
+                                          size_t bytes_per_tri, size_t target_bytes = 256 << 10);
@@ -0,0 +1,116 @@
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <numeric>
+
+#include "MeshStorage.h"
+
+static const char *position_format_names[] = {"double", "float", "quantized"};
+
+const char *position_format_name(PositionFormat format)
+{
+    return position_format_names[uint32_t(format)];
+}
+
+// Sorts the encoded positions to find equal ones; the first of each run
+// (lowest index) stands for the others.
+template <typename T>
+static void weld(std::vector<T> &encoded, std::vector<int> &remap)
+{
+    size_t n = encoded.size();
+    std::vector<int> order(n);
+    std::iota(order.begin(), order.end(), 0);
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        int c = memcmp(&encoded[a], &encoded[b], sizeof(T));
+        return c < 0 || (c == 0 && a < b);
+    });
+    std::vector<int> rep(n);
+    for (size_t i = 0; i < n; ++i) {
+        bool same = i > 0 && !memcmp(&encoded[order[i]], &encoded[order[i - 1]], sizeof(T));
+        rep[order[i]] = same ? rep[order[i - 1]] : order[i];
+    }
+
+    remap.assign(n, -1);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (rep[i] == int(i)) {
+            encoded[kept] = encoded[i];
+            remap[i] = kept++;
+        } else {
+            remap[i] = remap[rep[i]];
+        }
+    }
+    encoded.resize(kept);
+    encoded.shrink_to_fit();
+}
+
+PositionArray::PositionArray(ArrayView<Vec3d> positions, PositionFormat format, bool weld_positions,
+                             std::vector<int> &remap):
+    format{format}
+{
+    size_t n = positions.size();
+    if (format == PositionFormat::Double) {
+        doubles = positions;
+        if (weld_positions) {
+            double_storage.assign(positions.begin(), positions.end());
+            weld(double_storage, remap);
+            doubles = double_storage;
+        }
+    } else if (format == PositionFormat::Float) {
+        floats.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            for (int c = 0; c < 3; ++c) floats[i][c] = positions[i][c];
+        }
+        if (weld_positions) weld(floats, remap);
+    } else {
+        Vec3d lo{INF, INF, INF}, hi{-INF, -INF, -INF};
+        for (const Vec3d &p : positions) {
+            for (int c = 0; c < 3; ++c) {
+                lo[c] = std::min(lo[c], p[c]);
+                hi[c] = std::max(hi[c], p[c]);
+            }
+        }
+        origin = lo;
+        for (int c = 0; c < 3; ++c) step[c] = n && hi[c] > lo[c] ? (hi[c] - lo[c]) / 65535 : 1;
+        quantized.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            for (int c = 0; c < 3; ++c) {
+                double q = std::round((positions[i][c] - origin[c]) / step[c]);
+                quantized[i][c] = uint16_t(std::min(std::max(q, 0.0), 65535.0));
+            }
+        }
+        if (weld_positions) weld(quantized, remap);
+    }
+    if (!weld_positions) {
+        remap.resize(n);
+        std::iota(remap.begin(), remap.end(), 0);
+    }
+}
+
+uint32_t octahedral_encode(const Vec3d &n)
+{
+    double l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+    double u = n[0] / l1, v = n[1] / l1;
+    if (n[2] < 0) {
+        // fold the lower half over the diagonals
+        double fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+        double fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+        u = fu;
+        v = fv;
+    }
+    auto snorm16 = [](double x) { return uint32_t(uint16_t(int16_t(std::round(std::min(std::max(x, -1.0), 1.0) * 32767)))); };
+    return snorm16(u) | snorm16(v) << 16;
+}
+
+Vec3d octahedral_decode(uint32_t packed)
+{
+    double u = int16_t(packed & 0xffff) / 32767.0, v = int16_t(packed >> 16) / 32767.0;
+    double z = 1 - std::abs(u) - std::abs(v);
+    if (z < 0) {
+        double fu = (1 - std::abs(v)) * (u >= 0 ? 1 : -1);
+        double fv = (1 - std::abs(u)) * (v >= 0 ? 1 : -1);
+        u = fu;
+        v = fv;
+    }
+    return Vec3d(u, v, z).normalize();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+#include "MappedFile.h"
+#include "MathUtils.h"
+
+// How mesh vertex positions are kept in memory:
+//   Double     3 x 64 bit, 24 bytes, exact
+//   Float      3 x 32 bit, 12 bytes, about 7 significant digits
+//   Quantized  3 x 16 bit steps across the mesh bounds, 6 bytes, error up to
+//              1/131070 of the bounds in each axis
+enum class PositionFormat : uint32_t { Double = 0, Float = 1, Quantized = 2 };
+
+const char *position_format_name(PositionFormat format);
+
+class PositionArray {
+    PositionFormat format = PositionFormat::Double;
+    ArrayView<Vec3d> doubles; // owned by the mesh, mapped, or double_storage when welded
+    std::vector<Vec3d> double_storage;
+    std::vector<std::array<float, 3>> floats;
+    std::vector<std::array<uint16_t, 3>> quantized;
+    Vec3d origin, step; // quantized positions are origin + q * step
+
+public:
+    PositionArray() {}
+    explicit PositionArray(ArrayView<Vec3d> positions): doubles{positions} {}
+    // Encodes positions. With weld, positions that encode the same are merged
+    // and remap gets the new index of every old one, in first seen order.
+    PositionArray(ArrayView<Vec3d> positions, PositionFormat format, bool weld, std::vector<int> &remap);
+    // doubles may point into double_storage, which a move keeps but a copy wouldn't
+    PositionArray(const PositionArray &) = delete;
+    PositionArray &operator=(const PositionArray &) = delete;
+    PositionArray(PositionArray &&) = default;
+    PositionArray &operator=(PositionArray &&) = default;
+
+    PositionFormat get_format() const { return format; }
+    size_t size() const {
+        return format == PositionFormat::Double ? doubles.size()
+             : format == PositionFormat::Float ? floats.size() : quantized.size();
+    }
+    // bytes held, counting mapped doubles too
+    size_t bytes() const { return size() * (format == PositionFormat::Double ? 24 : format == PositionFormat::Float ? 12 : 6); }
+    ArrayView<Vec3d> double_view() const { return doubles; }
+
+    Vec3d operator[](size_t i) const {
+        switch (format) {
+        case PositionFormat::Float:
+            return Vec3d(floats[i][0], floats[i][1], floats[i][2]);
+        case PositionFormat::Quantized:
+            return Vec3d(origin[0] + quantized[i][0] * step[0], origin[1] + quantized[i][1] * step[1],
+                         origin[2] + quantized[i][2] * step[2]);
+        default:
+            return doubles[i];
+        }
+    }
+};
+
+// Unit vectors as two 16 bit numbers on an octahedron unfolded into a
+// square (Cigolle et al., "A Survey of Efficient Representations for
+// Independent Unit Vectors"), about 1e-4 radians of error.
+uint32_t octahedral_encode(const Vec3d &n);
+Vec3d octahedral_decode(uint32_t packed);
@@ -0,0 +1,294 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <omp.h>
+
+#include "ObjLoader.h"
+#include "MappedFile.h"
+#include "Profiler.h"
+
+namespace {
+
+enum LineType { Other, Position, Normal, UV, Face };
+
+struct Chunk {
+    const char *begin, *end;
+    // lines of each kind, then the index of the chunk's first one
+    size_t positions = 0, normals = 0, uvs = 0;
+    std::vector<std::array<int, 3>> tris, tri_normals, tri_uvs;
+    const char *error = nullptr; // start of the bad line
+    const char *message = nullptr;
+};
+
+const double pow10[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+inline bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+inline bool is_digit(char c) { return unsigned(c - '0') < 10; }
+
+inline const char *skip_space(const char *p, const char *end) {
+    while (p < end && is_space(*p)) ++p;
+    return p;
+}
+
+// Reads the keyword at p and moves past it.
+LineType line_type(const char *&p, const char *end) {
+    p = skip_space(p, end);
+    if (end - p < 2) return Other;
+    if (p[0] == 'f' && is_space(p[1])) {
+        p += 1;
+        return Face;
+    }
+    if (p[0] != 'v') return Other;
+    if (is_space(p[1])) {
+        p += 1;
+        return Position;
+    }
+    if (end - p < 3 || !is_space(p[2])) return Other;
+    if (p[1] == 'n') {
+        p += 2;
+        return Normal;
+    }
+    if (p[1] == 't') {
+        p += 2;
+        return UV;
+    }
+    return Other;
+}
+
+// [+-]digits[.digits][(e|E)[+-]digits]. Up to 15 significant digits and
+// exponents within 1e22 are exact integers and powers of ten, so one
+// multiply or divide rounds correctly, as strtod would. Anything else goes
+// to strtod.
+bool parse_double(const char *&p, const char *end, double &out) {
+    const char *start = p;
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool any = false;
+    for (; p < end && is_digit(*p); ++p) {
+        any = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            digits += mantissa != 0;
+        } else {
+            ++exponent;
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && is_digit(*p); ++p) {
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                digits += mantissa != 0;
+                --exponent;
+            }
+        }
+    }
+    if (!any) return false;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool neg_exp = false;
+        if (p < end && (*p == '-' || *p == '+')) neg_exp = *p++ == '-';
+        if (p == end || !is_digit(*p)) return false;
+        int e = 0;
+        for (; p < end && is_digit(*p); ++p) e = std::min(e * 10 + (*p - '0'), 100000);
+        exponent += neg_exp ? -e : e;
+    }
+
+    if (digits > 15 || exponent < -22 || exponent > 22) {
+        char buf[64];
+        size_t n = std::min<size_t>(p - start, sizeof(buf) - 1);
+        memcpy(buf, start, n);
+        buf[n] = 0;
+        out = strtod(buf, nullptr);
+        return true;
+    }
+    double value = double(mantissa);
+    value = exponent < 0 ? value / pow10[-exponent] : value * pow10[exponent];
+    out = neg ? -value : value;
+    return true;
+}
+
+bool parse_int(const char *&p, const char *end, int &out) {
+    bool neg = false;
+    if (p < end && (*p == '-' || *p == '+')) neg = *p++ == '-';
+    if (p == end || !is_digit(*p)) return false;
+    int64_t value = 0;
+    for (; p < end && is_digit(*p); ++p) {
+        value = value * 10 + (*p - '0');
+        if (value > INT32_MAX) return false;
+    }
+    out = neg ? -int(value) : int(value);
+    return true;
+}
+
+// 1 based or negative (relative to the count so far) to 0 based, -1 if it
+// points at nothing
+inline int resolve(int index, size_t so_far, size_t total) {
+    if (index > 0) return size_t(index) <= total ? index - 1 : -1;
+    if (index < 0 && size_t(-int64_t(index)) <= so_far) return int(so_far + index);
+    return -1;
+}
+
+void count_lines(Chunk &chunk) {
+    for (const char *p = chunk.begin; p < chunk.end; ) {
+        const char *nl = (const char *) memchr(p, '\n', chunk.end - p);
+        const char *line_end = nl ? nl : chunk.end;
+        switch (line_type(p, line_end)) {
+        case Position: chunk.positions++; break;
+        case Normal: chunk.normals++; break;
+        case UV: chunk.uvs++; break;
+        default: break;
+        }
+        p = line_end + 1;
+    }
+}
+
+void parse_chunk(Chunk &chunk, ObjMesh &mesh) {
+    size_t v = chunk.positions, vn = chunk.normals, vt = chunk.uvs;
+    bool want_normals = !mesh.normals.empty(), want_uvs = !mesh.uvs.empty();
+    std::vector<std::array<int, 3>> corners; // position, uv, normal
+
+    for (const char *p = chunk.begin; p < chunk.end; ) {
+        const char *line = p;
+        const char *nl = (const char *) memchr(p, '\n', chunk.end - p);
+        const char *line_end = nl ? nl : chunk.end;
+        LineType type = line_type(p, line_end);
+        const char *message = nullptr;
+
+        if (type == Position || type == Normal) {
+            Vec3d &out = type == Position ? mesh.positions[v++] : mesh.normals[vn++];
+            for (int i = 0; i < 3 && !message; ++i) {
+                p = skip_space(p, line_end);
+                if (!parse_double(p, line_end, out[i])) message = "bad vertex";
+            }
+            // anything after (w, vertex colours) is ignored
+        } else if (type == UV) {
+            std::array<double, 2> &out = mesh.uvs[vt++];
+            out = {0, 0};
+            p = skip_space(p, line_end);
+            if (!parse_double(p, line_end, out[0])) message = "bad uv";
+            p = skip_space(p, line_end);
+            if (p < line_end && *p != '#' && !parse_double(p, line_end, out[1])) message = "bad uv";
+        } else if (type == Face) {
+            corners.clear();
+            while (!message) {
+                p = skip_space(p, line_end);
+                if (p == line_end || *p == '#') break;
+                int index[3] = {0, 0, 0}; // v/vt/vn
+                if (!parse_int(p, line_end, index[0])) message = "bad face";
+                for (int i = 1; i < 3 && !message && p < line_end && *p == '/'; ++i) {
+                    ++p;
+                    if (p < line_end && *p == '/') continue; // v//vn
+                    if (!parse_int(p, line_end, index[i])) message = "bad face";
+                }
+                if (message) break;
+                if (p < line_end && !is_space(*p)) {
+                    message = "bad face";
+                    break;
+                }
+                std::array<int, 3> c = {resolve(index[0], v, mesh.positions.size()),
+                                        index[1] ? resolve(index[1], vt, mesh.uvs.size()) : -1,
+                                        index[2] ? resolve(index[2], vn, mesh.normals.size()) : -1};
+                if (c[0] < 0 || (index[1] && c[1] < 0) || (index[2] && c[2] < 0)) message = "index out of range";
+                corners.push_back(c);
+            }
+            if (!message && corners.size() < 3) message = "face with fewer than 3 corners";
+            for (size_t i = 1; !message && i + 1 < corners.size(); ++i) {
+                const auto &a = corners[0], &b = corners[i], &c = corners[i + 1];
+                chunk.tris.push_back({a[0], b[0], c[0]});
+                if (want_uvs) chunk.tri_uvs.push_back({a[1], b[1], c[1]});
+                if (want_normals) chunk.tri_normals.push_back({a[2], b[2], c[2]});
+            }
+        }
+
+        if (message) {
+            chunk.error = line;
+            chunk.message = message;
+            return;
+        }
+        p = line_end + 1;
+    }
+}
+
+template <typename T>
+void concatenate(std::vector<Chunk> &chunks, std::vector<T> Chunk::*part, std::vector<T> &out) {
+    std::vector<size_t> offsets(chunks.size() + 1, 0);
+    for (size_t i = 0; i < chunks.size(); ++i) offsets[i + 1] = offsets[i] + (chunks[i].*part).size();
+    out.resize(offsets.back());
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        std::copy((chunks[i].*part).begin(), (chunks[i].*part).end(), out.begin() + offsets[i]);
+        std::vector<T>().swap(chunks[i].*part);
+    }
+}
+
+} // namespace
+
+bool ObjLoader::load(const char *path, ObjMesh &mesh, size_t *file_size) {
+    ScopedTimer timer{"obj parse"};
+    MappedFile file;
+    if (!file.open(path)) {
+        std::cerr << path << ": cannot open" << std::endl;
+        return false;
+    }
+    const char *data = (const char *) file.data, *end = data + file.size;
+    madvise((void *) file.data, file.size, MADV_SEQUENTIAL);
+
+    // a few chunks per thread for balance, split after a newline
+    size_t num_chunks = std::min<size_t>(4 * omp_get_max_threads(), file.size / (256 << 10) + 1);
+    std::vector<Chunk> chunks(num_chunks);
+    const char *prev = data;
+    for (size_t i = 0; i < num_chunks; ++i) {
+        const char *split = i + 1 == num_chunks ? end : data + file.size * (i + 1) / num_chunks;
+        if (split < prev) split = prev;
+        const char *nl = split < end ? (const char *) memchr(split, '\n', end - split) : nullptr;
+        if (i + 1 < num_chunks) split = nl ? nl + 1 : end;
+        chunks[i].begin = prev;
+        chunks[i].end = split;
+        prev = split;
+    }
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < num_chunks; ++i) count_lines(chunks[i]);
+
+    size_t v = 0, vn = 0, vt = 0;
+    for (Chunk &chunk : chunks) {
+        std::swap(v, chunk.positions);
+        std::swap(vn, chunk.normals);
+        std::swap(vt, chunk.uvs);
+        v += chunk.positions;
+        vn += chunk.normals;
+        vt += chunk.uvs;
+    }
+    if (v > INT32_MAX || vn > INT32_MAX || vt > INT32_MAX) {
+        std::cerr << path << ": too many vertices" << std::endl;
+        return false;
+    }
+    mesh = ObjMesh{};
+    mesh.positions.resize(v);
+    mesh.normals.resize(vn);
+    mesh.uvs.resize(vt);
+
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (size_t i = 0; i < num_chunks; ++i) parse_chunk(chunks[i], mesh);
+
+    for (const Chunk &chunk : chunks) {
+        if (!chunk.error) continue;
+        size_t line = 1 + std::count(data, chunk.error, '\n');
+        std::cerr << path << ":" << line << ": " << chunk.message << std::endl;
+        return false;
+    }
+
+    concatenate(chunks, &Chunk::tris, mesh.tris);
+    concatenate(chunks, &Chunk::tri_normals, mesh.tri_normals);
+    concatenate(chunks, &Chunk::tri_uvs, mesh.tri_uvs);
+
+    if (file_size) *file_size = file.size;
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include "MathUtils.h"
+
+// Triangles of an OBJ file, with 0 based indices. Polygons are split into a
+// fan around their first corner. tri_normals and tri_uvs index normals and
+// uvs per corner, -1 for corners without one, and are empty when the file
+// has no vn / vt lines.
+struct ObjMesh {
+    std::vector<Vec3d> positions, normals;
+    std::vector<std::array<double, 2>> uvs;
+    std::vector<std::array<int, 3>> tris, tri_normals, tri_uvs;
+};
+
+// Maps the file and parses it in chunks on all threads: a first pass counts
+// the v / vn / vt lines of every chunk, so each chunk knows where its
+// vertices go and what negative indices refer to, then the chunks are
+// parsed for real. Only v, vn, vt and f lines are read. Errors are printed
+// with their line. file_size, if given, gets the bytes read.
+class ObjLoader {
+public:
+    static bool load(const char *path, ObjMesh &mesh, size_t *file_size = nullptr);
+};
@@ -1,29 +1,33 @@
 #include <cmath>
+#include <chrono>
 #include <string>
 #include <iostream>
-#include <sstream>
-#include <fstream>
 
 #include "Object.h"
 #include "MathUtils.h"
 #include "Material.h"
+#include "Sampling.h"
+#include "MeshFile.h"
+#include "Profiler.h"
 
 
 Object::Object(const Material &material): material{material} {}
-Object::Object(const Mat2 &mat2): mat2{mat2} {}
+Object::Object(int mat): mat{mat} {}
 
 Sphere::Sphere(const Vec3d &center, double radius, const Material &material):
     Object{material}, center{center}, radius{radius} {}
 
-Sphere::Sphere(const Vec3d &center, double radius, const Mat2 &mat2):
-    Object{mat2}, center{center}, radius{radius} {}
+Sphere::Sphere(const Vec3d &center, double radius, int mat):
+    Object{mat}, center{center}, radius{radius} {}
 
 bool Sphere::ray_intersection(const Vec3d &ray_orig,
                           const Vec3d &ray_dir,
                           double &dist,
                           Vec3d &hit_loc,
-                          Vec3d &hit_norm) const
+                          Vec3d &hit_norm,
+                          int *prim) const
 {
+    if (prim) *prim = 0;
     double t0, t1;
     Vec3d L = center - ray_orig;
     double tca = L.dot(ray_dir); 
@@ -44,8 +48,50 @@ bool Sphere::ray_intersection(const Vec3d &ray_orig,
     return true; 
 }
 
-Plane::Plane(const Vec3d &normal, const Vec3d &center, const Mat2 &mat2, double size):
-    Object{mat2}, normal{normal}, center{center}, size{size}
+int Sphere::emitter_count() const { return 1; }
+
+double Sphere::emitter_area(int prim) const { return 4 * M_PI * radius * radius; }
+
+bool Sphere::sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                            Vec3d &point, Vec3d &normal, double &pdf) const
+{
+    Vec3d to_center = center - ref;
+    double dist2 = to_center.sqrNorm();
+    if (dist2 <= radius * radius) return false; // can't light itself from inside
+
+    // sample sphere by solid angle
+    double cos_a_max = sqrt(1.0 - radius * radius / dist2);
+    Vec3d l = sample_cone(to_center * (1.0 / sqrt(dist2)), cos_a_max, u1, u2, pdf);
+
+    double dist;
+    if (!ray_intersection(ref, l, dist, point, normal)) {
+        point = ref + l * to_center.dot(l); // grazing, closest point on the ray
+    }
+    normal = (point - center).normalize();
+    return true;
+}
+
+double Sphere::emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const
+{
+    double dist2 = (center - ref).sqrNorm();
+    if (dist2 <= radius * radius) return 0;
+    double cos_a_max = sqrt(1.0 - radius * radius / dist2);
+    return emitter_area(0) / (2 * M_PI * (1 - cos_a_max));
+}
+
+bool Sphere::surface_uv(int prim, const Vec3d &hit_loc,
+                        double &u, double &v, double &uv_per_length) const
+{
+    Vec3d p = hit_loc - center;
+    u = 0.5 + atan2(p[2], p[0]) * M_1_PI * 0.5;
+    v = 0.5 + asin(std::min(std::max(p[1] / radius, -1.0), 1.0)) * M_1_PI;
+    // v runs pole to pole over half the circumference
+    uv_per_length = M_1_PI / radius;
+    return true;
+}
+
+Plane::Plane(const Vec3d &normal, const Vec3d &center, int mat, double size):
+    Object{mat}, normal{normal}, center{center}, size{size}
 {
     this->normal.normalize();
 }
@@ -54,8 +100,10 @@ bool Plane::ray_intersection(const Vec3d &ray_orig,
                           const Vec3d &ray_dir,
                           double &dist,
                           Vec3d &hit_loc,
-                          Vec3d &hit_norm) const
+                          Vec3d &hit_norm,
+                          int *prim) const
 {
+    if (prim) *prim = 0;
     if(std::abs(ray_dir.dot(normal)) < EPSILON) return false;
         
     dist = (center - ray_orig).dot(normal) / ray_dir.dot(normal);
@@ -70,49 +118,254 @@ bool Plane::ray_intersection(const Vec3d &ray_orig,
     return true;
 }
 
-Mesh::Mesh(const std::string &filepath, const Mat2 &mat2):
-    Object{mat2}
+int Plane::emitter_count() const { return size != INF; } // can't sample an infinite plane
+
+double Plane::emitter_area(int prim) const { return M_PI * size * size; }
+
+bool Plane::sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                           Vec3d &point, Vec3d &normal, double &pdf) const
+{
+    // uniform point on the disk of radius size
+    Vec3d t = (std::abs(this->normal[0]) > 0.1 ? Vec3d(0,1,0) : Vec3d(1,0,0)).cross(this->normal).normalize();
+    Vec3d b = this->normal.cross(t);
+    double r = size * sqrt(u1), phi = 2 * M_PI * u2;
+    point = center + t * (r * cos(phi)) + b * (r * sin(phi));
+    normal = this->normal;
+
+    Vec3d to_light = point - ref;
+    double dist2 = to_light.sqrNorm();
+    double cos_light = std::abs(normal.dot(to_light)) / sqrt(dist2);
+    if (cos_light < EPSILON) return false;
+    pdf = dist2 / (emitter_area(prim) * cos_light);
+    return true;
+}
+
+double Plane::emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const
 {
-    std::ifstream obj_file{filepath};
-    std::string line;
-    
-    while(std::getline(obj_file, line)){
-        std::stringstream ss{line};
-        std::string temp;
-
-        ss >> temp;
-        if(temp == "v"){
-            double x,y,z;
-            ss >> x >> y >> z;
-            verts.push_back({x,y,z});
-
-        } else if (temp == "f"){
-            std::string vert_info;
-            std::array<int, 3> vert_indices;
-            for(int i = 0; i < 3; i++){
-                ss >> vert_info;
-                int first_slash = vert_info.find("/");
-                vert_indices[i] = std::stoi(vert_info.substr(0, first_slash)) - 1;
+    Vec3d to_light = point - ref;
+    double dist2 = to_light.sqrNorm();
+    double cos_light = std::abs(normal.dot(to_light)) / sqrt(dist2);
+    if (cos_light < EPSILON) return 0;
+    return dist2 / cos_light;
+}
+
+Mesh::Mesh(const std::string &filepath, int mat, const MeshOptions &options):
+    Object{mat}, options{options}, name{filepath}
+{
+    ScopedTimer timer{"mesh load"};
+    auto start = std::chrono::steady_clock::now();
+    const std::string ext = ".cmesh";
+    bool binary = filepath.size() >= ext.size() && filepath.compare(filepath.size() - ext.size(), ext.size(), ext) == 0;
+    size_t bytes = binary ? load_mesh_file(filepath) : load_obj(filepath);
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    load_seconds = s - build_seconds;
+
+    // including the KD tree build, if there is one
+    std::cout << "Loaded " << filepath << " with " << verts.size() << " verts and " << tris.size()
+        << " tris (" << bytes / 1e6 << " MB) in " << s * 1e3 << " ms, " << bytes / 1e6 / s << " MB/s" << std::endl;
+    print_memory();
+}
+
+size_t Mesh::load_obj(const std::string &filepath)
+{
+    size_t bytes = 0;
+    if (!ObjLoader::load(filepath.c_str(), obj, &bytes)) {
+        std::cerr << "Cannot load mesh: " << filepath << std::endl;
+        throw 1;
+    }
+    MeshArrays arrays;
+    arrays.positions = obj.positions;
+    arrays.tris = obj.tris;
+    arrays.normals = obj.normals;
+    arrays.uvs = obj.uvs;
+    arrays.tri_normals = obj.tri_normals;
+    arrays.tri_uvs = obj.tri_uvs;
+    build(arrays);
+    return bytes;
+}
+
+size_t Mesh::load_mesh_file(const std::string &filepath)
+{
+    MeshArrays arrays;
+    if (!::load_mesh_file(filepath, file, arrays)) {
+        std::cerr << "Cannot load mesh: " << filepath << std::endl;
+        throw 1;
+    }
+    build(arrays);
+    mapped = arrays;
+    if (options.residency_budget) set_residency_budget(options.residency_budget);
+    return file.size;
+}
+
+void Mesh::set_residency_budget(size_t budget)
+{
+    if (pager) pager->print_stats(name);
+    kdtree.set_pager(nullptr);
+    pager.reset();
+    options.residency_budget = budget;
+    if (!budget) {
+        if (file.data) madvise((void *) file.data, file.size, MADV_NORMAL);
+        return;
+    }
+
+    bool in_place = options.positions == PositionFormat::Double && !options.weld && !options.compact_normals;
+    if (!file.data || mapped.treelets.empty() || mapped.kd_nodes.empty() || !in_place) {
+        std::cerr << name << ": not a .cmesh with treelets, or compact options copied it; not paging" << std::endl;
+        return;
+    }
+    // only the pager decides what to read ahead
+    madvise((void *) file.data, file.size, MADV_RANDOM);
+    pager.reset(new TreeletPager{mapped, budget});
+    kdtree.set_pager(pager.get());
+}
+
+void Mesh::build(const MeshArrays &src)
+{
+    auto start = std::chrono::steady_clock::now();
+    // normals aren't used for shading yet, uvs are read by surface_uv
+    std::vector<int> remap;
+    verts = PositionArray{src.positions, options.positions, options.weld, remap};
+    bool welded = verts.size() != src.positions.size();
+    if (welded) {
+        tri_storage.resize(src.tris.size());
+        for (size_t i = 0; i < src.tris.size(); ++i) {
+            for (int j = 0; j < 3; ++j) tri_storage[i][j] = remap[src.tris[i][j]];
+        }
+        tris = tri_storage;
+    } else {
+        tris = src.tris;
+    }
+    uvs = src.uvs;
+    tri_normals = src.tri_normals;
+    tri_uvs = src.tri_uvs;
+
+    if (options.compact_normals) {
+        oct_normals.resize(src.normals.size());
+        for (size_t i = 0; i < src.normals.size(); ++i) oct_normals[i] = octahedral_encode(src.normals[i]);
+    } else {
+        normals = src.normals;
+        // stored ones were computed from the double positions
+        if (!src.face_normals.empty() && options.positions == PositionFormat::Double) {
+            tri_norms = src.face_normals;
+        } else {
+            tri_norm_storage.resize(tris.size());
+            for (size_t i = 0; i < tris.size(); ++i) tri_norm_storage[i] = cross_normal(i);
+            tri_norms = tri_norm_storage;
+        }
+    }
+
+    // A stored tree is still tight around welded doubles, but not around
+    // rounded positions.
+    if (!src.kd_nodes.empty() && options.positions == PositionFormat::Double) {
+        kdtree = KDTree(&verts, tris, src.kd_nodes, src.kd_leaf_tris);
+    } else {
+        kdtree = KDTree(&verts, tris);
+    }
+
+    // drop the parsed arrays that were converted
+    if (options.positions != PositionFormat::Double || welded) std::vector<Vec3d>().swap(obj.positions);
+    if (welded) std::vector<std::array<int, 3>>().swap(obj.tris);
+    if (options.compact_normals) std::vector<Vec3d>().swap(obj.normals);
+    build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+Vec3d Mesh::cross_normal(int tri) const
+{
+    Vec3d vertex0 = verts[tris[tri][0]];
+    Vec3d edge1 = verts[tris[tri][1]] - vertex0;
+    Vec3d edge2 = verts[tris[tri][2]] - vertex0;
+    return edge1.cross(edge2);
+}
+
+Mesh::~Mesh()
+{
+    if (pager) pager->print_stats(name);
+}
+
+bool Mesh::corner_normal(int tri, int corner, Vec3d &n) const
+{
+    if (tri_normals.empty() || tri_normals[tri][corner] < 0) return false;
+    int i = tri_normals[tri][corner];
+    n = options.compact_normals ? octahedral_decode(oct_normals[i]) : normals[i];
+    return true;
+}
+
+size_t Mesh::memory_bytes() const
+{
+    return verts.bytes() + tris.size() * sizeof(tris[0]) + tri_norms.size() * sizeof(Vec3d)
+        + normals.size() * sizeof(Vec3d) + oct_normals.size() * sizeof(uint32_t) + uvs.size() * sizeof(uvs[0])
+        + (tri_normals.size() + tri_uvs.size()) * sizeof(tri_normals[0]) + kdtree.memory_bytes();
+}
+
+void Mesh::print_memory() const
+{
+    auto mb = [](size_t bytes) { return bytes / 1e6; };
+    std::cout << "  " << mb(memory_bytes()) << " MB: positions (" << position_format_name(verts.get_format()) << ") "
+        << mb(verts.bytes()) << ", triangles " << mb(tris.size() * sizeof(tris[0]))
+        << ", face normals " << mb(tri_norms.size() * sizeof(Vec3d))
+        << ", normals " << mb(normals.size() * sizeof(Vec3d) + oct_normals.size() * sizeof(uint32_t))
+        << ", uvs " << mb(uvs.size() * sizeof(uvs[0]))
+        << ", corner indices " << mb((tri_normals.size() + tri_uvs.size()) * sizeof(tri_normals[0]))
+        << ", KD tree " << mb(kdtree.memory_bytes()) << std::endl;
+}
+
+bool Mesh::save(const std::string &filepath) const
+{
+    if (options.positions != PositionFormat::Double || options.compact_normals) {
+        std::cerr << "Cannot save " << filepath << ": compact meshes aren't saved" << std::endl;
+        return false;
+    }
+
+    // Triangles in the order the tree's leaves list them and vertices in the
+    // order those triangles first use them, so each treelet is contiguous.
+    ArrayView<int> leaf_tris = kdtree.get_leaf_tris();
+    size_t n = tris.size(), num_verts = verts.size();
+    std::vector<int> new_vert(num_verts, -1), vert_start(n + 1);
+    std::vector<std::array<int, 3>> new_tris(n), new_tri_normals(tri_normals.size()), new_tri_uvs(tri_uvs.size());
+    std::vector<Vec3d> new_tri_norms(n), new_verts(num_verts);
+    std::vector<int> new_leaf_tris(n);
+    int next_vert = 0;
+    for (size_t k = 0; k < n; ++k) {
+        int t = leaf_tris[k];
+        vert_start[k] = next_vert;
+        for (int j = 0; j < 3; ++j) {
+            int v = tris[t][j];
+            if (new_vert[v] == -1) {
+                new_vert[v] = next_vert++;
+                new_verts[new_vert[v]] = verts[v];
             }
-            tris.push_back(vert_indices);
+            new_tris[k][j] = new_vert[v];
         }
+        new_tri_norms[k] = tri_norms[t];
+        if (!tri_normals.empty()) new_tri_normals[k] = tri_normals[t];
+        if (!tri_uvs.empty()) new_tri_uvs[k] = tri_uvs[t];
+        new_leaf_tris[k] = k;
     }
-    
-    tri_norms.reserve(tris.size());
-    for(uint i = 0; i < tris.size(); i++){
-        const Vec3d &vertex0 = verts[tris[i][0]];
-        const Vec3d &vertex1 = verts[tris[i][1]];  
-        const Vec3d &vertex2 = verts[tris[i][2]];
-        Vec3d edge1 = vertex1 - vertex0;
-        Vec3d edge2 = vertex2 - vertex0;
-        tri_norms.push_back(edge1.cross(edge2));
+    vert_start[n] = next_vert;
+    for (size_t v = 0; v < num_verts; ++v) {
+        if (new_vert[v] == -1) new_verts[next_vert++] = verts[v]; // unused ones at the end
     }
+    size_t bytes_per_tri = sizeof(tris[0]) + sizeof(Vec3d) + sizeof(int)
+        + (kdtree.get_nodes().size() * sizeof(KDTree::Node) + num_verts * sizeof(Vec3d)) / std::max<size_t>(n, 1);
+    std::vector<TreeletRecord> treelets = build_treelets(kdtree.get_nodes(), vert_start, bytes_per_tri);
 
-    
-    kdtree = KDTree(&verts, &tris);
+    MeshArrays arrays;
+    arrays.positions = new_verts;
+    arrays.tris = new_tris;
+    arrays.face_normals = new_tri_norms;
+    arrays.normals = normals;
+    arrays.uvs = uvs;
+    arrays.tri_normals = new_tri_normals;
+    arrays.tri_uvs = new_tri_uvs;
+    arrays.kd_nodes = kdtree.get_nodes();
+    arrays.kd_leaf_tris = new_leaf_tris;
+    arrays.treelets = treelets;
+    return save_mesh_file(filepath, arrays);
+}
 
-    std::cout << "Loaded " << filepath << " with " << verts.size()
-        << " verts and " << tris.size() << " tris." << std::endl;
+Vec3d Mesh::face_normal(int tri) const
+{
+    return tri_norms.empty() ? cross_normal(tri) : tri_norms[tri];
 }
 
 #define KDTREE
@@ -122,11 +375,13 @@ bool Mesh::ray_intersection(const Vec3d &ray_orig,
                             const Vec3d &ray_dir,
                             double &dist,
                             Vec3d &hit_loc,
-                            Vec3d &hit_norm) const
+                            Vec3d &hit_norm,
+                            int *prim) const
 {
     int closest_tri = kdtree.ray_intersect(ray_orig, ray_dir, dist, hit_loc);
     if(closest_tri == -1) return false;
-    hit_norm = tri_norms[closest_tri];
+    hit_norm = face_normal(closest_tri);
+    if (prim) *prim = closest_tri;
     return true;
 }
 
@@ -135,7 +390,8 @@ bool Mesh::ray_intersection(const Vec3d &ray_orig,
                             const Vec3d &ray_dir,
                             double &dist,
                             Vec3d &hit_loc,
-                            Vec3d &hit_norm) const
+                            Vec3d &hit_norm,
+                            int *prim) const
 {
     int closest_tri = -1;
     dist = INF;
@@ -152,7 +408,67 @@ bool Mesh::ray_intersection(const Vec3d &ray_orig,
     }
 
     if(closest_tri == -1) return false;
-    hit_norm = tri_norms[closest_tri];
+    hit_norm = face_normal(closest_tri);
+    if (prim) *prim = closest_tri;
     return true;
 }
-#endif
\ No newline at end of file
+#endif
+
+bool Mesh::surface_uv(int tri, const Vec3d &hit_loc,
+                      double &u, double &v, double &uv_per_length) const
+{
+    if (tri_uvs.empty() || tri < 0 || tri >= int(tris.size())) return false;
+    const std::array<int, 3> &corners = tri_uvs[tri];
+    if (corners[0] == -1 || corners[1] == -1 || corners[2] == -1) return false;
+
+    // barycentrics from the areas opposite each corner
+    Vec3d p0 = verts[tris[tri][0]], p1 = verts[tris[tri][1]], p2 = verts[tris[tri][2]];
+    Vec3d n = face_normal(tri);
+    double inv_area2 = 1 / n.sqrNorm();
+    double b1 = (p2 - hit_loc).cross(p0 - hit_loc).dot(n) * inv_area2;
+    double b2 = (p0 - hit_loc).cross(p1 - hit_loc).dot(n) * inv_area2;
+    double b0 = 1 - b1 - b2;
+    const std::array<double, 2> &t0 = uvs[corners[0]], &t1 = uvs[corners[1]], &t2 = uvs[corners[2]];
+    u = t0[0] * b0 + t1[0] * b1 + t2[0] * b2;
+    v = t0[1] * b0 + t1[1] * b1 + t2[1] * b2;
+
+    // sqrt of the uv area over the surface area
+    double uv_area2 = std::abs((t1[0] - t0[0]) * (t2[1] - t0[1]) - (t2[0] - t0[0]) * (t1[1] - t0[1]));
+    uv_per_length = sqrt(uv_area2 * sqrt(inv_area2));
+    return true;
+}
+
+int Mesh::emitter_count() const { return tris.size(); }
+
+double Mesh::emitter_area(int prim) const { return 0.5 * face_normal(prim).norm(); }
+
+bool Mesh::sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                          Vec3d &point, Vec3d &normal, double &pdf) const
+{
+    // uniform barycentrics
+    double su = sqrt(u1);
+    double b0 = 1 - su, b1 = u2 * su;
+    Vec3d vertex0 = verts[tris[prim][0]];
+    Vec3d vertex1 = verts[tris[prim][1]];
+    Vec3d vertex2 = verts[tris[prim][2]];
+    point = vertex0 * b0 + vertex1 * b1 + vertex2 * (1 - b0 - b1);
+    normal = face_normal(prim);
+    normal.normalize();
+
+    // emits from both sides, like when a path hits it
+    Vec3d to_light = point - ref;
+    double dist2 = to_light.sqrNorm();
+    double cos_light = std::abs(normal.dot(to_light)) / sqrt(dist2);
+    if (cos_light < EPSILON) return false;
+    pdf = dist2 / (emitter_area(prim) * cos_light);
+    return true;
+}
+
+double Mesh::emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const
+{
+    Vec3d to_light = point - ref;
+    double dist2 = to_light.sqrNorm();
+    double cos_light = std::abs(normal.dot(to_light)) / sqrt(dist2);
+    if (cos_light < EPSILON) return 0;
+    return dist2 / cos_light;
+}
@@ -3,18 +3,46 @@
 #include <algorithm>
 #include <vector>
 #include <array>
+#include <memory>
+#include <string>
 
 #include "MathUtils.h"
 #include "KDTree.h"
 #include "Material.h"
+#include "MappedFile.h"
+#include "ObjLoader.h"
+#include "MeshFile.h"
+#include "MeshStorage.h"
+#include "MeshPager.h"
 
 class Object {
     public:
         Material material;
-        Mat2 mat2;
+        int mat = -1; // index in Scene::materials
+        int id = -1; // index in the scene, set by add_object
         Object(const Material &material);
-        Object(const Mat2 &mat2);
-        virtual bool ray_intersection(const Vec3d &, const Vec3d &, double &, Vec3d &, Vec3d &) const = 0;
+        Object(int mat);
+        // prim, if given, gets the piece that was hit, numbered like the
+        // emitter pieces below (the triangle of a mesh)
+        virtual bool ray_intersection(const Vec3d &ray_orig, const Vec3d &ray_dir, double &dist,
+                                      Vec3d &hit_loc, Vec3d &hit_norm, int *prim = nullptr) const = 0;
+
+        // Light sampling for emissive objects, which are split into
+        // emitter_count() pieces (one per triangle for meshes). sample_emitter
+        // picks a point on piece prim as seen from ref, with pdf per solid angle.
+        // emitter_pdf is that pdf for a given point times the area of the piece
+        // it lies on, which doesn't depend on knowing the piece.
+        virtual int emitter_count() const { return 0; }
+        virtual double emitter_area(int prim) const { return 0; }
+        virtual bool sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                                    Vec3d &point, Vec3d &normal, double &pdf) const { return false; }
+        virtual double emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const { return 0; }
+
+        // Texture coordinates at hit_loc on piece prim, as ray_intersection
+        // returned them, and how far uv moves per unit of length along the
+        // surface there. False if the surface has none.
+        virtual bool surface_uv(int prim, const Vec3d &hit_loc,
+                                double &u, double &v, double &uv_per_length) const { return false; }
         virtual ~Object() {}
 };
 
@@ -24,7 +52,7 @@ class Sphere : public Object {
 
 public:
     Sphere(const Vec3d &center, double radius, const Material &material);
-    Sphere(const Vec3d &center, double radius, const Mat2 &mat2);
+    Sphere(const Vec3d &center, double radius, int mat);
     ~Sphere() {}
 
     const Vec3d &get_center() const { return center; }
@@ -33,7 +61,18 @@ public:
                           const Vec3d &ray_dir,
                           double &dist,
                           Vec3d &hit_loc,
-                          Vec3d &hit_norm) const;
+                          Vec3d &hit_norm,
+                          int *prim = nullptr) const;
+
+    int emitter_count() const;
+    double emitter_area(int prim) const;
+    bool sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                        Vec3d &point, Vec3d &normal, double &pdf) const;
+    double emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const;
+
+    // longitude and latitude
+    bool surface_uv(int prim, const Vec3d &hit_loc,
+                    double &u, double &v, double &uv_per_length) const;
 };
 
 class Plane : public Object {
@@ -41,31 +80,108 @@ class Plane : public Object {
     double size;
 
 public:
-    Plane(const Vec3d &normal, const Vec3d &center, const Mat2 &mat2, double size = INF);
+    Plane(const Vec3d &normal, const Vec3d &center, int mat, double size = INF);
     ~Plane() {}
 
     bool ray_intersection(const Vec3d &ray_orig,
                           const Vec3d &ray_dir,
                           double &dist,
                           Vec3d &hit_loc,
-                          Vec3d &hit_norm) const;
+                          Vec3d &hit_norm,
+                          int *prim = nullptr) const;
+
+    int emitter_count() const;
+    double emitter_area(int prim) const;
+    bool sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                        Vec3d &point, Vec3d &normal, double &pdf) const;
+    double emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const;
+};
+
+struct MeshOptions {
+    PositionFormat positions = PositionFormat::Double;
+    bool weld = false;            // merge vertices at the same (stored) position
+    bool compact_normals = false; // face normals per hit instead of stored, shading normals octahedral
+    // Bytes of a .cmesh's treelets kept resident, paging the rest in and out
+    // as rays reach them (MeshPager.h). 0 leaves it all to the OS. Needs the
+    // other options at their defaults, so the mesh is used in place. main
+    // sets it on every mesh with --mesh-budget-mb.
+    size_t residency_budget = 0;
+
+    // about a third of the default's memory
+    static MeshOptions compact() { return MeshOptions{PositionFormat::Float, true, true}; }
 };
 
 class Mesh : public Object {
-    std::vector<Vec3d> verts;
-    std::vector<std::array<int, 3>> tris;
-    std::vector<Vec3d> tri_norms;
+    // Loaded from an OBJ, the arrays are owned here (obj and the storage
+    // vectors). From a .cmesh file they point into the mapped file, unless
+    // the options convert them.
+    ObjMesh obj;
+    std::vector<std::array<int, 3>> tri_storage; // welded
+    std::vector<Vec3d> tri_norm_storage;
+    std::vector<uint32_t> oct_normals;
+    MappedFile file;
+    MeshArrays mapped; // views into file, for paging
+    MeshOptions options;
+    std::unique_ptr<TreeletPager> pager;
+    std::string name;
+
+    PositionArray verts;
+    ArrayView<std::array<int, 3>> tris;
+    ArrayView<Vec3d> tri_norms; // unnormalized, empty with compact normals
+    // per corner normals and uvs, when the source had them
+    ArrayView<Vec3d> normals;
+    ArrayView<std::array<double, 2>> uvs;
+    ArrayView<std::array<int, 3>> tri_normals, tri_uvs;
     KDTree kdtree;
 
+    // both return the bytes read
+    size_t load_obj(const std::string &filepath);
+    size_t load_mesh_file(const std::string &filepath);
+    // converts src as the options say and builds the tree if src has none
+    void build(const MeshArrays &src);
+    Vec3d cross_normal(int tri) const;
+    Vec3d face_normal(int tri) const;
+
 public:
-    Mesh(const std::string &filepath, const Mat2 &mat2);
-    ~Mesh() {}
+    // OBJ, or a binary mesh if the path ends in .cmesh
+    Mesh(const std::string &filepath, int mat, const MeshOptions &options = MeshOptions{});
+    ~Mesh(); // prints the paging stats, if paged
+
+    // time spent reading the file and converting the arrays / building the tree
+    double load_seconds = 0, build_seconds = 0;
+
+    // Writes a .cmesh with the KD tree and treelets included, triangles and
+    // vertices reordered to match. Compact meshes can't be saved.
+    bool save(const std::string &filepath) const;
+
+    // false if the file gave this corner no normal
+    bool corner_normal(int tri, int corner, Vec3d &n) const;
+
+    // Changes MeshOptions::residency_budget after loading, e.g. from the
+    // command line. Only while no rays are traced; 0 stops paging.
+    void set_residency_budget(size_t budget);
+
+    // bytes held by the mesh arrays and the tree, mapped ones included
+    size_t memory_bytes() const;
+    void print_memory() const;
+    TreeQuality tree_quality() const { return kdtree.quality(); }
 
     bool ray_intersection(const Vec3d &ray_orig,
                           const Vec3d &ray_dir,
                           double &dist,
                           Vec3d &hit_loc,
-                          Vec3d &hit_norm) const;
+                          Vec3d &hit_norm,
+                          int *prim = nullptr) const;
+
+    int emitter_count() const;
+    double emitter_area(int prim) const;
+    bool sample_emitter(int prim, const Vec3d &ref, double u1, double u2,
+                        Vec3d &point, Vec3d &normal, double &pdf) const;
+    double emitter_pdf(const Vec3d &ref, const Vec3d &point, const Vec3d &normal) const;
+
+    // from the file's uvs of triangle prim
+    bool surface_uv(int prim, const Vec3d &hit_loc,
+                    double &u, double &v, double &uv_per_length) const;
 
     friend class KDTree;
 };
\ No newline at end of file
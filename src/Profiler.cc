@@ -0,0 +1,145 @@
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
+#include "Profiler.h"
+
+namespace {
+struct Event {
+    const char *name;
+    int64_t start_ns, end_ns;
+};
+
+struct ThreadEvents {
+    int tid;
+    std::vector<Event> ring;
+    uint64_t written = 0; // events ever recorded, ring[written % size] is next
+};
+
+std::atomic<bool> enabled{false};
+size_t ring_size = 0;
+const auto epoch = std::chrono::steady_clock::now();
+
+// every thread's buffer, kept after the thread exits
+std::mutex threads_mutex;
+std::vector<std::unique_ptr<ThreadEvents>> threads;
+thread_local ThreadEvents *thread_events = nullptr;
+}
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+void enable_profiling(size_t events_per_thread)
+{
+    std::lock_guard<std::mutex> lock{threads_mutex};
+    ring_size = std::max<size_t>(events_per_thread, 1);
+    enabled = true;
+}
+
+bool profiling_enabled() { return enabled.load(std::memory_order_relaxed); }
+
+ScopedTimer::ScopedTimer(const char *name): name{name}, start_ns{profiling_enabled() ? now_ns() : -1} {}
+
+ScopedTimer::~ScopedTimer()
+{
+    if (start_ns < 0) return;
+    ThreadEvents *t = thread_events;
+    if (!t) {
+        std::lock_guard<std::mutex> lock{threads_mutex};
+        threads.emplace_back(new ThreadEvents{int(threads.size()), std::vector<Event>(ring_size)});
+        t = thread_events = threads.back().get();
+    }
+    t->ring[t->written % t->ring.size()] = Event{name, start_ns, now_ns()};
+    t->written++;
+}
+
+bool write_chrome_trace(const std::string &filename)
+{
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f) {
+        std::cerr << "Cannot write trace " << filename << std::endl;
+        return false;
+    }
+    std::lock_guard<std::mutex> lock{threads_mutex};
+    // complete ("X") events in microseconds, nested by time in the viewer
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (const auto &t : threads) {
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"thread %d\"}}",
+                first ? "" : ",\n", t->tid, t->tid);
+        first = false;
+        uint64_t n = std::min<uint64_t>(t->written, t->ring.size());
+        for (uint64_t i = t->written - n; i < t->written; ++i) {
+            const Event &e = t->ring[i % t->ring.size()];
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    e.name, t->tid, e.start_ns / 1e3, (e.end_ns - e.start_ns) / 1e3);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    bool ok = fclose(f) == 0;
+    if (ok) std::cout << "Wrote trace " << filename << std::endl;
+    return ok;
+}
+
+void print_profile_summary()
+{
+    struct Phase {
+        double seconds = 0;
+        uint64_t count = 0;
+        std::set<int> threads;
+    };
+    std::map<std::string, Phase> phases;
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock{threads_mutex};
+        for (const auto &t : threads) {
+            uint64_t n = std::min<uint64_t>(t->written, t->ring.size());
+            dropped += t->written - n;
+            for (uint64_t i = t->written - n; i < t->written; ++i) {
+                const Event &e = t->ring[i % t->ring.size()];
+                Phase &p = phases[e.name];
+                p.seconds += (e.end_ns - e.start_ns) / 1e9;
+                p.count++;
+                p.threads.insert(t->tid);
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, Phase>> sorted(phases.begin(), phases.end());
+    std::sort(sorted.begin(), sorted.end(), [](const std::pair<std::string, Phase> &a, const std::pair<std::string, Phase> &b) {
+        return a.second.seconds > b.second.seconds;
+    });
+    std::cout << "phase                     seconds      count  threads" << std::endl;
+    for (const auto &p : sorted) {
+        printf("%-24s %9.3f %10llu %8zu\n", p.first.c_str(), p.second.seconds,
+               (unsigned long long) p.second.count, p.second.threads.size());
+    }
+    if (dropped) std::cout << dropped << " older events were overwritten" << std::endl;
+}
+
+Progress::Progress(const std::string &label, uint64_t total):
+    label{label}, total{std::max<uint64_t>(total, 1)}, start{std::chrono::steady_clock::now()} {}
+
+void Progress::add(uint64_t items, uint64_t items_rays)
+{
+    uint64_t all_rays = rays.fetch_add(items_rays, std::memory_order_relaxed) + items_rays;
+    uint64_t before = done.fetch_add(items, std::memory_order_relaxed);
+    uint64_t after = before + items;
+    if (before * 10 / total == after * 10 / total) return;
+
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double eta = after < total ? s * (total - after) / after : 0;
+    // one write per line, so lines from different threads don't mix
+    char line[256];
+    snprintf(line, sizeof(line), "%s: %d%%, %.2f Mrays/s, %.1f s elapsed, %.1f s left\n", label.c_str(),
+             int(after * 100 / total), all_rays / std::max(s, 1e-9) / 1e6, s, eta);
+    fputs(line, stdout);
+    fflush(stdout);
+}
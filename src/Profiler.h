@@ -0,0 +1,49 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Phase timers. A ScopedTimer records when its scope began and ended into a
+// ring buffer of the calling thread, so timers nest and no thread waits on
+// another; when a buffer is full the oldest events are overwritten. Nothing
+// is recorded until profiling is enabled, and a timer then costs two clock
+// reads.
+//
+// The events can be written as Chrome trace JSON (chrome://tracing or
+// Perfetto show each thread as a row of nested phases) or summed per phase.
+// Both read every thread's buffer, so call them while no timed work runs.
+
+void enable_profiling(size_t events_per_thread = 1 << 16);
+bool profiling_enabled();
+
+bool write_chrome_trace(const std::string &filename);
+// total time, count and threads of every phase, longest first
+void print_profile_summary();
+
+class ScopedTimer {
+    const char *name;
+    int64_t start_ns;
+
+public:
+    // name must outlive the profile, e.g. a string literal
+    explicit ScopedTimer(const char *name);
+    ~ScopedTimer();
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+};
+
+// Work done across threads, e.g. pixels of a frame. Printed by whichever
+// thread completes the next tenth, with the rays per second so far and the
+// time left at that rate.
+class Progress {
+    std::string label;
+    uint64_t total;
+    std::atomic<uint64_t> done{0}, rays{0};
+    std::chrono::steady_clock::time_point start;
+
+public:
+    Progress(const std::string &label, uint64_t total);
+    void add(uint64_t items, uint64_t items_rays);
+};
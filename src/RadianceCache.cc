@@ -0,0 +1,48 @@
+#include <cmath>
+
+#include "RadianceCache.h"
+
+// dominant axis and sign of the normal, 0-5
+static uint64_t normal_bucket(const Vec3d &n) {
+    double ax = fabs(n[0]), ay = fabs(n[1]), az = fabs(n[2]);
+    if (ax >= ay && ax >= az) return n[0] > 0 ? 0 : 1;
+    if (ay >= az) return n[1] > 0 ? 2 : 3;
+    return n[2] > 0 ? 4 : 5;
+}
+
+uint64_t RadianceCache::key(const Vec3d &pos, const Vec3d &normal, double &cell_size) const {
+    // power of two cell sizes, so the grids of different levels line up
+    double dist = std::max((pos - eye).norm() * settings.cell_scale, 1e-6);
+    int level = int(ceil(log2(dist)));
+    cell_size = ldexp(1.0, level);
+
+    uint64_t h = hash64(uint64_t(level + 512) << 3 | normal_bucket(normal));
+    for (int i = 0; i < 3; ++i) {
+        int64_t c = int64_t(floor(pos[i] / cell_size));
+        h = hash64(h ^ uint64_t(c));
+    }
+    return h;
+}
+
+void RadianceCache::clear(const Vec3d &eye_pos) {
+    cells.clear();
+    eye = eye_pos;
+}
+
+void RadianceCache::add(const Record &record) {
+    double cell_size;
+    Cell &cell = cells[key(record.pos, record.normal, cell_size)];
+    cell.sum = cell.sum + record.value;
+    cell.count++;
+}
+
+bool RadianceCache::lookup(const Vec3d &pos, const Vec3d &normal, const Vec3d &u, Color &value) const {
+    double cell_size;
+    key(pos, normal, cell_size);
+    Vec3d jittered = pos + (u - 0.5) * cell_size;
+
+    auto it = cells.find(key(jittered, normal, cell_size));
+    if (it == cells.end() || it->second.count < settings.min_samples) return false;
+    value = it->second.sum * (1.0 / it->second.count);
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+#include <cstdint>
+
+#include "MathUtils.h"
+
+struct RadianceCacheSettings {
+    double cell_scale = 0.1;  // cell size relative to the distance from the camera
+    int min_samples = 16;     // cells with fewer recorded paths aren't used
+    int depth = 1;            // paths end in the cache from this bounce on (0 is the camera hit)
+    int train_spp = 8;        // samples per training pixel
+    int train_stride = 2;     // every train_stride'th pixel in x and y is traced for training
+};
+
+// Radiance leaving a diffuse surface, recorded by a training pass over the
+// frame and stored in a world space hash grid of cells keyed by position and
+// normal direction. Cells grow with the distance from the camera, so they
+// cover a roughly constant area on screen. Values are divided by the albedo,
+// i.e. they are irradiance / pi, so surfaces of any colour can share a cell.
+//
+// Filled single threaded in pixel order and only read while rendering, so
+// renders with the cache stay deterministic.
+class RadianceCache {
+public:
+    // one diffuse vertex of a training path
+    struct Record {
+        Vec3d pos, normal; // normal facing the incoming ray
+        Color value;       // outgoing radiance / albedo
+    };
+
+private:
+    struct Cell {
+        Color sum = 0;
+        int count = 0;
+    };
+
+    std::unordered_map<uint64_t, Cell> cells;
+    Vec3d eye;
+
+    uint64_t key(const Vec3d &pos, const Vec3d &normal, double &cell_size) const;
+
+public:
+    RadianceCacheSettings settings;
+
+    void clear(const Vec3d &eye);
+    void add(const Record &record);
+    bool empty() const { return cells.empty(); }
+    size_t size() const { return cells.size(); }
+
+    // Jitters the lookup position inside the cell (u in [0, 1)^3), which
+    // averages to a trilinear blend of the neighbouring cells over many paths.
+    // False if that cell hasn't seen enough training paths.
+    bool lookup(const Vec3d &pos, const Vec3d &normal, const Vec3d &u, Color &value) const;
+};
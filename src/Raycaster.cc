@@ -1,4 +1,6 @@
 #include <cmath>
+#include <algorithm>
+#include <chrono>
 #include <omp.h>
 
 #include "MathUtils.h"
@@ -7,24 +9,43 @@
 #include "Light.h"
 #include "Camera.h"
 #include "hdr_utils.h"
+#include "Profiler.h"
 
 
 Scene::Scene(const Color &background):
-    background{background}, use_environment{false} {}
+    background{background}, use_environment{false}, samples{6000}, textures{new TextureCache} {}
+
+int Scene::add_texture(const std::string &filepath) {
+    int tex = textures->open(filepath);
+    if (tex == -1) throw 1;
+    return tex;
+}
 
 void Scene::add_object(Object *obj){
+    obj->id = objects.size();
     objects.emplace_back(obj);
+    lights.add(obj, obj->mat >= 0 ? materials[obj->mat].emissive : Color(0));
 }
 
 void Scene::add_light(const Light &light){
     light_sources.push_back(light);
 }
 
+static thread_local uint64_t thread_rays = 0;
+
+uint64_t Scene::rays_traced_on_thread() { return thread_rays; }
+
 const Object *Scene::hit_scene(const Vec3d &ray_orig,
                                const Vec3d &ray_dir,
                                Vec3d &hit_loc,
-                               Vec3d &hit_norm)
+                               Vec3d &hit_norm,
+                               int *prim) const
 {
+    ++thread_rays;
+    if (traversal_stats_enabled) {
+        traversal_stats.rays++;
+        traversal_stats.object_tests += objects.size();
+    }
     double min_dist = INF;
     const Object *closest_obj = nullptr;
 
@@ -32,38 +53,72 @@ const Object *Scene::hit_scene(const Vec3d &ray_orig,
     for(auto &obj : objects){
         double dist = INF;
         Vec3d tmp_hit_loc, tmp_hit_norm;
-        if(obj->ray_intersection(ray_orig, ray_dir, dist, tmp_hit_loc, tmp_hit_norm)){
+        int tmp_prim = -1;
+        if(obj->ray_intersection(ray_orig, ray_dir, dist, tmp_hit_loc, tmp_hit_norm, &tmp_prim)){
             if (dist < min_dist) {
                 min_dist = dist;
                 closest_obj = obj.get();
                 hit_loc = tmp_hit_loc;
                 hit_norm = tmp_hit_norm;
+                if (prim) *prim = tmp_prim;
             }
         }
     }
     return closest_obj;
 }
 
-void Scene::set_HDRI(const std::string &filepath) {
+bool Scene::occluded(const Vec3d &ray_orig, const Vec3d &ray_dir, double max_dist) const
+{
+    Vec3d hit_loc, hit_norm;
+    if (!hit_scene(ray_orig, ray_dir, hit_loc, hit_norm)) return false;
+    // the light itself is hit at max_dist, leave some slack for rounding
+    return (hit_loc - ray_orig).norm() < max_dist * (1 - 1e-4);
+}
+
+void Scene::set_HDRI(const std::string &filepath, EnvStorage storage) {
     use_environment = true;
-    bool res = HDRLoader::load(filepath.c_str(), environment);
+    environment.storage = storage;
+    auto start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    bool res = HDRLoader::load(filepath.c_str(), environment, &bytes);
     if(!res) {
         std::cerr << "Cannot load HDRI: " << filepath << std::endl;
         throw 1;
     }
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Loaded " << filepath << " (" << environment.width << "x" << environment.height << ", "
+              << bytes / 1e6 << " MB) in " << s * 1e3 << " ms, " << bytes / 1e6 / s << " MB/s" << std::endl;
+    environment.build_mips();
+    environment.build_distribution();
+    std::cout << "Environment stored as " << env_storage_name(storage) << ", "
+              << environment.memory_bytes() / 1e6 << " MB" << std::endl;
 }
 
 void Scene::set_env_rotation(double theta) {
     environment.theta = theta;
 }
 
+void Scene::set_mesh_budget(size_t bytes) {
+    for (auto &obj : objects)
+        if (Mesh *mesh = dynamic_cast<Mesh *>(obj.get())) mesh->set_residency_budget(bytes);
+}
+
 Color Scene::get_background(const Vec3d &dir) const {
     return use_environment ? environment.get_pixel(dir) : background;
 }
 
+Color Scene::get_background(const Vec3d &dir, double footprint) const {
+    if (!use_environment || footprint <= 0) return get_background(dir);
+    return environment.get_filtered(dir, footprint);
+}
+
+double Scene::env_footprint(const Mat2 &mat) const {
+    return filter_environment ? mat.lobe_solid_angle() / samples : 0;
+}
+
 Color Scene::trace(const Vec3d &ray_orig,
                    const Vec3d &ray_dir,
-                   int hit_depth){
+                   int hit_depth) const {
     if(hit_depth >= ray_bounce_limit) return 0;
 
     double min_dist = INF;
@@ -129,7 +184,7 @@ Color Scene::trace(const Vec3d &ray_orig,
 Color Scene::trace2(const Vec3d &ray_orig,
                     const Vec3d &ray_dir,
                     int hit_depth,
-                    bool include_emission)
+                    bool include_emission) const
 {
     if (hit_depth >= ray_bounce_limit) return 0;
 
@@ -139,10 +194,11 @@ Color Scene::trace2(const Vec3d &ray_orig,
 
     if (closest_obj) {
         Vec3d scattered, attenuation, lightE;
-        const Mat2& mat = closest_obj->mat2;
+        const Mat2& mat = materials[closest_obj->mat];
         const Color &alb = mat.albedo;
 
-        Color emissive_col = mat.emissive * include_emission;
+        // emitters outside the light list (infinite planes) are never light sampled
+        Color emissive_col = mat.emissive * (include_emission || !closest_obj->emitter_count());
 
         if(mat.scatter(ray_dir, hit_loc, hit_norm, attenuation, scattered, include_emission)){
             importance_sampling(closest_obj, ray_dir, hit_loc, hit_norm, lightE);
@@ -161,140 +217,398 @@ Color Scene::trace2(const Vec3d &ray_orig,
             return emissive_col;
         }
     } else {
-        return get_background(ray_dir);
+        // after a diffuse bounce the environment was already light sampled
+        return include_emission || !environment_sampled() ? get_background(ray_dir) : 0;
     }
 }
 
+const Mat2 &Scene::textured(const Mat2 &mat, const Object *obj, int prim,
+                            const Vec3d &hit_loc, double cone_width, Mat2 &tmp) const
+{
+    double u, v, uv_per_length;
+    if (mat.albedo_texture == -1 || !obj->surface_uv(prim, hit_loc, u, v, uv_per_length)) return mat;
+    // not scaled by the angle to the surface, so grazing hits stay sharper than they should
+    tmp = mat;
+    tmp.albedo = mat.albedo * textures->sample(mat.albedo_texture, u, v, cone_width * uv_per_length);
+    return tmp;
+}
+
 Color Scene::trace_iterative(Vec3d ray_orig,
-                            Vec3d ray_dir)
+                            Vec3d ray_dir,
+                            Sampler &sampler,
+                            double pixel_angle,
+                            PathAOVs *aovs,
+                            std::vector<RadianceCache::Record> *cache_records) const
 {
-    //
+    // Light found by following the BSDF is weighted against the chance that
+    // direct_lighting would have sampled it (multiple importance sampling).
+    // Camera rays and delta bounces can't be light sampled and count fully.
 
     Vec3d hit_loc, hit_norm;
     Vec3d attenuation = 1;
     Color c = 0;
+    bool specular = true;
+    double bsdf_pdf = 0;
+    double footprint = 0; // of the environment behind the last bounce
+    // a cone around the path for texture lookups, widened at rough bounces
+    double cone_angle = pixel_angle, cone_width = 0;
+    Vec3d prev_loc;
+    // the albedo AOV is taken at the first non-delta hit, as seen through
+    // any mirrors or glass in front of it
+    bool albedo_found = aovs == nullptr;
+
+    // training paths remember their diffuse vertices with the radiance
+    // gathered so far, what's gathered after a vertex is what left it
+    struct CacheVertex {
+        Vec3d pos, normal, attenuation;
+        Color albedo, c_before;
+    };
+    std::vector<CacheVertex> cache_vertices;
+    bool use_cache = use_radiance_cache && cache_records == nullptr;
 
     for (int b = 0; b < ray_bounce_limit; ++b) {
-        const Object *closest_obj = hit_scene(ray_orig, ray_dir, hit_loc, hit_norm);
+        int prim = -1;
+        const Object *closest_obj = hit_scene(ray_orig, ray_dir, hit_loc, hit_norm, &prim);
         if (closest_obj == nullptr) {
-            c = c + attenuation * get_background(ray_dir);
+            double w = 1;
+            if (!specular && environment_sampled())
+                w = power_heuristic(bsdf_pdf, env_light_prob() * environment.pdf(ray_dir));
+            c = c + attenuation * get_background(ray_dir, footprint) * w;
+            if (!albedo_found) aovs->albedo = attenuation * get_background(ray_dir);
             break;
         }
         hit_norm.normalize();
 
-        const Mat2& mat = closest_obj->mat2;
+        cone_width += cone_angle * (hit_loc - ray_orig).norm();
+        Mat2 tmp;
+        const Mat2& mat = textured(materials[closest_obj->mat], closest_obj, prim, hit_loc, cone_width, tmp);
+        if (aovs) {
+            aovs->length = b + 1;
+            if (b == 0) {
+                aovs->normal = hit_norm;
+                aovs->depth = (hit_loc - ray_orig).norm();
+                aovs->object_id = closest_obj->id;
+            }
+        }
+        if (!albedo_found && !mat.is_delta()) {
+            // emitters without a surface colour count as white
+            bool black = mat.albedo[0] <= 0 && mat.albedo[1] <= 0 && mat.albedo[2] <= 0;
+            aovs->albedo = attenuation * (black ? Vec3d(1) : mat.albedo);
+            albedo_found = true;
+        }
         if (mat.emissive[0] > 0 || mat.emissive[1] > 0 || mat.emissive[2] > 0) {
-            c = c + attenuation * mat.emissive;
+            double w = 1;
+            if (!specular) {
+                double light_pdf = (1 - env_light_prob()) * lights.pdf(closest_obj, mat.emissive, prev_loc, hit_loc, hit_norm);
+                if (light_pdf > 0) w = power_heuristic(bsdf_pdf, light_pdf);
+            }
+            c = c + attenuation * mat.emissive * w;
+        }
+
+        bool emissive = mat.emissive[0] > 0 || mat.emissive[1] > 0 || mat.emissive[2] > 0;
+        if (mat.type == Mat2::Diffuse && !emissive && (use_cache || cache_records)) {
+            Vec3d nl = hit_norm.dot(ray_dir) < 0 ? hit_norm : hit_norm * -1;
+            if (cache_records) {
+                cache_vertices.push_back(CacheVertex{hit_loc, nl, attenuation, mat.albedo, c});
+            } else if (b >= radiance_cache.settings.depth) {
+                Color cached;
+                Vec3d u;
+                sampler.get_2d(vertex_dim(b, dim_cache), u[0], u[1]);
+                u[2] = sampler.get_1d(vertex_dim(b, dim_cache_z));
+                if (radiance_cache.lookup(hit_loc, nl, u, cached)) {
+                    c = c + attenuation * mat.albedo * cached;
+                    break;
+                }
+            }
         }
 
-        Vec3d wi = mat.sample(ray_dir, hit_norm);
+        specular = mat.is_delta();
+        footprint = env_footprint(mat);
+        if (!specular) cone_angle = std::max(cone_angle, sqrt(mat.lobe_solid_angle() / samples));
+        if (!specular) c = c + attenuation * direct_lighting(mat, ray_dir, hit_loc, hit_norm, sampler, b);
+
+        double u1, u2;
+        sampler.get_2d(vertex_dim(b, dim_bsdf), u1, u2);
+        Vec3d wi = mat.sample(ray_dir, hit_norm, sampler.get_1d(vertex_dim(b, dim_bsdf_lobe)), u1, u2);
 
         Vec3d reflectance = mat.eval(wi, ray_dir, hit_norm);
-        // double pdf;
-        // mat.eval(wi, ray_dir, hit_norm, reflectance, pdf);
+        if (!specular) {
+            Vec3d f;
+            mat.eval(wi, ray_dir, hit_norm, f, bsdf_pdf);
+        }
 
         attenuation = attenuation * reflectance;
+        if (attenuation[0] <= 0 && attenuation[1] <= 0 && attenuation[2] <= 0) break;
 
         // russian roulette
         if (b > russian_roulette_start_depth) {
             double p = std::max(attenuation[0], std::max(attenuation[1], attenuation[2]));
-            if (random_double_01() > p) {
+            if (sampler.get_1d(vertex_dim(b, dim_roulette)) > p) {
                 break;
             }
             attenuation = attenuation * (1.0 / p);
         }
         
+        prev_loc = hit_loc;
         ray_orig = hit_loc;
         ray_dir = wi;
     }
+
+    for (auto &v : cache_vertices) {
+        Color out = c - v.c_before;
+        Color value;
+        bool valid = true;
+        for (int i = 0; i < 3; ++i) {
+            double div = v.attenuation[i] * v.albedo[i];
+            if (div <= 0) valid = false;
+            else value[i] = out[i] / div;
+        }
+        if (valid) cache_records->push_back(RadianceCache::Record{v.pos, v.normal, value});
+    }
     return c;
 }
 
+void Scene::build_radiance_cache(const Camera &cam) {
+    ScopedTimer timer{"radiance cache"};
+    radiance_cache.clear(cam.get_origin());
+    const RadianceCacheSettings &settings = radiance_cache.settings;
+    int width = cam.get_width(), height = cam.get_height();
+    int stride = settings.train_stride;
+    int train_w = (width + stride - 1) / stride, train_h = (height + stride - 1) / stride;
+
+    std::vector<std::vector<RadianceCache::Record>> records(train_w * train_h);
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int i = 0; i < train_w * train_h; ++i) {
+        int x = i % train_w * stride, y = i / train_w * stride;
+        uint64_t pixel = x + y * uint64_t(width);
+        std::unique_ptr<Sampler> sampler = make_sampler(sampler_type);
+        for(int s = 0; s < settings.train_spp; ++s) {
+            // away from the sample indices the render itself uses
+            uint32_t index = 0x80000000u + s;
+            seed_rng(pixel << 32 | index);
+            sampler->start_sample(x, y, index);
+            double u1, u2;
+            sampler->get_2d(dim_pixel, u1, u2);
+            trace_iterative(cam.get_origin(), cam.ray_dir_at_pixel(x + u1, y + u2), *sampler, cam.pixel_angle(),
+                            nullptr, &records[i]);
+        }
+    }
+
+    // in pixel order, so the cache doesn't depend on the thread schedule
+    for (auto &pixel_records : records) {
+        for (auto &r : pixel_records) radiance_cache.add(r);
+    }
+}
+
+double Scene::env_light_prob() const
+{
+    // split between the environment and the emitters
+    return !environment_sampled() ? 0 : lights.empty() ? 1 : 0.5;
+}
+
+bool Scene::sample_light(const Vec3d &ref, double u_pick, double u1, double u2,
+                         Vec3d &dir, double &dist, Color &radiance, double &pdf,
+                         double env_footprint) const
+{
+    if (lights.empty() && !environment_sampled()) return false;
+
+    double env_prob = env_light_prob();
+    if (u_pick < env_prob) {
+        dir = environment.sample(u1, u2, pdf);
+        if (pdf <= 0) return false;
+        pdf *= env_prob;
+        dist = INF;
+        radiance = get_background(dir, env_footprint);
+        return true;
+    }
+
+    // one light, picked by power with what's left of u_pick
+    double pmf;
+    const LightList::Emitter &light = lights.sample((u_pick - env_prob) / (1 - env_prob), pmf);
+
+    Vec3d light_pt, light_norm;
+    if (!light.obj->sample_emitter(light.prim, ref, u1, u2, light_pt, light_norm, pdf)) return false;
+
+    dir = light_pt - ref;
+    dist = dir.norm();
+    dir = dir * (1.0 / dist);
+    pdf *= pmf * (1 - env_prob);
+    radiance = materials[light.obj->mat].emissive;
+    return true;
+}
+
+Color Scene::direct_lighting(const Mat2 &mat,
+                             const Vec3d &ray_dir,
+                             const Vec3d &hit_loc,
+                             const Vec3d &hit_norm,
+                             Sampler &sampler,
+                             int depth) const
+{
+    double u1, u2;
+    sampler.get_2d(vertex_dim(depth, dim_light), u1, u2);
+    double u_pick = sampler.get_1d(vertex_dim(depth, dim_light_pick));
+
+    Vec3d l;
+    Color radiance;
+    double dist, light_pdf;
+    if (!sample_light(hit_loc, u_pick, u1, u2, l, dist, radiance, light_pdf, env_footprint(mat))) return 0;
+
+    Vec3d f;
+    double bsdf_pdf;
+    mat.eval(l, ray_dir, hit_norm, f, bsdf_pdf);
+    if (f[0] <= 0 && f[1] <= 0 && f[2] <= 0) return 0;
+
+    // shadow ray, anything in the way blocks the environment (dist is INF)
+    if (occluded(hit_loc, l, dist)) return 0;
+
+    return f * radiance * (power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+}
+
 void Scene::importance_sampling(const Object *closest_object,
                                 const Vec3d &ray_dir,
                                 const Vec3d &hit_loc,
                                 const Vec3d &hit_norm,
-                                Vec3d &out_light_E)
+                                Vec3d &out_light_E) const
 {
     out_light_E = Vec3d(0,0,0);
 
-    Mat2 mat = closest_object->mat2;
+    const Mat2 &mat = materials[closest_object->mat];
     if (mat.type != Mat2::Diffuse) return;
 
-    for(auto &obj : objects){
-        const Mat2 &smat = obj->mat2;
-        if (smat.emissive[0] <= 0 && smat.emissive[1] <= 0 && smat.emissive[2] <= 0)
-            continue; // skip non-emissive
-        if (&mat == &smat)
-            continue; // skip self
-        
-        // this has to be a sphere (or maybe disk) (this is really hacky)
-        if (typeid(*obj) != typeid(Sphere)) return;
-        const Sphere &s = dynamic_cast<Sphere&>(*obj);
-
-        Vec3d sw = (s.get_center() - hit_loc).normalize();
-        Vec3d su = (abs(sw[0])>0.01f ? Vec3d(0,1,0):Vec3d(1,0,0)).cross(sw).normalize();
-        Vec3d sv = sw.cross(su);
-
-        // sample sphere by solid angle
-        float cos_a_max = sqrt(1.0f - s.get_radius()*s.get_radius() / (hit_loc-s.get_center()).sqrNorm());
-        float eps1 = random_double_01(), eps2 = random_double_01();
-        float cos_a = 1.0f - eps1 + eps1 * cos_a_max;
-        float sin_a = sqrt(1.0f - cos_a*cos_a);
-        float phi = 2 * M_PI * eps2;
-        Vec3d l = su * cos(phi) * sin_a + sv * sin(phi) * sin_a + sw * cos_a;
-        l.normalize();
+    Vec3d l;
+    Color radiance;
+    double dist, pdf;
+    double u_pick = random_double_01(), u1 = random_double_01(), u2 = random_double_01();
+    if (!sample_light(hit_loc, u_pick, u1, u2, l, dist, radiance, pdf)) return;
 
-        
-        // shadow ray
-        Vec3d light_hit, light_norm;
-        // if we hit the current light source
-        if (hit_scene(hit_loc, l, light_hit, light_norm) == obj.get()) {
-            float omega = 2 * M_PI * (1-cos_a_max);
-            
-            Vec3d rdir = ray_dir;
-            Vec3d nl = hit_norm.dot(rdir) < 0 ? hit_norm : hit_norm * -1;
-            out_light_E = out_light_E + (mat.albedo * smat.emissive) * (std::max(0.0, l.dot(nl)) * omega * M_1_PI);
+    Vec3d nl = hit_norm.dot(ray_dir) < 0 ? hit_norm : hit_norm * -1;
+    double cos_theta = l.dot(nl);
+    if (cos_theta <= 0) return;
+
+    // shadow ray
+    if (occluded(hit_loc, l, dist)) return;
+
+    out_light_E = (mat.albedo * radiance) * (cos_theta * M_1_PI / pdf);
+}
+
+#define RANDOM_ANTIALIASING
+
+Color Scene::sample_pixel(const Camera &cam, int x, int y, int first_sample, int count,
+                          PathAOVs *aov_sum) const {
+    uint64_t pixel = x + y * uint64_t(cam.get_width());
+
+    std::unique_ptr<Sampler> sampler = make_sampler(sampler_type);
+
+    Color c = 0;
+    for(int s = first_sample; s < first_sample + count; ++s) {
+        seed_rng(pixel << 32 | uint32_t(s));
+        sampler->start_sample(x, y, s);
+        #ifdef RANDOM_ANTIALIASING
+        double u1, u2;
+        sampler->get_2d(dim_pixel, u1, u2);
+        double x_0 = x + u1;
+        double y_0 = y + u2;
+        #else
+        double x_0 = x + (sx / double(aa_samples + 1));
+        double y_0 = y + (sy / double(aa_samples + 1));
+        #endif
+        // c = c + trace2(cam.get_origin(), cam.ray_dir_at_pixel(x_0, y_0));
+        PathAOVs path;
+        Color sample = trace_iterative(cam.get_origin(), cam.ray_dir_at_pixel(x_0, y_0), *sampler,
+                                       cam.pixel_angle(), aov_sum ? &path : nullptr);
+        c = c + sample;
+        if (aov_sum) {
+            path.lum2 = luminance(sample) * luminance(sample);
+            aov_sum->add(path);
         }
     }
+    return c;
 }
 
-#define RANDOM_ANTIALIASING
+Color Scene::render_pixel(const Camera &cam, int x, int y) const {
+    return sample_pixel(cam, x, y, 0, samples) * (1.0 / samples);
+}
+
+RenderBuffer Scene::render_region(const Camera &cam, int x0, int y0, int x1, int y1,
+                                  int first_sample, int count) const {
+    int w = x1 - x0, h = y1 - y0;
+    RenderBuffer buf{w, h};
+
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(int i = 0; i < w * h; ++i) {
+        buf.sum[i] = sample_pixel(cam, x0 + i % w, y0 + i / w, first_sample, count);
+        buf.samples[i] = count;
+    }
+    return buf;
+}
 
-std::vector<Color> Scene::render(const Camera &cam){
+void Scene::render_progressive(const Camera &cam, RenderBuffer &buf, int target_samples, int pass_samples,
+                               const std::function<bool(const RenderBuffer &)> &on_pass) const {
+    int width = cam.get_width();
+    int n = width * cam.get_height();
+    if(pass_samples <= 0) return;
+
+    while(true) {
+        uint32_t min_samples = *std::min_element(buf.samples.begin(), buf.samples.end());
+        if(int(min_samples) >= target_samples) break;
+
+        // pixels continue from their own count, so they converge to the same
+        // image no matter how the passes were split up or interrupted
+        #pragma omp parallel for schedule(dynamic, 64)
+        for(int i = 0; i < n; ++i) {
+            int have = buf.samples[i];
+            int count = std::min(pass_samples, target_samples - have);
+            if(count <= 0) continue;
+            buf.sum[i] = buf.sum[i] + sample_pixel(cam, i % width, i / width, have, count);
+            buf.samples[i] += count;
+        }
+
+        std::cout << std::min<int>(min_samples + pass_samples, target_samples) << "/" << target_samples << " samples" << std::endl;
+        if(on_pass && !on_pass(buf)) break;
+    }
+}
+
+std::vector<Color> Scene::render(const Camera &cam, AOVBuffer *aovs,
+                                 std::vector<TraversalStats> *pixel_stats) const {
     int width = cam.get_width();
     int height = cam.get_height();
 
+    ScopedTimer timer{"render"};
     std::vector<Color> pixels(width * height);
-
-    int samples = 6000;
-    double inv_samples = 1.0 / samples;
+    if (aovs) *aovs = AOVBuffer{width, height};
+    if (pixel_stats) pixel_stats->assign(width * height, TraversalStats{});
+    Progress progress{"render", uint64_t(width) * height};
 
     auto trace_rays = [&](int i){
+        uint64_t rays_before = thread_rays;
         int x = i % width;
         int y = i / width;
-
-        // extra aa_samples per pixel
-        Color c = 0;
-        for(int s = 0; s < samples; ++s) {
-            #ifdef RANDOM_ANTIALIASING
-            double x_0 = x + random_double_01();
-            double y_0 = y + random_double_01();
-            #else
-            double x_0 = x + (sx / double(aa_samples + 1));
-            double y_0 = y + (sy / double(aa_samples + 1));
-            #endif
-            // c = c + trace2(cam.get_origin(), cam.ray_dir_at_pixel(x_0, y_0));
-            c = c + trace_iterative(cam.get_origin(), cam.ray_dir_at_pixel(x_0, y_0));
+        TraversalStats before;
+        if (traversal_stats_enabled && pixel_stats) before = traversal_stats;
+
+        if (aovs) {
+            auto start = std::chrono::steady_clock::now();
+            PathAOVs sum;
+            Color c = sample_pixel(cam, x, y, 0, samples, &sum);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            aovs->set(i, sum, c, samples, seconds);
+            pixels[i] = c * (1.0 / samples);
+        } else {
+            pixels[x + y * width] = render_pixel(cam, x, y);
         }
-        c = c * inv_samples;
-        pixels[x + y * width] = c;
+        if (traversal_stats_enabled && pixel_stats) (*pixel_stats)[i] = traversal_stats - before;
 
-        if(i % (int)(height * width / 100.0 * 10) == 0) std::cout << i / (int)(height * width / 100.0) << std::endl;
+        progress.add(1, thread_rays - rays_before);
     };
 
-    #pragma omp parallel for
-    for(int i = 0; i < height * width; ++i) trace_rays(i);
+    #pragma omp parallel
+    {
+        ScopedTimer thread_timer{"render thread"};
+        // nowait so each thread's span ends with its last pixel, not at the barrier
+        #pragma omp for nowait
+        for(int i = 0; i < height * width; ++i) trace_rays(i);
+    }
 
     return pixels;
 }
@@ -2,59 +2,158 @@
 
 #include <vector>
 #include <memory>
+#include <functional>
 
 #include "MathUtils.h"
 #include "Object.h"
 #include "Light.h"
 #include "Camera.h"
 #include "hdr_utils.h"
+#include "RenderBuffer.h"
+#include "AOVBuffer.h"
+#include "LightList.h"
+#include "Sampler.h"
+#include "RadianceCache.h"
+#include "TextureCache.h"
+#include "TraversalStats.h"
 
 constexpr int ray_bounce_limit = 10;
 constexpr int russian_roulette_start_depth = 5;
 
 struct Scene {
     std::vector<std::unique_ptr<Object>> objects;
+    MaterialTable materials; // indexed by Object::mat
     std::vector<Light> light_sources;
+    LightList lights; // emissive objects, filled by add_object
     Color background;
 
     HDRI environment;
     bool use_environment;
+    // light reflected off non-delta surfaces reads a prefiltered environment
+    bool filter_environment = true;
+
+    int samples; // paths per pixel
+    SamplerType sampler_type = SamplerType::Sobol;
+
+    // paths end in the cache at diffuse hits once it has been built
+    bool use_radiance_cache = false;
+    RadianceCache radiance_cache;
+
+    // tiles of every texture the materials use, read as rays reach them
+    std::unique_ptr<TextureCache> textures;
 
 public:
     Scene(const Color &background = 255);
 
+    // objects refer to their material by the index returned here
+    int add_material(const Mat2 &mat) { return materials.add(mat); }
+    // index for Mat2::albedo_texture, the file is a .ctex (see TextureCache.h)
+    int add_texture(const std::string &filepath);
    // TODO: figure out how to do this properly
     void add_object(Object *obj);
 
     void add_light(const Light &light);
 
+    // picks the environment or an emitter with u_pick and a direction from
+    // ref towards it with u1, u2. pdf is per solid angle and includes the
+    // choice of light, dist is INF for the environment, which is looked up
+    // with env_footprint.
+    bool sample_light(const Vec3d &ref, double u_pick, double u1, double u2,
+                      Vec3d &dir, double &dist, Color &radiance, double &pdf,
+                      double env_footprint = 0) const;
+    double env_light_prob() const;
+
+    // one light sample for a non-delta material, MIS weighted against the
+    // BSDF having found the same light
+    Color direct_lighting(const Mat2 &mat,
+                          const Vec3d &ray_dir,
+                          const Vec3d &hit_loc,
+                          const Vec3d &hit_norm,
+                          Sampler &sampler,
+                          int depth) const;
+
+    // next event estimation at a diffuse hit without MIS, for trace2
     void importance_sampling(const Object *closest_object,
                              const Vec3d &ray_dir,
                              const Vec3d &hit_loc,
                              const Vec3d &hit_norm,
-                             Vec3d &outLightE);
+                             Vec3d &outLightE) const;
 
+    // true if something is hit before max_dist along the ray
+    bool occluded(const Vec3d &ray_orig, const Vec3d &ray_dir, double max_dist) const;
+
+    // prim, if given, gets the piece of the object that was hit
     const Object *hit_scene(const Vec3d &ray_orig,
                             const Vec3d &ray_dir,
                             Vec3d &hit_loc,
-                            Vec3d &hit_norm);
-
-    void set_HDRI(const std::string &filepath);
+                            Vec3d &hit_norm,
+                            int *prim = nullptr) const;
+    // hit_scene calls (shadow rays included) made on the calling thread so
+    // far, by any scene
+    static uint64_t rays_traced_on_thread();
+
+    // traces training paths over the frame to fill radiance_cache, needs
+    // the scene to be complete and to be redone when the camera moves
+    void build_radiance_cache(const Camera &cam);
+
+    // the texels are decoded straight into storage, see EnvStorage
+    void set_HDRI(const std::string &filepath, EnvStorage storage = EnvStorage::Float);
     void set_env_rotation(double theta); // set clockwise z rotation
+    // pages every .cmesh mesh's treelets to stay under bytes each, see
+    // Mesh::set_residency_budget
+    void set_mesh_budget(size_t bytes);
 
     Color get_background(const Vec3d &dir) const;
-
-    std::vector<Color> render(const Camera &cam);
+    // environment blurred over footprint steradians around dir
+    Color get_background(const Vec3d &dir, double footprint) const;
+    // Footprint for light reflected off mat: its lobe split between the
+    // samples of a pixel, so it goes to a point lookup as samples grows.
+    // Light sampling and BSDF sampling read the same blurred environment,
+    // so their MIS weights still add up.
+    double env_footprint(const Mat2 &mat) const;
+    bool environment_sampled() const { return use_environment && environment.can_sample(); }
+
+    // rendering only reads the scene, so several frames (cameras) can be
+    // in flight at once
+    // aovs, if given, gets the first hit albedo, normal, depth and object,
+    // the path lengths and the time spent per pixel. pixel_stats gets the
+    // traversal counts of every pixel, when they are compiled in.
+    std::vector<Color> render(const Camera &cam, AOVBuffer *aovs = nullptr,
+                              std::vector<TraversalStats> *pixel_stats = nullptr) const;
+    Color render_pixel(const Camera &cam, int x, int y) const;
+
+    // sum of samples [first_sample, first_sample + count) for one pixel. Every
+    // sample is seeded from its pixel and index, so splitting a frame into
+    // tiles or sample ranges gives the same result as rendering it whole.
+    // aov_sum, if given, gets the AOVs of those samples added to it.
+    Color sample_pixel(const Camera &cam, int x, int y, int first_sample, int count,
+                       PathAOVs *aov_sum = nullptr) const;
+    // accumulates the region [x0, x1) x [y0, y1) into a buffer of its size
+    RenderBuffer render_region(const Camera &cam, int x0, int y0, int x1, int y1,
+                               int first_sample, int count) const;
+    // Adds passes of pass_samples to buf until every pixel has target_samples,
+    // continuing from the counts already in buf (e.g. a loaded checkpoint).
+    // on_pass runs after every pass, returning false stops early. Renders
+    // nothing unless pass_samples is positive.
+    void render_progressive(const Camera &cam, RenderBuffer &buf, int target_samples, int pass_samples,
+                            const std::function<bool(const RenderBuffer &)> &on_pass = nullptr) const;
 
 private:
     Color trace(const Vec3d &ray_orig,
                 const Vec3d &ray_dir,
-                int hit_depth = 0);
+                int hit_depth = 0) const;
     Color trace2(const Vec3d &ray_orig,
                  const Vec3d &ray_dir,
                  int hit_depth = 0,
-                 bool include_emission = true);
-    Color trace_iterative(Vec3d ray_orig, Vec3d ray_dir);
+                 bool include_emission = true) const;
+    // mat with its texture looked up where piece prim of obj was hit, cone_width across
+    // the ray there; mat itself when it has no texture
+    const Mat2 &textured(const Mat2 &mat, const Object *obj, int prim,
+                         const Vec3d &hit_loc, double cone_width, Mat2 &tmp) const;
+    // pixel_angle is the spread of camera rays, for texture filtering
+    Color trace_iterative(Vec3d ray_orig, Vec3d ray_dir, Sampler &sampler, double pixel_angle,
+                          PathAOVs *aovs = nullptr,
+                          std::vector<RadianceCache::Record> *cache_records = nullptr) const;
 };
 
 
@@ -0,0 +1,23 @@
+#include "RenderBuffer.h"
+
+RenderBuffer::RenderBuffer(int width, int height):
+    width{width}, height{height}, sum(width * height, Color(0)), samples(width * height, 0) {}
+
+void RenderBuffer::merge(const RenderBuffer &other, int x0, int y0) {
+    for (int y = 0; y < other.height; ++y) {
+        for (int x = 0; x < other.width; ++x) {
+            int src = x + y * other.width;
+            int dst = (x0 + x) + (y0 + y) * width;
+            sum[dst] = sum[dst] + other.sum[src];
+            samples[dst] += other.samples[src];
+        }
+    }
+}
+
+std::vector<Color> RenderBuffer::resolve() const {
+    std::vector<Color> pixels(width * height, Color(0));
+    for (int i = 0; i < width * height; ++i) {
+        if (samples[i]) pixels[i] = sum[i] * (1.0 / samples[i]);
+    }
+    return pixels;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+
+#include "MathUtils.h"
+
+// Unnormalized radiance sums and per-pixel sample counts. Buffers covering
+// different tiles or different sample ranges of the same frame can be merged,
+// and the final image is sum / samples.
+struct RenderBuffer {
+    int width = 0, height = 0;
+    std::vector<Color> sum;
+    std::vector<uint32_t> samples;
+
+    RenderBuffer() {}
+    RenderBuffer(int width, int height);
+
+    // adds a buffer covering the region starting at (x0, y0)
+    void merge(const RenderBuffer &other, int x0 = 0, int y0 = 0);
+    std::vector<Color> resolve() const;
+};
@@ -0,0 +1,239 @@
+#include <vector>
+#include <algorithm>
+
+#include "Sampler.h"
+#include "MathUtils.h"
+
+bool sampler_type_from_name(const std::string &name, SamplerType &type) {
+    if (name == "random") type = SamplerType::Random;
+    else if (name == "sobol") type = SamplerType::Sobol;
+    else if (name == "bluenoise") type = SamplerType::BlueNoise;
+    else return false;
+    return true;
+}
+
+const char *sampler_name(SamplerType type) {
+    switch (type) {
+    case SamplerType::Random: return "random";
+    case SamplerType::Sobol: return "sobol";
+    case SamplerType::BlueNoise: return "bluenoise";
+    }
+    return "unknown";
+}
+
+static uint32_t reverse_bits(uint32_t x) {
+    x = (x << 16) | (x >> 16);
+    x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+    x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+    x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+    x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+    return x;
+}
+
+// Owen scrambling by hashing (Laine-Karras permutation on the reversed bits,
+// constants from Burley's "Practical Hash-based Owen Scrambling"). Every bit
+// is flipped depending only on the bits above it, so stratification is kept.
+static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47c;
+    x ^= x * 0xb82f1e52;
+    x ^= x * 0xc7afe638;
+    x ^= x * 0x8d22f6e6;
+    return reverse_bits(x);
+}
+
+// first two Sobol dimensions, which are all that's needed: every pair of
+// dimensions gets its own shuffle of the sample order instead of higher
+// dimensions of the sequence
+static void sobol_2d(uint32_t index, uint32_t &x, uint32_t &y) {
+    x = reverse_bits(index);
+    y = 0;
+    for (uint32_t v = 1u << 31; index; index >>= 1, v ^= v >> 1) {
+        if (index & 1) y ^= v;
+    }
+}
+
+static uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return hash64(uint64_t(seed) << 32 | v);
+}
+
+static double to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+}
+
+class RandomSampler : public Sampler {
+public:
+    // the thread's rng is already seeded from the pixel and sample index
+    void start_sample(int, int, uint32_t) override {}
+    double get_1d(int) override { return random_double_01(); }
+    void get_2d(int, double &u1, double &u2) override {
+        u1 = random_double_01();
+        u2 = random_double_01();
+    }
+};
+
+class SobolSampler : public Sampler {
+protected:
+    uint32_t seed;
+    uint32_t index;
+
+    void sobol(int dim, uint32_t &x, uint32_t &y) const {
+        uint32_t dim_seed = hash_combine(seed, dim);
+        sobol_2d(nested_uniform_scramble(index, dim_seed), x, y);
+        x = nested_uniform_scramble(x, hash_combine(dim_seed, 0));
+        y = nested_uniform_scramble(y, hash_combine(dim_seed, 1));
+    }
+
+public:
+    void start_sample(int x, int y, uint32_t i) override {
+        seed = hash64(uint64_t(uint32_t(x)) << 32 | uint32_t(y));
+        index = i;
+    }
+    double get_1d(int dim) override {
+        uint32_t x, y;
+        sobol(dim, x, y);
+        return to_unit(x);
+    }
+    void get_2d(int dim, double &u1, double &u2) override {
+        uint32_t x, y;
+        sobol(dim, x, y);
+        u1 = to_unit(x);
+        u2 = to_unit(y);
+    }
+};
+
+constexpr int blue_noise_size = 64;
+
+// Void and cluster (Ulichney): points are added one at a time into the largest
+// gap of a toroidal gaussian energy, and their rank becomes the threshold.
+// With more than half the pixels set, the biggest void of the ones is also
+// the tightest cluster of the zeros, so one insertion loop covers every phase.
+static std::vector<uint32_t> make_blue_noise() {
+    const int n = blue_noise_size, count = n * n, radius = 6;
+    const double sigma = 1.9;
+
+    std::vector<double> kernel((2 * radius + 1) * (2 * radius + 1));
+    for (int dy = -radius; dy <= radius; ++dy) {
+        for (int dx = -radius; dx <= radius; ++dx) {
+            kernel[(dy + radius) * (2 * radius + 1) + dx + radius] = exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<double> energy(count, 0);
+    std::vector<char> set(count, 0);
+    auto splat = [&](int p, double sign) {
+        int px = p % n, py = p / n;
+        for (int dy = -radius; dy <= radius; ++dy) {
+            for (int dx = -radius; dx <= radius; ++dx) {
+                int q = ((py + dy + n) % n) * n + (px + dx + n) % n;
+                energy[q] += sign * kernel[(dy + radius) * (2 * radius + 1) + dx + radius];
+            }
+        }
+    };
+    auto extreme = [&](bool want_set, bool want_max) {
+        int best = -1;
+        for (int p = 0; p < count; ++p) {
+            if (bool(set[p]) != want_set) continue;
+            if (best < 0 || (want_max ? energy[p] > energy[best] : energy[p] < energy[best])) best = p;
+        }
+        return best;
+    };
+
+    // random initial points, then swap the tightest cluster into the largest
+    // void until that stops moving anything
+    uint64_t counter = 0;
+    int initial = count / 10;
+    for (int placed = 0; placed < initial;) {
+        int p = hash64(++counter) % count;
+        if (set[p]) continue;
+        set[p] = 1;
+        splat(p, 1);
+        ++placed;
+    }
+    for (int iter = 0; iter < count; ++iter) {
+        int cluster = extreme(true, true);
+        set[cluster] = 0;
+        splat(cluster, -1);
+        int gap = extreme(false, false);
+        set[gap] = 1;
+        splat(gap, 1);
+        if (gap == cluster) break;
+    }
+
+    std::vector<uint32_t> rank(count);
+    std::vector<char> initial_set = set;
+    std::vector<double> initial_energy = energy;
+
+    // initial points ranked by removing the tightest cluster first
+    for (int r = initial - 1; r >= 0; --r) {
+        int cluster = extreme(true, true);
+        set[cluster] = 0;
+        splat(cluster, -1);
+        rank[cluster] = r;
+    }
+
+    set = initial_set;
+    energy = initial_energy;
+    for (int r = initial; r < count; ++r) {
+        int gap = extreme(false, false);
+        set[gap] = 1;
+        splat(gap, 1);
+        rank[gap] = r;
+    }
+
+    // as 32 bit fractions, centred in their bucket
+    for (auto &r : rank) r = uint32_t((r + 0.5) / count * 4294967296.0);
+    return rank;
+}
+
+// Per pixel toroidal shift of a sequence shared by the whole frame (Georgiev
+// and Fajardo's blue noise dithered sampling): neighbouring pixels get very
+// different shifts, so the error at low sample counts is high frequency and
+// much less visible. Each dimension reads the texture at its own offset.
+class BlueNoiseSampler : public SobolSampler {
+    const std::vector<uint32_t> &noise;
+    int px, py;
+
+    uint32_t shift(int dim) const {
+        uint32_t h = hash_combine(0xb1e7, dim);
+        int x = (px + (h & 0xff)) % blue_noise_size;
+        int y = (py + (h >> 8 & 0xff)) % blue_noise_size;
+        return noise[y * blue_noise_size + x];
+    }
+
+public:
+    BlueNoiseSampler(): noise{blue_noise()} {}
+
+    static const std::vector<uint32_t> &blue_noise() {
+        static const std::vector<uint32_t> texture = make_blue_noise();
+        return texture;
+    }
+
+    void start_sample(int x, int y, uint32_t i) override {
+        seed = 0x5eed;
+        index = i;
+        px = x & (blue_noise_size - 1);
+        py = y & (blue_noise_size - 1);
+    }
+    double get_1d(int dim) override {
+        uint32_t x, y;
+        sobol(dim, x, y);
+        return to_unit(x + shift(2 * dim)); // wraps around
+    }
+    void get_2d(int dim, double &u1, double &u2) override {
+        uint32_t x, y;
+        sobol(dim, x, y);
+        u1 = to_unit(x + shift(2 * dim));
+        u2 = to_unit(y + shift(2 * dim + 1));
+    }
+};
+
+std::unique_ptr<Sampler> make_sampler(SamplerType type) {
+    switch (type) {
+    case SamplerType::Sobol: return std::unique_ptr<Sampler>(new SobolSampler);
+    case SamplerType::BlueNoise: return std::unique_ptr<Sampler>(new BlueNoiseSampler);
+    case SamplerType::Random: break;
+    }
+    return std::unique_ptr<Sampler>(new RandomSampler);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+// Sources of the random numbers for one path. Every number a path uses comes
+// from a fixed dimension, so a dimension always means the same thing (e.g.
+// the bsdf direction at the second bounce) and low discrepancy sequences can
+// stratify it across the samples of a pixel.
+//
+// the values double as the sampler id stored in checkpoints
+enum class SamplerType : uint32_t {
+    Random = 1,    // independent uniform numbers
+    Sobol = 2,     // Owen scrambled Sobol, scrambled per pixel
+    BlueNoise = 3, // one Owen scrambled Sobol for the frame, shifted per pixel by blue noise
+};
+
+// random, sobol or bluenoise
+bool sampler_type_from_name(const std::string &name, SamplerType &type);
+const char *sampler_name(SamplerType type);
+
+// dimension layout: the pixel jitter, then dims_per_vertex for every bounce
+constexpr int dim_pixel = 0; // 2d
+constexpr int dims_camera = 2;
+constexpr int dims_per_vertex = 10;
+enum VertexDim {
+    dim_light_pick = 0, // environment or emitter, and which emitter
+    dim_light = 1,      // 2d, point on the light
+    dim_bsdf_lobe = 3,  // reflect or refract, radius in the metal fuzz ball
+    dim_bsdf = 4,       // 2d, direction
+    dim_roulette = 6,
+    dim_cache = 7,      // 2d, then 1d at dim_cache_z: lookup position in the radiance cache cell
+    dim_cache_z = 9,
+};
+
+inline int vertex_dim(int depth, VertexDim d) { return dims_camera + depth * dims_per_vertex + d; }
+
+class Sampler {
+public:
+    virtual ~Sampler() {}
+
+    // sample `index` of pixel (x, y), called before any get
+    virtual void start_sample(int x, int y, uint32_t index) = 0;
+    virtual double get_1d(int dim) = 0;
+    // dim and dim + 1, stratified together
+    virtual void get_2d(int dim, double &u1, double &u2) = 0;
+};
+
+// one per thread, they keep the state of the current sample
+std::unique_ptr<Sampler> make_sampler(SamplerType type);
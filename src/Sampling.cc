@@ -0,0 +1,47 @@
+#include "Sampling.h"
+
+void sample_uniform_sphere(int n, const double *u1, const double *u2,
+                           double *x, double *y, double *z, double *pdf) {
+    #pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        double zi = 1 - 2 * u1[i];
+        double r = sqrt(std::max(0.0, 1 - zi * zi));
+        double s, c;
+        sincos_2pi(u2[i], s, c);
+        x[i] = r * c;
+        y[i] = r * s;
+        z[i] = zi;
+        pdf[i] = 0.25 * M_1_PI;
+    }
+}
+
+void sample_cosine_hemisphere(int n, const double *u1, const double *u2,
+                              double *x, double *y, double *z, double *pdf) {
+    #pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        double r = sqrt(u1[i]);
+        double zi = sqrt(std::max(0.0, 1 - u1[i]));
+        double s, c;
+        sincos_2pi(u2[i], s, c);
+        x[i] = r * c;
+        y[i] = r * s;
+        z[i] = zi;
+        pdf[i] = zi * M_1_PI;
+    }
+}
+
+void sample_cone(int n, double cos_max, const double *u1, const double *u2,
+                 double *x, double *y, double *z, double *pdf) {
+    double cone_pdf = 1 / (2 * M_PI * (1 - cos_max));
+    #pragma omp simd
+    for (int i = 0; i < n; ++i) {
+        double cos_theta = 1 - u1[i] * (1 - cos_max);
+        double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+        double s, c;
+        sincos_2pi(u2[i], s, c);
+        x[i] = sin_theta * c;
+        y[i] = sin_theta * s;
+        z[i] = cos_theta;
+        pdf[i] = cone_pdf;
+    }
+}
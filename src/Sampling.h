@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cmath>
+
+#include "MathUtils.h"
+
+// Closed form warps from uniform numbers in [0, 1) to directions, with the
+// pdf of the result (per solid angle, or per volume for the ball). Every one
+// uses a fixed number of uniforms and no rejection loop, so they map
+// stratified / low discrepancy samples to stratified directions.
+
+// t, b, n right handed and orthonormal for unit n, without branches
+// (Duff et al., "Building an Orthonormal Basis, Revisited")
+inline void orthonormal_basis(const Vec3d &n, Vec3d &t, Vec3d &b) {
+    double sign = std::copysign(1.0, n[2]);
+    double a = -1.0 / (sign + n[2]);
+    double c = n[0] * n[1] * a;
+    t = Vec3d(1 + sign * n[0] * n[0] * a, sign * c, -sign * n[0]);
+    b = Vec3d(c, sign + n[1] * n[1] * a, -n[1]);
+}
+
+inline Vec3d to_world(const Vec3d &local, const Vec3d &n) {
+    Vec3d t, b;
+    orthonormal_basis(n, t, b);
+    return t * local[0] + b * local[1] + n * local[2];
+}
+
+inline Vec3d sample_uniform_sphere(double u1, double u2, double &pdf) {
+    double z = 1 - 2 * u1;
+    double r = sqrt(std::max(0.0, 1 - z * z));
+    double phi = 2 * M_PI * u2;
+    pdf = 0.25 * M_1_PI;
+    return Vec3d(r * cos(phi), r * sin(phi), z);
+}
+
+// uniform in the unit ball, pdf per unit volume
+inline Vec3d sample_uniform_ball(double u1, double u2, double u3, double &pdf) {
+    double sphere_pdf;
+    Vec3d d = sample_uniform_sphere(u1, u2, sphere_pdf);
+    pdf = 0.75 * M_1_PI;
+    return d * cbrt(u3);
+}
+
+// around the unit normal n, pdf = cos / pi
+inline Vec3d sample_cosine_hemisphere(const Vec3d &n, double u1, double u2, double &pdf) {
+    double r = sqrt(u1), phi = 2 * M_PI * u2;
+    double z = sqrt(std::max(0.0, 1 - u1));
+    pdf = z * M_1_PI;
+    return to_world(Vec3d(r * cos(phi), r * sin(phi), z), n);
+}
+
+// uniform in the cone of directions within acos(cos_max) of the unit axis
+inline Vec3d sample_cone(const Vec3d &axis, double cos_max, double u1, double u2, double &pdf) {
+    double cos_theta = 1 - u1 * (1 - cos_max);
+    double sin_theta = sqrt(std::max(0.0, 1 - cos_theta * cos_theta));
+    double phi = 2 * M_PI * u2;
+    pdf = 1 / (2 * M_PI * (1 - cos_max));
+    return to_world(Vec3d(sin_theta * cos(phi), sin_theta * sin(phi), cos_theta), axis);
+}
+
+// GGX microfacet distribution, local frame with the normal along z
+inline double ggx_d(const Vec3d &m, double alpha) {
+    if (m[2] <= 0) return 0;
+    double a2 = alpha * alpha;
+    double d = m[2] * m[2] * (a2 - 1) + 1;
+    return a2 / (M_PI * d * d);
+}
+
+// Smith masking for one direction
+inline double ggx_g1(const Vec3d &w, double alpha) {
+    if (w[2] <= 0) return 0;
+    double tan2 = (w[0] * w[0] + w[1] * w[1]) / (w[2] * w[2]);
+    return 2 / (1 + sqrt(1 + alpha * alpha * tan2));
+}
+
+// Microfacet normal visible from wo (local frame, wo[2] > 0), Heitz's
+// "Sampling the GGX Distribution of Visible Normals". pdf is of the normal:
+// G1(wo) max(0, wo.m) D(m) / wo.z
+inline Vec3d sample_ggx_vndf(const Vec3d &wo, double alpha, double u1, double u2, double &pdf) {
+    // stretch to the hemisphere configuration
+    Vec3d vh = Vec3d(alpha * wo[0], alpha * wo[1], wo[2]).normalize();
+    double len2 = vh[0] * vh[0] + vh[1] * vh[1];
+    Vec3d t1 = len2 > 0 ? Vec3d(-vh[1], vh[0], 0) * (1 / sqrt(len2)) : Vec3d(1, 0, 0);
+    Vec3d t2 = vh.cross(t1);
+
+    // point on the projected disk, squashed towards the visible half
+    double r = sqrt(u1), phi = 2 * M_PI * u2;
+    double p1 = r * cos(phi), p2 = r * sin(phi);
+    double s = 0.5 * (1 + vh[2]);
+    p2 = (1 - s) * sqrt(std::max(0.0, 1 - p1 * p1)) + s * p2;
+
+    Vec3d nh = t1 * p1 + t2 * p2 + vh * sqrt(std::max(0.0, 1 - p1 * p1 - p2 * p2));
+    Vec3d m = Vec3d(alpha * nh[0], alpha * nh[1], std::max(1e-9, nh[2])).normalize();
+
+    pdf = ggx_g1(wo, alpha) * std::max(0.0, wo.dot(m)) * ggx_d(m, alpha) / wo[2];
+    return m;
+}
+
+// sin and cos of 2 pi u for u in [0, 1), without library calls so the batched
+// loops vectorize. Reduced to [-pi/4, pi/4] around the nearest quarter turn,
+// where the Taylor series below are good to about 1e-10.
+inline void sincos_2pi(double u, double &s, double &c) {
+    int q = int(4 * u + 0.5);
+    double r = (u - q * 0.25) * (2 * M_PI);
+    double r2 = r * r;
+    double sr = r * (1 + r2 * (-1 / 6.0 + r2 * (1 / 120.0 + r2 * (-1 / 5040.0 + r2 * (1 / 362880.0 + r2 * (-1 / 39916800.0))))));
+    double cr = 1 + r2 * (-1 / 2.0 + r2 * (1 / 24.0 + r2 * (-1 / 720.0 + r2 * (1 / 40320.0 + r2 * (-1 / 3628800.0)))));
+
+    // rotate by q quarter turns
+    bool swap = q & 1;
+    double sign_s = (q & 2) ? -1 : 1;
+    double sign_c = ((q + 1) & 2) ? -1 : 1;
+    s = sign_s * (swap ? cr : sr);
+    c = sign_c * (swap ? sr : cr);
+}
+
+// Batched versions over n samples in structure of arrays layout, in the local
+// frame (z up). Plain branch free loops so they vectorize.
+void sample_uniform_sphere(int n, const double *u1, const double *u2,
+                           double *x, double *y, double *z, double *pdf);
+void sample_cosine_hemisphere(int n, const double *u1, const double *u2,
+                              double *x, double *y, double *z, double *pdf);
+void sample_cone(int n, double cos_max, const double *u1, const double *u2,
+                 double *x, double *y, double *z, double *pdf);
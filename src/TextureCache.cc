@@ -0,0 +1,383 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "TextureCache.h"
+#include "MappedFile.h"
+
+struct TextureCache::Tile {
+    uint16_t texels[tile_size * tile_size * 3]; // half rgb, rows top first
+};
+
+static const char texture_magic[8] = {'C', 'R', 'A', 'Y', 'T', 'E', 'X', 0};
+static const uint32_t texture_version = 1;
+static const uint64_t texture_alignment = 4096;
+
+struct TextureHeader {
+    char magic[8];
+    uint32_t version, tile_size;
+    uint32_t width, height, levels, unused;
+};
+
+struct LevelEntry {
+    uint32_t width, height;
+    uint64_t offset;
+};
+
+namespace {
+// the last tiles a thread used, looked up without the lock
+struct LocalTile {
+    uint32_t serial = 0;
+    uint64_t key = 0;
+    std::shared_ptr<const TextureCache::Tile> tile;
+};
+struct LocalTiles {
+    static const int size = 8;
+    LocalTile entries[size];
+    int next = 0;
+    uint64_t hits = 0; // added to the cache's count in batches
+};
+thread_local LocalTiles local_tiles;
+std::atomic<uint32_t> next_serial{1};
+}
+
+// A tile's key packs its texture, level and position. open rejects files
+// whose fields would not fit, so keys never collide.
+static const int key_tile_bits = 20, key_level_bits = 8, key_tex_bits = 16;
+static const uint64_t key_tile_mask = (uint64_t(1) << key_tile_bits) - 1;
+static const uint64_t key_level_mask = (uint64_t(1) << key_level_bits) - 1;
+
+static uint64_t tile_key(int tex, int level, int tx, int ty)
+{
+    return uint64_t(tex) << (2 * key_tile_bits + key_level_bits) | uint64_t(level) << (2 * key_tile_bits)
+        | uint64_t(ty) << key_tile_bits | uint64_t(tx);
+}
+
+static int tiles_across(int texels) { return (texels + TextureCache::tile_size - 1) / TextureCache::tile_size; }
+
+TextureCache::TextureCache(size_t budget): budget{budget}, serial{next_serial++} {}
+
+TextureCache::~TextureCache()
+{
+    if (local_hits + shared_hits + misses) print_stats();
+    for (Texture &t : textures) ::close(t.fd);
+}
+
+int TextureCache::open(const std::string &path)
+{
+    Texture t;
+    t.path = path;
+    t.fd = ::open(path.c_str(), O_RDONLY);
+    TextureHeader header;
+    if (t.fd < 0 || pread(t.fd, &header, sizeof(header), 0) != sizeof(header)
+        || memcmp(header.magic, texture_magic, sizeof(texture_magic)) != 0
+        || header.version != texture_version || header.tile_size != tile_size || header.levels == 0) {
+        std::cerr << "Cannot load texture " << path << ": not a .ctex written by this version" << std::endl;
+        if (t.fd >= 0) ::close(t.fd);
+        return -1;
+    }
+
+    auto reject = [&](const std::string &why) {
+        std::cerr << "Cannot load texture " << path << ": " << why << std::endl;
+        ::close(t.fd);
+        return -1;
+    };
+
+    // the levels halve down to 1x1, with tile positions that fit a tile key
+    const uint64_t max_texels = (key_tile_mask + 1) * tile_size;
+    if (header.width == 0 || header.height == 0 || header.width > max_texels || header.height > max_texels)
+        return reject("bad size " + std::to_string(header.width) + "x" + std::to_string(header.height));
+    std::vector<LevelEntry> expected{LevelEntry{header.width, header.height, 0}};
+    while (expected.back().width > 1 || expected.back().height > 1)
+        expected.push_back(LevelEntry{std::max(expected.back().width / 2, 1u), std::max(expected.back().height / 2, 1u), 0});
+    if (header.levels != expected.size())
+        return reject(std::to_string(header.levels) + " levels, expected " + std::to_string(expected.size()));
+    if (textures.size() > (uint64_t(1) << key_tex_bits) - 1)
+        return reject("too many textures open");
+
+    struct stat st;
+    std::vector<LevelEntry> entries(header.levels);
+    size_t bytes = entries.size() * sizeof(LevelEntry);
+    if (fstat(t.fd, &st) != 0 || pread(t.fd, entries.data(), bytes, sizeof(header)) != ssize_t(bytes))
+        return reject("truncated");
+    uint64_t file_size = st.st_size;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const LevelEntry &e = entries[i];
+        int w = e.width, h = e.height;
+        uint64_t tiles = uint64_t(tiles_across(w)) * tiles_across(h);
+        if (e.width != expected[i].width || e.height != expected[i].height)
+            return reject("level " + std::to_string(i) + " is " + std::to_string(e.width) + "x" + std::to_string(e.height));
+        if (e.offset > file_size || tiles > (file_size - e.offset) / sizeof(Tile))
+            return reject("level " + std::to_string(i) + " runs past the end of the file");
+        t.levels.push_back(Level{w, h, tiles_across(w), tiles_across(h), e.offset});
+    }
+    textures.push_back(std::move(t));
+    return textures.size() - 1;
+}
+
+std::shared_ptr<const TextureCache::Tile> TextureCache::find_tile(uint64_t key)
+{
+    {
+        std::lock_guard<std::mutex> lock{mutex};
+        auto it = tiles.find(key);
+        if (it != tiles.end()) {
+            lru.splice(lru.begin(), lru, it->second.lru);
+            shared_hits.fetch_add(1, std::memory_order_relaxed);
+            return it->second.tile;
+        }
+    }
+
+    // read without the lock, another thread may read the same tile meanwhile
+    const Texture &t = textures[key >> (2 * key_tile_bits + key_level_bits)];
+    const Level &level = t.levels[(key >> (2 * key_tile_bits)) & key_level_mask];
+    uint64_t index = ((key >> key_tile_bits) & key_tile_mask) * level.tiles_x + (key & key_tile_mask);
+    std::shared_ptr<Tile> tile{new Tile};
+    if (pread(t.fd, tile->texels, sizeof(Tile), level.offset + index * sizeof(Tile)) != ssize_t(sizeof(Tile))) {
+        std::cerr << "Cannot read a tile of " << t.path << std::endl;
+        memset(tile->texels, 0, sizeof(Tile));
+    }
+    misses.fetch_add(1, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock{mutex};
+    auto it = tiles.find(key);
+    if (it != tiles.end()) return it->second.tile;
+    lru.push_front(key);
+    tiles.emplace(key, Entry{tile, lru.begin()});
+    resident_bytes += sizeof(Tile);
+    while (resident_bytes > budget && lru.size() > 1) {
+        tiles.erase(lru.back());
+        lru.pop_back();
+        resident_bytes -= sizeof(Tile);
+        evictions.fetch_add(1, std::memory_order_relaxed);
+    }
+    peak_bytes = std::max(peak_bytes, resident_bytes);
+    return tile;
+}
+
+const TextureCache::Tile &TextureCache::tile(int tex, int level, int tx, int ty)
+{
+    uint64_t key = tile_key(tex, level, tx, ty);
+    LocalTiles &local = local_tiles;
+    for (const LocalTile &e : local.entries) {
+        if (e.key == key && e.serial == serial) {
+            if (++local.hits == 1024) {
+                local_hits.fetch_add(local.hits, std::memory_order_relaxed);
+                local.hits = 0;
+            }
+            return *e.tile;
+        }
+    }
+    LocalTile &e = local.entries[local.next];
+    local.next = (local.next + 1) % LocalTiles::size;
+    e.tile = find_tile(key);
+    e.key = key;
+    e.serial = serial;
+    return *e.tile;
+}
+
+Vec3d TextureCache::texel(int tex, int level, int x, int y)
+{
+    const Tile &t = tile(tex, level, x / tile_size, y / tile_size);
+    const uint16_t *p = &t.texels[3 * ((y % tile_size) * tile_size + x % tile_size)];
+    return Vec3d(half_to_float(p[0]), half_to_float(p[1]), half_to_float(p[2]));
+}
+
+Vec3d TextureCache::bilinear(int tex, int level, double u, double v)
+{
+    const Level &l = textures[tex].levels[level];
+    double px = u * l.width - 0.5, py = v * l.height - 0.5;
+    int x0 = int(floor(px)), y0 = int(floor(py));
+    double fx = px - x0, fy = py - y0;
+
+    Vec3d ret = 0;
+    for (int j = 0; j < 2; ++j) {
+        int y = ((y0 + j) % l.height + l.height) % l.height;
+        for (int i = 0; i < 2; ++i) {
+            int x = ((x0 + i) % l.width + l.width) % l.width;
+            double w = (i ? fx : 1 - fx) * (j ? fy : 1 - fy);
+            ret = ret + texel(tex, level, x, y) * w;
+        }
+    }
+    return ret;
+}
+
+Vec3d TextureCache::sample(int tex, double u, double v, double footprint)
+{
+    u -= floor(u);
+    v = 1 - (v - floor(v));
+    const Texture &t = textures[tex];
+    double level = log2(footprint * std::max(t.levels[0].width, t.levels[0].height));
+    if (!(level > 0)) return bilinear(tex, 0, u, v);
+    level = std::min(level, double(t.levels.size() - 1));
+
+    int l0 = int(level);
+    int l1 = std::min(l0 + 1, int(t.levels.size()) - 1);
+    double f = level - l0;
+    return bilinear(tex, l0, u, v) * (1 - f) + bilinear(tex, l1, u, v) * f;
+}
+
+void TextureCache::print_stats() const
+{
+    uint64_t local = local_hits, shared = shared_hits, read = misses;
+    uint64_t total = std::max<uint64_t>(local + shared + read, 1);
+    std::cout << "Textures: " << textures.size() << " open, " << local << " thread local hits ("
+        << 100.0 * local / total << "%), " << shared << " shared hits, " << read << " tiles read ("
+        << read * sizeof(Tile) / 1e6 << " MB), " << evictions << " evictions, peak "
+        << peak_bytes / 1e6 << " of " << budget / 1e6 << " MB" << std::endl;
+}
+
+// Conversion
+
+static double srgb_to_linear(double c)
+{
+    return c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+}
+
+static uint32_t get32(const uint8_t *p) { return p[0] | p[1] << 8 | p[2] << 16 | uint32_t(p[3]) << 24; }
+
+// rows top first
+static bool load_bmp(const MappedFile &file, int &width, int &height, std::vector<Vec3d> &texels)
+{
+    const uint8_t *d = file.data;
+    if (file.size < 54 || d[0] != 'B' || d[1] != 'M') return false;
+    uint32_t offset = get32(d + 10);
+    width = int32_t(get32(d + 18));
+    int h = int32_t(get32(d + 22));
+    int bpp = d[28] | d[29] << 8;
+    uint32_t compression = get32(d + 30);
+    height = std::abs(h);
+    if (width <= 0 || height == 0 || (bpp != 24 && bpp != 32) || (compression != 0 && compression != 3)) return false;
+    size_t row_size = (size_t(width) * bpp / 8 + 3) / 4 * 4;
+    if (offset + row_size * height > file.size) return false;
+
+    double table[256];
+    for (int i = 0; i < 256; ++i) table[i] = srgb_to_linear(i / 255.0);
+    texels.resize(size_t(width) * height);
+    for (int y = 0; y < height; ++y) {
+        // stored bottom to top unless the height is negative, in (b,g,r) order
+        const uint8_t *row = d + offset + row_size * (h > 0 ? height - 1 - y : y);
+        for (int x = 0; x < width; ++x) {
+            const uint8_t *p = row + x * bpp / 8;
+            texels[size_t(y) * width + x] = Vec3d(table[p[2]], table[p[1]], table[p[0]]);
+        }
+    }
+    return true;
+}
+
+static bool load_pfm(const MappedFile &file, int &width, int &height, std::vector<Vec3d> &texels)
+{
+    // "PF\n<width> <height>\n<scale>\n", little endian when the scale is negative
+    char header[64] = {};
+    memcpy(header, file.data, std::min<size_t>(file.size, sizeof(header) - 1));
+    double scale;
+    int header_len;
+    if (sscanf(header, "PF %d %d %lf%n", &width, &height, &scale, &header_len) != 3 || scale >= 0) return false;
+    ++header_len; // the newline after the scale
+    if (width <= 0 || height <= 0 || header_len + size_t(width) * height * 12 > file.size) return false;
+
+    const float *rows = (const float *) (file.data + header_len);
+    texels.resize(size_t(width) * height);
+    for (int y = 0; y < height; ++y) {
+        // also stored bottom to top
+        const float *row = rows + size_t(height - 1 - y) * width * 3;
+        for (int x = 0; x < width; ++x)
+            texels[size_t(y) * width + x] = Vec3d(row[3 * x], row[3 * x + 1], row[3 * x + 2]);
+    }
+    return true;
+}
+
+bool convert_texture(const std::string &in, const std::string &out)
+{
+    MappedFile file;
+    int width = 0, height = 0;
+    std::vector<Vec3d> texels;
+    if (!file.open(in.c_str()) || !(load_bmp(file, width, height, texels) || load_pfm(file, width, height, texels))) {
+        std::cerr << "Cannot load image " << in << ": only uncompressed 24 or 32 bit BMP and PFM are read" << std::endl;
+        return false;
+    }
+
+    struct Image {
+        int width, height;
+        std::vector<Vec3d> texels;
+    };
+    std::vector<Image> levels;
+    levels.push_back(Image{width, height, std::move(texels)});
+    while (levels.back().width > 1 || levels.back().height > 1) {
+        const Image &src = levels.back();
+        Image dst{std::max(src.width / 2, 1), std::max(src.height / 2, 1), {}};
+        dst.texels.resize(size_t(dst.width) * dst.height);
+        for (int y = 0; y < dst.height; ++y) {
+            int y0 = y * src.height / dst.height, y1 = (y + 1) * src.height / dst.height;
+            for (int x = 0; x < dst.width; ++x) {
+                int x0 = x * src.width / dst.width, x1 = (x + 1) * src.width / dst.width;
+                Vec3d sum = 0;
+                for (int sy = y0; sy < y1; ++sy)
+                    for (int sx = x0; sx < x1; ++sx) sum = sum + src.texels[size_t(sy) * src.width + sx];
+                dst.texels[size_t(y) * dst.width + x] = sum * (1.0 / ((y1 - y0) * (x1 - x0)));
+            }
+        }
+        levels.push_back(std::move(dst));
+    }
+
+    TextureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, texture_magic, sizeof(texture_magic));
+    header.version = texture_version;
+    header.tile_size = TextureCache::tile_size;
+    header.width = width;
+    header.height = height;
+    header.levels = levels.size();
+
+    std::vector<LevelEntry> entries;
+    uint64_t offset = sizeof(header) + levels.size() * sizeof(LevelEntry);
+    for (const Image &l : levels) {
+        offset = (offset + texture_alignment - 1) / texture_alignment * texture_alignment;
+        entries.push_back(LevelEntry{uint32_t(l.width), uint32_t(l.height), offset});
+        offset += uint64_t(tiles_across(l.width)) * tiles_across(l.height) * sizeof(TextureCache::Tile);
+    }
+
+    std::string tmp_path = out + ".tmp";
+    FILE *f = fopen(tmp_path.c_str(), "wb");
+    if (!f) {
+        std::cerr << "Cannot write texture " << tmp_path << std::endl;
+        return false;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+        && fwrite(entries.data(), sizeof(LevelEntry), entries.size(), f) == entries.size();
+    uint64_t written = sizeof(header) + entries.size() * sizeof(LevelEntry);
+    static const char zeros[texture_alignment] = {};
+    TextureCache::Tile tile;
+    const int ts = TextureCache::tile_size;
+    for (size_t i = 0; i < levels.size() && ok; ++i) {
+        const Image &l = levels[i];
+        ok = fwrite(zeros, 1, entries[i].offset - written, f) == entries[i].offset - written;
+        for (int ty = 0; ty < tiles_across(l.height) && ok; ++ty) {
+            for (int tx = 0; tx < tiles_across(l.width) && ok; ++tx) {
+                // padded with the edge texels
+                for (int y = 0; y < ts; ++y) {
+                    int sy = std::min(ty * ts + y, l.height - 1);
+                    for (int x = 0; x < ts; ++x) {
+                        const Vec3d &c = l.texels[size_t(sy) * l.width + std::min(tx * ts + x, l.width - 1)];
+                        for (int k = 0; k < 3; ++k) tile.texels[3 * (y * ts + x) + k] = float_to_half(c[k]);
+                    }
+                }
+                ok = fwrite(&tile, sizeof(tile), 1, f) == 1;
+            }
+        }
+        written = entries[i].offset + uint64_t(tiles_across(l.width)) * tiles_across(l.height) * sizeof(tile);
+    }
+    ok = fclose(f) == 0 && ok;
+
+    if (!ok || rename(tmp_path.c_str(), out.c_str()) != 0) {
+        std::cerr << "Failed to write texture " << out << std::endl;
+        remove(tmp_path.c_str());
+        return false;
+    }
+    std::cout << "Wrote " << out << ": " << width << "x" << height << ", " << levels.size() << " levels, "
+        << written / 1e6 << " MB" << std::endl;
+    return true;
+}
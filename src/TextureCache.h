@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "MathUtils.h"
+
+// Image textures, read a tile at a time from .ctex files. A .ctex holds the
+// mip chain of an image (each level half the size of the one before, down to
+// 1x1) cut into tile_size x tile_size tiles of half float linear rgb. Edge
+// tiles are padded to full size, so a tile's place in the file follows from
+// its level and position.
+//
+// Tiles are read on first use and kept in one LRU list shared by all threads
+// until more than the budget is held. Each thread also keeps the last few
+// tiles it read, which it finds again without taking the lock. Those hold
+// on to a tile after it is evicted until the thread moves on, so the budget
+// can be exceeded by a few tiles per thread.
+class TextureCache {
+public:
+    static constexpr int tile_size = 64;
+    struct Tile;
+
+private:
+    struct Level {
+        int width, height, tiles_x, tiles_y;
+        uint64_t offset;
+    };
+    struct Texture {
+        std::string path;
+        int fd = -1;
+        std::vector<Level> levels;
+    };
+    struct Entry {
+        std::shared_ptr<const Tile> tile;
+        std::list<uint64_t>::iterator lru;
+    };
+
+    std::vector<Texture> textures;
+    size_t budget;
+    uint32_t serial; // tells this cache's tiles apart in the per thread lists
+
+    std::mutex mutex; // held for the shared list
+    std::unordered_map<uint64_t, Entry> tiles;
+    std::list<uint64_t> lru; // most recently used first
+    size_t resident_bytes = 0, peak_bytes = 0;
+    std::atomic<uint64_t> local_hits{0}, shared_hits{0}, misses{0}, evictions{0};
+
+    // from the shared list, reading it on a miss
+    std::shared_ptr<const Tile> find_tile(uint64_t key);
+    const Tile &tile(int tex, int level, int tx, int ty);
+    Vec3d texel(int tex, int level, int x, int y);
+    Vec3d bilinear(int tex, int level, double u, double v);
+
+public:
+    explicit TextureCache(size_t budget = size_t(256) << 20);
+    TextureCache(const TextureCache &) = delete;
+    TextureCache &operator=(const TextureCache &) = delete;
+    ~TextureCache(); // prints the stats, if anything was looked up
+
+    // -1 if the file can't be read (the error is printed). Not safe while
+    // other threads are sampling.
+    int open(const std::string &path);
+    void set_budget(size_t bytes) { budget = bytes; }
+    int count() const { return textures.size(); }
+    int width(int tex) const { return textures[tex].levels[0].width; }
+    int height(int tex) const { return textures[tex].levels[0].height; }
+
+    // Trilinear lookup that repeats outside [0, 1)^2, with v = 0 the bottom
+    // row as in OBJ files. footprint is the width the lookup covers in uv,
+    // a point lookup when that is below a texel.
+    Vec3d sample(int tex, double u, double v, double footprint);
+
+    void print_stats() const;
+};
+
+// writes in, a 24 or 32 bit BMP (taken as sRGB) or a PFM (linear), as a .ctex
+bool convert_texture(const std::string &in, const std::string &out);
@@ -0,0 +1,63 @@
+#include <algorithm>
+#include <iostream>
+
+#include "TraversalStats.h"
+#include "ImageWriter.h"
+
+thread_local TraversalStats traversal_stats;
+
+TraversalStats &TraversalStats::operator+=(const TraversalStats &o)
+{
+    rays += o.rays;
+    object_tests += o.object_tests;
+    box_tests += o.box_tests;
+    nodes += o.nodes;
+    tri_tests += o.tri_tests;
+    return *this;
+}
+
+TraversalStats TraversalStats::operator-(const TraversalStats &o) const
+{
+    TraversalStats d;
+    d.rays = rays - o.rays;
+    d.object_tests = object_tests - o.object_tests;
+    d.box_tests = box_tests - o.box_tests;
+    d.nodes = nodes - o.nodes;
+    d.tri_tests = tri_tests - o.tri_tests;
+    return d;
+}
+
+void print_traversal_stats(const TraversalStats &total)
+{
+    double rays = std::max<uint64_t>(total.rays, 1);
+    std::cout << total.rays << " rays, per ray: " << total.object_tests / rays << " objects, "
+        << total.box_tests / rays << " box tests, " << total.nodes / rays << " nodes entered, "
+        << total.tri_tests / rays << " triangle tests" << std::endl;
+}
+
+// piecewise linear blue, cyan, green, yellow, red
+static Color false_colour(double t)
+{
+    static const Color stops[5] = {Color(0, 0, 1), Color(0, 1, 1), Color(0, 1, 0), Color(1, 1, 0), Color(1, 0, 0)};
+    t = std::min(std::max(t, 0.0), 1.0) * 4;
+    int i = std::min(int(t), 3);
+    double f = t - i;
+    return stops[i] * (1 - f) + stops[i + 1] * f;
+}
+
+bool write_cost_heatmap(const std::string &filename, int width, int height,
+                        const std::vector<TraversalStats> &pixels)
+{
+    if (pixels.empty()) return false;
+    std::vector<uint64_t> costs(pixels.size());
+    for (size_t i = 0; i < pixels.size(); ++i) costs[i] = pixels[i].cost();
+    std::vector<uint64_t> sorted = costs;
+    size_t p99 = sorted.size() * 99 / 100;
+    std::nth_element(sorted.begin(), sorted.begin() + p99, sorted.end());
+    double top = std::max<uint64_t>(sorted[p99], 1);
+
+    std::vector<Color> image(pixels.size());
+    for (size_t i = 0; i < pixels.size(); ++i) image[i] = false_colour(costs[i] / top);
+    std::cout << "cost heatmap " << filename << ": red is " << top << " box and triangle tests per pixel" << std::endl;
+    return write_image(filename, width, height, image.data());
+}
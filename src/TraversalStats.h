@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Counts of the work done to trace rays, kept per thread. Counting is
+// compiled in with -DTRAVERSAL_STATS (make STATS=1); otherwise every
+// counting site is an if on a false constant and disappears.
+#ifdef TRAVERSAL_STATS
+constexpr bool traversal_stats_enabled = true;
+#else
+constexpr bool traversal_stats_enabled = false;
+#endif
+
+struct TraversalStats {
+    uint64_t rays = 0;         // Scene::hit_scene calls
+    uint64_t object_tests = 0; // objects intersected
+    uint64_t box_tests = 0;    // KD tree node bounds tested
+    uint64_t nodes = 0;        // nodes whose bounds the ray hit
+    uint64_t tri_tests = 0;    // triangles intersected in leaves
+
+    TraversalStats &operator+=(const TraversalStats &o);
+    TraversalStats operator-(const TraversalStats &o) const;
+    // box and triangle tests, the usual cost metric for a heatmap
+    uint64_t cost() const { return box_tests + tri_tests; }
+};
+
+// the calling thread's counts so far
+extern thread_local TraversalStats traversal_stats;
+
+// per ray averages of a frame
+void print_traversal_stats(const TraversalStats &total);
+
+// Per pixel cost() in false colour, blue through green to red at the 99th
+// percentile, as a BMP.
+bool write_cost_heatmap(const std::string &filename, int width, int height,
+                        const std::vector<TraversalStats> &pixels);
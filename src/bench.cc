@@ -0,0 +1,230 @@
+// End to end benchmark: renders a fixed set of reference scenes at a fixed
+// size and spp and writes their timings as JSON. Every scene runs in its own
+// forked process, so its peak RSS is its own. Renders are seeded per pixel
+// and sample, so runs only differ in speed.
+//   make bench && ./bench [--spp n] [--width w] [--scene name] [--out bench.json]
+//
+// load_s and build_s are the meshes' file parse and KD tree build, rays
+// counts every hit_scene call (camera, bounce and shadow rays) and samples
+// are camera paths.
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <omp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Raycaster.h"
+
+struct BenchScene {
+    std::string name;
+    std::function<Scene(Camera &)> build;
+};
+
+static Scene spheres_scene(Camera &cam) {
+    Scene scene{Color(0.3)};
+    std::vector<Mat2> mats = {
+        {Mat2::Diffuse, Vec3d(0.8), 0, 0, 0},
+        {Mat2::Diffuse, Vec3d(0.4, 0.4, 0.8), 0, 0, 0},
+        {Mat2::Metal, Vec3d(0.79, 0.56, 0.21), 0, 0, 0},
+        {Mat2::Metal, Vec3d(0.4, 0.8, 0.4), 0, 0.6, 0},
+        {Mat2::Dielectric, Vec3d(1), 0, 0, 1.5},
+    };
+    for (int i = 0; i < int(mats.size()); ++i)
+        scene.add_object(new Sphere{{(i - 2) * 1.1, 0, -1}, 0.5, scene.add_material(mats[i])});
+    scene.add_object(new Sphere{{0, -100.5, -1}, 100, scene.add_material(mats[0])});
+    scene.add_object(new Sphere{{-2, 3, 1}, 0.7, scene.add_material(Mat2{Mat2::Diffuse, Vec3d(0), Vec3d(20), 0, 0})});
+    cam.move_from_to({0, 1, 3}, {0, 0, -1});
+    return scene;
+}
+
+// HDRI_test_scene's glossy and glass set, lit by an emitter instead of an HDR
+static Scene glossy_glass_scene(Camera &cam) {
+    Scene scene{Color(0.2)};
+    int chrome = scene.add_material(Mat2{Mat2::Metal, 1, 0, 0, 0});
+    int gold = scene.add_material(Mat2{Mat2::Metal, {0.86, 0.66, 0.26}, 0, 0.1, 0});
+    int glass = scene.add_material(Mat2{Mat2::Dielectric, Vec3d(0.8, 0, 0.8), 0, 0, 1.5});
+    double sphere_r = 0.5, spacing = 2 * sphere_r + 0.2;
+    scene.add_object(new Sphere{{-1.5 * spacing, 0, 0}, sphere_r, chrome});
+    scene.add_object(new Sphere{{1.5 * spacing, 0, 0}, sphere_r, glass});
+    scene.add_object(new Plane{{0, 1, 0}, {0, -sphere_r - 0.05, 0}, scene.add_material(Mat2{Mat2::Metal, 0.8, 0, 0.12, 0}), 3});
+    scene.add_object(new Mesh{"../assets/meshes/monkey_low.obj", gold});
+    scene.add_object(new Sphere{{1, 4, 2}, 1, scene.add_material(Mat2{Mat2::Diffuse, Vec3d(0), Vec3d(12), 0, 0})});
+    cam.move_from_to({0, 0.6, 3}, {0, 0.3, 0});
+    return scene;
+}
+
+// A diffuse mesh on a floor, framed by the bounds of its vertices. With a
+// budget, the OBJ is converted to a .cmesh in the working directory first
+// and loaded paged (MeshPager.h); the conversion counts as setup.
+static std::function<Scene(Camera &)> mesh_scene(const std::string &path, const Vec3d &lo, const Vec3d &hi,
+                                                 size_t budget = 0) {
+    return [=](Camera &cam) {
+        Scene scene{Color(0.3)};
+        Vec3d center = (lo + hi) * 0.5;
+        double size = (hi - lo).norm();
+        std::string mesh_path = path;
+        MeshOptions options;
+        if (budget) {
+            std::string file = path.substr(path.find_last_of('/') + 1);
+            mesh_path = file.substr(0, file.find_last_of('.')) + ".cmesh";
+            if (!Mesh{path, -1}.save(mesh_path)) throw 1;
+            options.residency_budget = budget;
+        }
+        scene.add_object(new Mesh{mesh_path, scene.add_material(Mat2{Mat2::Diffuse, Vec3d(0.7, 0.6, 0.5), 0, 0, 0}), options});
+        scene.add_object(new Plane{{0, 1, 0}, {center[0], lo[1], center[2]}, scene.add_material(Mat2{Mat2::Diffuse, Vec3d(0.8), 0, 0, 0}), 4 * size});
+        scene.add_object(new Sphere{center + Vec3d(-0.6, 1, 0.8) * size, 0.2 * size,
+                                    scene.add_material(Mat2{Mat2::Diffuse, Vec3d(0), Vec3d(15), 0, 0})});
+        cam.move_from_to(center + Vec3d(0, 0.2, 1.1) * size, center);
+        return scene;
+    };
+}
+
+static const std::vector<BenchScene> bench_scenes = {
+    {"spheres", spheres_scene},
+    {"glossy_glass", glossy_glass_scene},
+    {"bunny_low", mesh_scene("../assets/meshes/bunny_low.obj", {-0.435, -0.393, -0.444}, {0.564, 0.612, 0.320})},
+    {"head", mesh_scene("../assets/meshes/head.obj", {-8.31, -7.53, -38.56}, {8.72, 8.29, -28.24})},
+    {"wolf", mesh_scene("../assets/meshes/wolf.obj", {-11.07, -3.72, -29.97}, {8.61, 7.75, -24.82})},
+    {"monkey", mesh_scene("../assets/meshes/monkey.obj", {-7.18, -5.17, -30.02}, {7.18, 5.17, -21.08})},
+    // less than its 1.3 MB of treelets, so they are evicted and paged back in
+    {"bunny_paged", mesh_scene("../assets/meshes/bunny_low.obj", {-0.435, -0.393, -0.444}, {0.564, 0.612, 0.320}, 1 << 20)},
+};
+
+static uint64_t rays_on_all_threads() {
+    uint64_t rays = 0;
+    #pragma omp parallel reduction(+:rays)
+    rays += Scene::rays_traced_on_thread();
+    return rays;
+}
+
+// runs in the child, returns the scene's JSON object
+static std::string run_scene(const BenchScene &b, int width, int height, int spp) {
+    auto start = std::chrono::steady_clock::now();
+    Camera cam{width, height, 45};
+    Scene scene = b.build(cam);
+    double setup_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    scene.samples = spp;
+
+    double load_s = 0, build_s = 0;
+    size_t tris = 0;
+    for (auto &obj : scene.objects) {
+        if (const Mesh *mesh = dynamic_cast<const Mesh *>(obj.get())) {
+            load_s += mesh->load_seconds;
+            build_s += mesh->build_seconds;
+            tris += mesh->emitter_count();
+        }
+    }
+
+    uint64_t rays_before = rays_on_all_threads();
+    start = std::chrono::steady_clock::now();
+    std::vector<Color> pixels = scene.render(cam);
+    double render_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t rays = rays_on_all_threads() - rays_before;
+
+    // so a broken render shows up next to its timing
+    double mean = 0;
+    for (const Color &c : pixels) mean += luminance(c);
+    mean /= pixels.size();
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double samples = double(width) * height * spp;
+
+    std::ostringstream json;
+    json << "{\"name\": \"" << b.name << "\", \"triangles\": " << tris << ", \"setup_s\": " << setup_s
+         << ", \"load_s\": " << load_s << ", \"build_s\": " << build_s << ", \"render_s\": " << render_s
+         << ", \"rays\": " << rays << ", \"rays_per_s\": " << rays / render_s
+         << ", \"samples_per_s\": " << samples / render_s << ", \"peak_rss_mb\": " << usage.ru_maxrss / 1024.0
+         << ", \"mean_luminance\": " << mean << "}";
+    return json.str();
+}
+
+// the scene's JSON from a forked child, empty if it failed
+static std::string run_scene_forked(const BenchScene &b, int width, int height, int spp) {
+    int fds[2];
+    if (pipe(fds) < 0) return "";
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        std::string json;
+        try {
+            json = run_scene(b, width, height, spp);
+        } catch (...) {
+            _exit(1);
+        }
+        std::cout.flush();
+        _exit(write(fds[1], json.data(), json.size()) == ssize_t(json.size()) ? 0 : 1);
+    }
+    close(fds[1]);
+    std::string json;
+    char buf[4096];
+    ssize_t n;
+    while (pid > 0 && (n = read(fds[0], buf, sizeof(buf))) > 0) json.append(buf, n);
+    close(fds[0]);
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) return "";
+    return json;
+}
+
+static std::string cpu_model() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.compare(0, 10, "model name") == 0) return line.substr(line.find(':') + 2);
+    }
+    return "unknown";
+}
+
+int main(int argc, char **argv) {
+    int width = 320, spp = 16;
+    std::string only, out = "bench.json";
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_val = i + 1 < argc;
+        if (arg == "--spp" && has_val) spp = std::stoi(argv[++i]);
+        else if (arg == "--width" && has_val) width = std::stoi(argv[++i]);
+        else if (arg == "--scene" && has_val) only = argv[++i];
+        else if (arg == "--out" && has_val) out = argv[++i];
+        else {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+    int height = width * 9 / 16;
+
+    std::ostringstream json;
+    json << "{\n  \"cpu\": \"" << cpu_model() << "\", \"threads\": " << omp_get_max_threads()
+         << ", \"width\": " << width << ", \"height\": " << height << ", \"spp\": " << spp << ",\n  \"scenes\": [";
+    bool first = true, failed = false;
+    for (const BenchScene &b : bench_scenes) {
+        if (!only.empty() && b.name != only) continue;
+        std::string scene_json = run_scene_forked(b, width, height, spp);
+        if (scene_json.empty()) {
+            std::cerr << b.name << " failed" << std::endl;
+            failed = true;
+            continue;
+        }
+        json << (first ? "\n    " : ",\n    ") << scene_json;
+        first = false;
+        std::cout << scene_json << std::endl;
+    }
+    json << "\n  ]\n}\n";
+
+    std::ofstream file(out);
+    file << json.str();
+    if (!file) {
+        std::cerr << "Cannot write " << out << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << out << std::endl;
+    return failed ? 1 : 0;
+}
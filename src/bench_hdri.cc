@@ -0,0 +1,98 @@
+// Cost of an environment lookup (HDRI::get_pixel) against the version that
+// rotated with trig and projected with atan2 / asin on every call, and its
+// cost and error with each EnvStorage format.
+//   make bench_hdri && ./bench_hdri [file.hdr]
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "hdr_utils.h"
+
+// the old get_pixel's projection (it also tone mapped with pow per call)
+static Vec3d old_get_pixel(const HDRI &env, Vec3d dir) {
+    if (env.theta != 0) {
+        double mag = sqrt(dir[0] * dir[0] + dir[2] * dir[2]);
+        double angle = atan2(dir[2], dir[0]) + env.theta;
+        dir[0] = mag * cos(angle);
+        dir[2] = mag * sin(angle);
+        dir.normalize();
+    }
+    double u = 0.5 + atan2(dir[2], dir[0]) * M_1_PI * 0.5;
+    double v = 0.5 - asin(dir[1]) * M_1_PI;
+    int x = std::min(std::max(int(u * env.width), 0), env.width - 1);
+    int y = std::min(std::max(int(v * env.height), 0), env.height - 1);
+    return env.texel(x, y);
+}
+
+template <typename F>
+static void bench(const char *name, int n, F f) {
+    auto start = std::chrono::steady_clock::now();
+    double sink = f();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(32) << name << std::right << std::setw(8) << std::fixed
+              << std::setprecision(2) << s * 1e9 / n << " ns/lookup  (" << sink << ")" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    const char *path = argc > 1 ? argv[1] : "../assets/hdrs/sunny.hdr";
+    HDRI env;
+    if (!HDRLoader::load(path, env)) {
+        std::cerr << "Cannot load HDRI: " << path << std::endl;
+        return 1;
+    }
+
+    const int n = 1 << 22;
+    std::vector<Vec3d> dirs(n);
+    seed_rng(1);
+    for (auto &d : dirs) {
+        double z = 1 - 2 * random_double_01(), phi = 2 * M_PI * random_double_01();
+        double r = sqrt(std::max(0.0, 1 - z * z));
+        d = Vec3d(r * cos(phi), r * sin(phi), z);
+    }
+
+    // same texel as the exact projection, apart from directions within the
+    // approximation error of a texel edge
+    int differ = 0;
+    for (auto &d : dirs) differ += (old_get_pixel(env, d) - env.get_pixel(d)).norm() > 1e-5;
+    std::cout << env.width << "x" << env.height << ", " << differ << " of " << n
+              << " lookups differ from the exact projection" << std::endl;
+
+    for (double theta : {0.0, -0.1}) {
+        env.theta = theta;
+        std::cout << "theta " << theta << ":" << std::endl;
+        bench("old", n, [&] {
+            double sum = 0;
+            for (auto &d : dirs) sum += luminance(old_get_pixel(env, d));
+            return sum;
+        });
+        bench("get_pixel", n, [&] {
+            double sum = 0;
+            for (auto &d : dirs) sum += luminance(env.get_pixel(d));
+            return sum;
+        });
+    }
+
+    env.theta = 0;
+    std::vector<Vec3d> reference(n);
+    for (int i = 0; i < n; ++i) reference[i] = env.get_pixel(dirs[i]);
+    std::cout << "storage:" << std::endl;
+    for (EnvStorage storage : {EnvStorage::Float, EnvStorage::Half, EnvStorage::RGBE}) {
+        env.set_storage(storage);
+        double max_err = 0;
+        for (int i = 0; i < n; ++i) {
+            Vec3d a = env.get_pixel(dirs[i]), b = reference[i];
+            // relative to the brightest channel, which is what RGBE's shared exponent keeps
+            double peak = std::max(std::max(b[0], b[1]), std::max(b[2], 1e-3));
+            for (int c = 0; c < 3; ++c) max_err = std::max(max_err, fabs(a[c] - b[c]) / peak);
+        }
+        std::cout << env_storage_name(storage) << ": " << std::setprecision(1) << env.memory_bytes() / 1048576.0
+                  << " MB, max relative error " << std::scientific << max_err << std::endl;
+        bench("  get_pixel", n, [&] {
+            double sum = 0;
+            for (auto &d : dirs) sum += luminance(env.get_pixel(d));
+            return sum;
+        });
+    }
+}
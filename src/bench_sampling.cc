@@ -0,0 +1,131 @@
+// Throughput of the closed form warps in Sampling.h against the rejection
+// sampling and per-light trig they replace.
+//   make bench_sampling && ./bench_sampling
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <vector>
+
+#include "MathUtils.h"
+#include "Sampling.h"
+
+static uint64_t rng_draws = 0;
+
+static double counted_random() {
+    ++rng_draws;
+    return random_double_01();
+}
+
+// the old random_in_unit_sphere
+static Vec3d rejection_in_unit_sphere() {
+    Vec3d p;
+    do {
+        p = Vec3d(counted_random(), counted_random(), counted_random()) * 2.0 - Vec3d(1, 1, 1);
+    } while (p.sqrNorm() >= 1.0);
+    return p;
+}
+
+// the old solid angle sampling in Sphere::sample_emitter
+static Vec3d old_cone(const Vec3d &sw, double cos_a_max, double u1, double u2) {
+    Vec3d su = (std::abs(sw[0]) > 0.01 ? Vec3d(0, 1, 0) : Vec3d(1, 0, 0)).cross(sw).normalize();
+    Vec3d sv = sw.cross(su);
+    double cos_a = 1.0 - u1 + u1 * cos_a_max;
+    double sin_a = sqrt(std::max(0.0, 1.0 - cos_a * cos_a));
+    double phi = 2 * M_PI * u2;
+    return (su * (cos(phi) * sin_a) + sv * (sin(phi) * sin_a) + sw * cos_a).normalize();
+}
+
+// every component, so no part of the warp is optimized away
+static double sum3(const Vec3d &v) { return v[0] + v[1] + v[2]; }
+
+template <typename F>
+static void bench(const char *name, int n, F f) {
+    auto start = std::chrono::steady_clock::now();
+    double sink = f();
+    double s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << std::left << std::setw(44) << name << std::right << std::setw(8) << std::fixed
+              << std::setprecision(2) << s * 1e9 / n << " ns/sample  (" << sink << ")" << std::endl;
+}
+
+int main() {
+    const int n = 1 << 22;
+    std::vector<double> u1(n), u2(n), u3(n), x(n), y(n), z(n), pdf(n);
+    seed_rng(1);
+    for (int i = 0; i < n; ++i) {
+        u1[i] = random_double_01();
+        u2[i] = random_double_01();
+        u3[i] = random_double_01();
+    }
+    Vec3d normal = Vec3d(0.3, 0.8, -0.5).normalize();
+
+    std::cout << "with rng:" << std::endl;
+    bench("unit ball, rejection (old)", n, [&] {
+        rng_draws = 0;
+        double sum = 0;
+        for (int i = 0; i < n; ++i) sum += sum3(rejection_in_unit_sphere());
+        std::cout << "  " << double(rng_draws) / n << " draws/sample" << std::endl;
+        return sum;
+    });
+    bench("unit ball, closed form", n, [&] {
+        double sum = 0, p;
+        for (int i = 0; i < n; ++i) sum += sum3(sample_uniform_ball(random_double_01(), random_double_01(), random_double_01(), p));
+        return sum;
+    });
+    bench("diffuse, normal + rejection point (old)", n, [&] {
+        double sum = 0;
+        for (int i = 0; i < n; ++i) sum += sum3((normal + rejection_in_unit_sphere().normalize()).normalize());
+        return sum;
+    });
+    bench("diffuse, cosine hemisphere", n, [&] {
+        double sum = 0, p;
+        for (int i = 0; i < n; ++i) sum += sum3(sample_cosine_hemisphere(normal, random_double_01(), random_double_01(), p));
+        return sum;
+    });
+
+    std::cout << "warps only, from precomputed uniforms:" << std::endl;
+    bench("cone, per light basis (old)", n, [&] {
+        double sum = 0;
+        for (int i = 0; i < n; ++i) sum += sum3(old_cone(normal, 0.9, u1[i], u2[i]));
+        return sum;
+    });
+    bench("cone", n, [&] {
+        double sum = 0, p;
+        for (int i = 0; i < n; ++i) sum += sum3(sample_cone(normal, 0.9, u1[i], u2[i], p));
+        return sum;
+    });
+    bench("cone, batched (local frame)", n, [&] {
+        sample_cone(n, 0.9, u1.data(), u2.data(), x.data(), y.data(), z.data(), pdf.data());
+        double sum = 0;
+        for (int i = 0; i < n; ++i) sum += x[i] + y[i] + z[i];
+        return sum;
+    });
+    bench("uniform sphere", n, [&] {
+        double sum = 0, p;
+        for (int i = 0; i < n; ++i) sum += sum3(sample_uniform_sphere(u1[i], u2[i], p));
+        return sum;
+    });
+    bench("uniform sphere, batched", n, [&] {
+        sample_uniform_sphere(n, u1.data(), u2.data(), x.data(), y.data(), z.data(), pdf.data());
+        double sum = 0;
+        for (int i = 0; i < n; ++i) sum += x[i] + y[i] + z[i];
+        return sum;
+    });
+    bench("cosine hemisphere (local frame)", n, [&] {
+        double sum = 0, p;
+        for (int i = 0; i < n; ++i) sum += sum3(sample_cosine_hemisphere(Vec3d(0, 0, 1), u1[i], u2[i], p));
+        return sum;
+    });
+    bench("cosine hemisphere, batched", n, [&] {
+        sample_cosine_hemisphere(n, u1.data(), u2.data(), x.data(), y.data(), z.data(), pdf.data());
+        double sum = 0;
+        for (int i = 0; i < n; ++i) sum += x[i] + y[i] + z[i];
+        return sum;
+    });
+    bench("ggx visible normals, alpha 0.3", n, [&] {
+        double sum = 0, p;
+        Vec3d wo = Vec3d(0.4, 0.1, 0.8).normalize();
+        for (int i = 0; i < n; ++i) sum += sum3(sample_ggx_vndf(wo, 0.3, u1[i], u2[i], p));
+        return sum;
+    });
+}
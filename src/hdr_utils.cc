@@ -7,185 +7,372 @@
 ************************************************************************************/
 
 #include "hdr_utils.h"
+#include "MappedFile.h"
+#include "Profiler.h"
 
 #include <math.h>
-#include <memory.h>
-#include <stdio.h>
-
-typedef unsigned char RGBE[4];
-#define R			0
-#define G			1
-#define B			2
-#define E			3
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <string>
 
 #define  MINELEN	8				// minimum scanline length for encoding
 #define  MAXELEN	0x7fff			// maximum scanline length for encoding
 
-static void workOnRGBE(RGBE *scan, int len, float *cols);
-static bool decrunch(RGBE *scanline, int len, FILE *file);
-static bool oldDecrunch(RGBE *scanline, int len, FILE *file);
+float rgbe_scale[256];
 
-bool HDRLoader::load(const char *fileName, HDRI &res)
-{
-	int i;
-	char str[200];
-	FILE *file;
+static bool rgbe_scale_init = [] {
+	rgbe_scale[0] = 0; // all zero is black
+	for (int e = 1; e < 256; ++e) rgbe_scale[e] = ldexp(1.0, e - 136);
+	return true;
+}();
 
-	file = fopen(fileName, "rb");
-	if (!file)
-		return false;
+static const char *env_storage_names[] = {"float", "half", "rgbe"};
 
-	fread(str, 10, 1, file);
-	if (memcmp(str, "#?RADIANCE", 10)) {
-		fclose(file);
-		return false;
+bool env_storage_from_name(const std::string &name, EnvStorage &storage)
+{
+	for (uint32_t i = 0; i < 3; ++i) {
+		if (name == env_storage_names[i]) {
+			storage = EnvStorage(i);
+			return true;
+		}
 	}
+	return false;
+}
 
-	fseek(file, 1, SEEK_CUR);
+const char *env_storage_name(EnvStorage storage)
+{
+	return env_storage_names[uint32_t(storage)];
+}
 
-	char cmd[200];
-	i = 0;
-	char c = 0, oldc;
-	while(true) {
-		oldc = c;
-		c = fgetc(file);
-		if (c == 0xa && oldc == 0xa)
-			break;
-		cmd[i++] = c;
-	}
+TexelArray::TexelArray(EnvStorage format, size_t count): format{format}
+{
+	if (format == EnvStorage::Float) floats.resize(3 * count);
+	else if (format == EnvStorage::Half) halves.resize(3 * count);
+	else rgbe.resize(4 * count);
+}
 
-	char reso[200];
-	i = 0;
-	while(true) {
-		c = fgetc(file);
-		reso[i++] = c;
-		if (c == 0xa)
-			break;
+void TexelArray::set(size_t i, float r, float g, float b)
+{
+	if (format == EnvStorage::Float) {
+		floats[3 * i] = r;
+		floats[3 * i + 1] = g;
+		floats[3 * i + 2] = b;
+	} else if (format == EnvStorage::Half) {
+		halves[3 * i] = float_to_half(r);
+		halves[3 * i + 1] = float_to_half(g);
+		halves[3 * i + 2] = float_to_half(b);
+	} else {
+		uint8_t *p = &rgbe[4 * i];
+		float m = std::max(r, std::max(g, b));
+		if (m < 1e-32f) {
+			p[0] = p[1] = p[2] = p[3] = 0;
+			return;
+		}
+		int e;
+		frexpf(m, &e); // m = f * 2^e with f in [0.5, 1)
+		float s = ldexpf(256.0f, -e);
+		p[0] = std::min(r * s, 255.0f);
+		p[1] = std::min(g * s, 255.0f);
+		p[2] = std::min(b * s, 255.0f);
+		p[3] = e + 128;
 	}
+}
 
-	int w, h;
-	if (!sscanf(reso, "-Y %ld +X %ld", &h, &w)) {
-		fclose(file);
-		return false;
+void HDRI::set_storage(EnvStorage s)
+{
+	storage = s;
+	for (MipLevel &level : mips) {
+		if (level.texels.storage() == s) continue;
+		size_t n = size_t(level.width) * level.height;
+		TexelArray converted{s, n};
+		#pragma omp parallel for schedule(static)
+		for (size_t i = 0; i < n; ++i) {
+			Vec3d c = level.texels.get(i);
+			converted.set(i, c[0], c[1], c[2]);
+		}
+		level.texels = std::move(converted);
 	}
+}
 
-	res.width = w;
-    h = w / 2; // TODO cant read height of file ??
-	res.height = h;
+size_t HDRI::memory_bytes() const
+{
+	size_t bytes = 0;
+	for (const MipLevel &level : mips) bytes += level.texels.bytes();
+	return bytes;
+}
+
+void HDRI::build_mips()
+{
+	mips.resize(1);
+	while (mips.back().width > 1 || mips.back().height > 1) {
+		const MipLevel &src = mips.back();
+		int dst_w = std::max(src.width / 2, 1), dst_h = std::max(src.height / 2, 1);
+		MipLevel dst{dst_w, dst_h, TexelArray{storage, size_t(dst_w) * dst_h}};
 
-	float *cols = new float[w * h * 3];
-	res.cols = cols;
+		for (int y = 0; y < dst.height; ++y) {
+			int y0 = y * src.height / dst.height, y1 = (y + 1) * src.height / dst.height;
+			for (int x = 0; x < dst.width; ++x) {
+				int x0 = x * src.width / dst.width, x1 = (x + 1) * src.width / dst.width;
 
-	RGBE *scanline = new RGBE[w];
-	if (!scanline) {
-		fclose(file);
-		return false;
+				// rows weighted by the solid angle they cover
+				double sum[3] = {0, 0, 0}, weight = 0;
+				for (int sy = y0; sy < y1; ++sy) {
+					double w = sin(M_PI * (sy + 0.5) / src.height);
+					for (int sx = x0; sx < x1; ++sx) {
+						Vec3d t = src.texels.get(size_t(sy) * src.width + sx);
+						for (int i = 0; i < 3; ++i) sum[i] += t[i] * w;
+						weight += w;
+					}
+				}
+				dst.texels.set(size_t(y) * dst.width + x, sum[0] / weight, sum[1] / weight, sum[2] / weight);
+			}
+		}
+		mips.push_back(std::move(dst));
 	}
+}
 
-	// convert image 
-	for (int y = h - 1; y >= 0; y--) {
-		if (decrunch(scanline, w, file) == false)
-			break;
-		workOnRGBE(scanline, w, cols);
-		cols += w * 3;
+Vec3d HDRI::bilinear(const MipLevel &level, double u, double v) const
+{
+	double px = u * level.width - 0.5, py = v * level.height - 0.5;
+	int x0 = int(floor(px)), y0 = int(floor(py));
+	double fx = px - x0, fy = py - y0;
+
+	Vec3d ret = 0;
+	for (int j = 0; j < 2; ++j) {
+		int y = std::min(std::max(y0 + j, 0), level.height - 1);
+		for (int i = 0; i < 2; ++i) {
+			int x = (x0 + i + level.width) % level.width;
+			double w = (i ? fx : 1 - fx) * (j ? fy : 1 - fy);
+			ret = ret + level.texels.get(size_t(y) * level.width + x) * w;
+		}
 	}
+	return ret;
+}
+
+Vec3d HDRI::get_filtered(const Vec3d &dir, double solid_angle) const
+{
+	double u, v;
+	direction_to_uv(dir, u, v);
 
-	delete [] scanline;
-	fclose(file);
+	// texels near the poles cover less solid angle than at the horizon
+	double cos_e = sqrt(dir[0] * dir[0] + dir[2] * dir[2]) / dir.norm();
+	double texel_angle = 2 * M_PI * M_PI / (width * height) * std::max(cos_e, 1e-4);
+	double level = 0.5 * log2(solid_angle / texel_angle);
+	if (!(level > 0)) return get_pixel(dir);
+	level = std::min(level, double(mips.size() - 1));
 
-	return true;
+	int l0 = int(level);
+	int l1 = std::min(l0 + 1, int(mips.size()) - 1);
+	double t = level - l0;
+	return bilinear(mips[l0], u, v) * (1 - t) + bilinear(mips[l1], u, v) * t;
 }
 
-float convertComponent(int expo, int val)
+void HDRI::build_distribution()
 {
-	float v = val / 256.0f;
-	float d = (float) pow(2, expo);
-	return v * d;
+	dist_w = std::min(width, max_dist_width);
+	dist_h = std::min(height, max_dist_height);
+
+	std::vector<double> row_weights(dist_h);
+	dist_cols.assign(dist_h, AliasTable());
+	std::vector<double> cell_weights(dist_w);
+	for (int cy = 0; cy < dist_h; ++cy) {
+		int y0 = cy * height / dist_h, y1 = (cy + 1) * height / dist_h;
+		double sin_polar = sin(M_PI * (cy + 0.5) / dist_h);
+
+		for (int cx = 0; cx < dist_w; ++cx) {
+			int x0 = cx * width / dist_w, x1 = (cx + 1) * width / dist_w;
+			double sum = 0;
+			for (int y = y0; y < y1; ++y)
+				for (int x = x0; x < x1; ++x)
+					sum += luminance(texel(x, y));
+			cell_weights[cx] = sum / ((x1 - x0) * (y1 - y0)) * sin_polar;
+		}
+		dist_cols[cy] = AliasTable(cell_weights);
+		row_weights[cy] = dist_cols[cy].weight_sum();
+	}
+	dist_rows = AliasTable(row_weights);
 }
 
-void workOnRGBE(RGBE *scan, int len, float *cols)
+Vec3d HDRI::sample(double u1, double u2, double &pdf) const
 {
-	while (len-- > 0) {
-		int expo = scan[0][E] - 128;
-		cols[0] = convertComponent(expo, scan[0][R]);
-		cols[1] = convertComponent(expo, scan[0][G]);
-		cols[2] = convertComponent(expo, scan[0][B]);
-		cols += 3;
-		scan++;
+	double row_pmf, col_pmf, jy, jx;
+	int cy = dist_rows.sample(u1, row_pmf, jy);
+	int cx = dist_cols[cy].sample(u2, col_pmf, jx);
+
+	// inverse of the spherical projection in get_pixel
+	double u = (cx + jx) / dist_w, v = (cy + jy) / dist_h;
+	double phi = (u - 0.5) * 2 * M_PI - theta;
+	double elevation = (0.5 - v) * M_PI;
+	double cos_e = cos(elevation);
+	if (cos_e <= 0) {
+		pdf = 0;
+		return Vec3d(0, 1, 0);
 	}
+
+	// uniform in (u, v) over the cell, dA = cos(e) * 2pi^2 du dv
+	pdf = row_pmf * col_pmf * dist_w * dist_h / (2 * M_PI * M_PI * cos_e);
+	return Vec3d(cos_e * cos(phi), sin(elevation), cos_e * sin(phi));
 }
 
-bool decrunch(RGBE *scanline, int len, FILE *file)
+double HDRI::pdf(const Vec3d &dir) const
 {
-	int  i, j;
-					
-	if (len < MINELEN || len > MAXELEN)
-		return oldDecrunch(scanline, len, file);
-
-	i = fgetc(file);
-	if (i != 2) {
-		fseek(file, -1, SEEK_CUR);
-		return oldDecrunch(scanline, len, file);
-	}
-
-	scanline[0][G] = fgetc(file);
-	scanline[0][B] = fgetc(file);
-	i = fgetc(file);
-
-	if (scanline[0][G] != 2 || scanline[0][B] & 128) {
-		scanline[0][R] = 2;
-		scanline[0][E] = i;
-		return oldDecrunch(scanline + 1, len - 1, file);
-	}
-
-	// read each component
-	for (i = 0; i < 4; i++) {
-	    for (j = 0; j < len; ) {
-			unsigned char code = fgetc(file);
-			if (code > 128) { // run
-			    code &= 127;
-			    unsigned char val = fgetc(file);
-			    while (code--)
-					scanline[j++][i] = val;
-			}
-			else  {	// non-run
-			    while(code--)
-					scanline[j++][i] = fgetc(file);
+	double phi = fast_atan2(dir[2], dir[0]) + theta;
+	double u = 0.5 + phi * M_1_PI * 0.5;
+	u -= floor(u); // rotation can push it out of [0, 1)
+	double v = 0.5 - fast_atan2(dir[1], sqrt(dir[0] * dir[0] + dir[2] * dir[2])) * M_1_PI;
+	int cx = std::min(int(u * dist_w), dist_w - 1), cy = std::min(int(v * dist_h), dist_h - 1);
+	if (!can_sample() || dist_rows.pmf(cy) == 0) return 0;
+
+	double cos_e = sqrt(std::max(0.0, 1 - dir[1] * dir[1]));
+	if (cos_e <= 0) return 0;
+	return dist_rows.pmf(cy) * dist_cols[cy].pmf(cx) * dist_w * dist_h / (2 * M_PI * M_PI * cos_e);
+}
+
+// next header line from p, without the newline; false at the end of the file
+static bool next_line(const uint8_t *&p, const uint8_t *end, std::string &line)
+{
+	const uint8_t *nl = (const uint8_t *) memchr(p, '\n', end - p);
+	if (!nl) return false;
+	line.assign((const char *) p, nl - p);
+	p = nl + 1;
+	return true;
+}
+
+// Walks one scanline of w pixels starting at p, writing RGBE to out if it
+// isn't null. Returns where the next scanline starts, null if the data is
+// malformed or cut short.
+static const uint8_t *read_scanline(const uint8_t *p, const uint8_t *end, int w, uint8_t *out)
+{
+	// run length encoded: 2, 2, then the width, then each channel separately
+	if (w >= MINELEN && w <= MAXELEN && end - p >= 4 && p[0] == 2 && p[1] == 2 && !(p[2] & 0x80)) {
+		if ((p[2] << 8 | p[3]) != w) return nullptr;
+		p += 4;
+		for (int c = 0; c < 4; ++c) {
+			for (int x = 0; x < w; ) {
+				if (p >= end) return nullptr;
+				int code = *p++;
+				if (code > 128) { // run
+					code &= 127;
+					if (code > w - x || p >= end) return nullptr;
+					if (out) for (int i = 0; i < code; ++i) out[4 * (x + i) + c] = *p;
+					p++;
+				} else { // literal
+					if (code == 0 || code > w - x || code > end - p) return nullptr;
+					if (out) for (int i = 0; i < code; ++i) out[4 * (x + i) + c] = p[i];
+					p += code;
+				}
+				x += code;
 			}
 		}
-    }
+		return p;
+	}
 
-	return feof(file) ? false : true;
+	// flat pixels, where 1, 1, 1, n repeats the last pixel (old style runs)
+	int shift = 0;
+	for (int x = 0; x < w; ) {
+		if (end - p < 4) return nullptr;
+		if (p[0] == 1 && p[1] == 1 && p[2] == 1) {
+			if (x == 0) return nullptr;
+			long count = long(p[3]) << shift;
+			if (count > w - x) return nullptr;
+			if (out) for (long i = 0; i < count; ++i) memcpy(out + 4 * (x + i), out + 4 * (x - 1), 4);
+			x += count;
+			shift += 8;
+		} else {
+			if (out) memcpy(out + 4 * x, p, 4);
+			x++;
+			shift = 0;
+		}
+		p += 4;
+	}
+	return p;
 }
 
-bool oldDecrunch(RGBE *scanline, int len, FILE *file)
+bool HDRLoader::load(const char *fileName, HDRI &res, size_t *file_size)
 {
-	int i;
-	int rshift = 0;
-	
-	while (len > 0) {
-		scanline[0][R] = fgetc(file);
-		scanline[0][G] = fgetc(file);
-		scanline[0][B] = fgetc(file);
-		scanline[0][E] = fgetc(file);
-		if (feof(file))
+	ScopedTimer timer{"hdr load"};
+	MappedFile file;
+	if (!file.open(fileName)) {
+		std::cerr << fileName << ": cannot open" << std::endl;
+		return false;
+	}
+	const uint8_t *p = file.data, *end = file.data + file.size;
+
+	std::string line;
+	if (!next_line(p, end, line) || (line.compare(0, 10, "#?RADIANCE") && line.compare(0, 6, "#?RGBE"))) {
+		std::cerr << fileName << ": not a Radiance HDR file" << std::endl;
+		return false;
+	}
+	// variables up to an empty line
+	while (true) {
+		if (!next_line(p, end, line)) {
+			std::cerr << fileName << ": truncated header" << std::endl;
 			return false;
+		}
+		if (line.empty()) break;
+		if (!line.compare(0, 7, "FORMAT=") && line != "FORMAT=32-bit_rle_rgbe") {
+			std::cerr << fileName << ": unsupported " << line << std::endl;
+			return false;
+		}
+	}
 
-		if (scanline[0][R] == 1 &&
-			scanline[0][G] == 1 &&
-			scanline[0][B] == 1) {
-			for (i = scanline[0][E] << rshift; i > 0; i--) {
-				memcpy(&scanline[0][0], &scanline[-1][0], 4);
-				scanline++;
-				len--;
-			}
-			rshift += 8;
+	// resolution, rows top to bottom (-Y) or bottom to top (+Y), columns left to right
+	char y_sign, x_sign;
+	int w, h;
+	if (!next_line(p, end, line) || sscanf(line.c_str(), "%cY %d %cX %d", &y_sign, &h, &x_sign, &w) != 4
+	    || (y_sign != '-' && y_sign != '+') || x_sign != '+' || w <= 0 || h <= 0) {
+		std::cerr << fileName << ": unsupported resolution line \"" << line << "\"" << std::endl;
+		return false;
+	}
+
+	// Where each scanline starts. Run lengths can only be found by walking
+	// them, but that skips over runs and literals without touching the
+	// pixels, so it's cheap next to decoding.
+	std::vector<const uint8_t *> starts(h + 1);
+	starts[0] = p;
+	for (int y = 0; y < h; ++y) {
+		starts[y + 1] = read_scanline(starts[y], end, w, nullptr);
+		if (!starts[y + 1]) {
+			std::cerr << fileName << ": bad scanline " << y << std::endl;
+			return false;
 		}
-		else {
-			scanline++;
-			len--;
-			rshift = 0;
+	}
+
+	res.width = w;
+	res.height = h;
+	res.mips.assign(1, HDRI::MipLevel{w, h, TexelArray{res.storage, size_t(w) * h}});
+	TexelArray &texels = res.mips[0].texels;
+
+	// The tone map, gamma_compression(c, 0.6, 0.8), of mantissa * 2^exponent
+	// splits into a power of the mantissa times a power of the exponent,
+	// which take 256 values each.
+	float mantissa_pow[256], exponent_pow[256];
+	for (int i = 0; i < 256; ++i) {
+		mantissa_pow[i] = 0.6 * pow(i, 0.8);
+		exponent_pow[i] = pow(2, 0.8 * (i - 136));
+	}
+
+	#pragma omp parallel
+	{
+		std::vector<uint8_t> rgbe(4 * w);
+		#pragma omp for schedule(dynamic, 16)
+		for (int y = 0; y < h; ++y) {
+			read_scanline(starts[y], end, w, rgbe.data());
+			int row = y_sign == '-' ? y : h - 1 - y;
+			for (int x = 0; x < w; ++x) {
+				const uint8_t *px = &rgbe[4 * x];
+				float c[3];
+				for (int i = 0; i < 3; ++i) {
+					// c[i] = contrast_tone_map(c[i]);
+					c[i] = std::min(mantissa_pow[px[i]] * exponent_pow[px[3]], 2.0f);
+				}
+				texels.set(size_t(row) * w + x, c[0], c[1], c[2]);
+			}
 		}
 	}
+
+	if (file_size) *file_size = file.size;
 	return true;
-}
\ No newline at end of file
+}
@@ -9,51 +9,131 @@
 #pragma once
 
 #include <cmath>
+#include <vector>
+#include <string>
+#include <algorithm>
 
 #include "MathUtils.h"
+#include "AliasTable.h"
+
+// How environment texels are kept in memory:
+//   Float  3 x 32 bit float, 12 bytes
+//   Half   3 x 16 bit float, 6 bytes, 3 significant digits
+//   RGBE   8 bit mantissas with a shared exponent, 4 bytes, error up to
+//          1/256 of the brightest channel
+enum class EnvStorage : uint32_t { Float = 0, Half = 1, RGBE = 2 };
+
+bool env_storage_from_name(const std::string &name, EnvStorage &storage);
+const char *env_storage_name(EnvStorage storage);
+
+// 2^(e - 136): an RGBE mantissa byte times this is its value
+extern float rgbe_scale[256];
+
+// rgb texels in one of the EnvStorage formats
+class TexelArray {
+    EnvStorage format = EnvStorage::Float;
+    std::vector<float> floats;
+    std::vector<uint16_t> halves;
+    std::vector<uint8_t> rgbe;
+
+public:
+    TexelArray() {}
+    TexelArray(EnvStorage format, size_t count);
+
+    EnvStorage storage() const { return format; }
+    size_t bytes() const { return floats.size() * 4 + halves.size() * 2 + rgbe.size(); }
+
+    void set(size_t i, float r, float g, float b);
+    Vec3d get(size_t i) const {
+        switch (format) {
+        case EnvStorage::Half:
+            return Vec3d(half_to_float(halves[3 * i]), half_to_float(halves[3 * i + 1]), half_to_float(halves[3 * i + 2]));
+        case EnvStorage::RGBE: {
+            const uint8_t *p = &rgbe[4 * i];
+            // mid point of the truncated mantissa
+            float s = rgbe_scale[p[3]];
+            return Vec3d((p[0] + 0.5f) * s, (p[1] + 0.5f) * s, (p[2] + 0.5f) * s);
+        }
+        default:
+            return Vec3d(floats[3 * i], floats[3 * i + 1], floats[3 * i + 2]);
+        }
+    }
+};
 
 class HDRI {
 public:
 	int width, height;
     double theta = 0; // rotation on y axis
-	// each pixel takes 3 float32, each component can be of any value...
-	float *cols;
-    
-    HDRI(): cols{nullptr} {}
-    ~HDRI() { delete[] cols; }
-
-    Vec3d get_pixel(Vec3d dir) const {
-
-        if (theta != 0) {
-             // rotate
-             double mag = sqrt(dir[0] * dir[0] + dir[2] * dir[2]);
-             double angle = atan2(dir[2], dir[0]) + theta;
-
-             dir[0] = mag * cos(angle);
-             dir[2] = mag * sin(angle);
-             dir.normalize();
-        }
 
-        // spherical projection
-        double u = 0.5 + atan2(dir[2], dir[0]) * M_1_PI * 0.5;
-        double v = 0.5 - asin(dir[1]) * M_1_PI;
-        int x = u * width, y = v * height;
-        int idx = 3 * (y * width + x);
-        
-        // tone map?
-        Vec3d ret;
-        for (int i = 0; i < 3; ++i) {
-            ret[i] = cols[idx + i];
-
-            ret[i] = gamma_compression(ret[i], 0.6, 0.8);
-            // ret[i] = contrast_tone_map(ret[i]);
-        }
-        ret.clamp(0, 2);
-        return ret;
+    // The loader fills mip level 0 with the tone mapped texels that get_pixel
+    // returns (there's no copy of the raw radiance), in this format.
+    EnvStorage storage = EnvStorage::Float;
+    // re-encodes every mip level
+    void set_storage(EnvStorage s);
+    size_t memory_bytes() const;
+
+    // Prefiltered copies of the tone mapped map for blurry lookups, each
+    // level half the size of the one before, down to 1x1.
+    void build_mips();
+    int mip_levels() const { return mips.size(); }
+
+    // tone mapped value of a texel, what get_pixel returns
+    Vec3d texel(int x, int y) const {
+        x = std::min(std::max(x, 0), width - 1);
+        y = std::min(std::max(y, 0), height - 1);
+        return mips[0].texels.get(size_t(y) * width + x);
+    }
+
+    // Spherical projection of dir (any length) to [0, 1)^2. The rotation
+    // around y is a shift in u, wrapped around the seam.
+    void direction_to_uv(const Vec3d &dir, double &u, double &v) const {
+        u = 0.5 + (fast_atan2(dir[2], dir[0]) + theta) * M_1_PI * 0.5;
+        v = 0.5 - fast_atan2(dir[1], sqrt(dir[0] * dir[0] + dir[2] * dir[2])) * M_1_PI;
+        u -= floor(u);
+    }
+
+    Vec3d get_pixel(const Vec3d &dir) const {
+        double u, v;
+        direction_to_uv(dir, u, v);
+        return texel(std::min(int(u * width), width - 1), std::min(int(v * height), height - 1));
     }
+
+    // Trilinear lookup, blurred so that one texel covers about solid_angle
+    // around dir. The same as get_pixel when that is below a texel.
+    Vec3d get_filtered(const Vec3d &dir, double solid_angle) const;
+
+    // Importance sampling of the environment by luminance. The map is split
+    // into cells of at most max_dist_width x max_dist_height, each weighted by
+    // its mean luminance times sin(polar angle) (rows near the poles cover
+    // less solid angle). A row is picked first, then a cell in that row, then
+    // a uniform point in the cell.
+    void build_distribution();
+    bool can_sample() const { return !dist_rows.empty(); }
+    // direction in world space (theta is applied), pdf per solid angle
+    Vec3d sample(double u1, double u2, double &pdf) const;
+    double pdf(const Vec3d &dir) const;
+
+private:
+    struct MipLevel {
+        int width, height;
+        TexelArray texels;
+    };
+    std::vector<MipLevel> mips;
+
+    friend class HDRLoader;
+
+    // bilinear, wrapping in u and clamped in v
+    Vec3d bilinear(const MipLevel &level, double u, double v) const;
+
+    static constexpr int max_dist_width = 1024, max_dist_height = 512;
+    int dist_w = 0, dist_h = 0;
+    AliasTable dist_rows;
+    std::vector<AliasTable> dist_cols;
 };
 
+// Maps the file, finds where every scanline starts and decodes them in
+// parallel. Errors are printed. file_size, if given, gets the bytes read.
 class HDRLoader {
 public:
-	static bool load(const char *fileName, HDRI &res);
+	static bool load(const char *fileName, HDRI &res, size_t *file_size = nullptr);
 };
\ No newline at end of file
@@ -1,7 +1,15 @@
 #include <chrono>
+#include <atomic>
+#include <csignal>
+#include <sys/stat.h>
+#include <omp.h>
 
 #include "Raycaster.h"
-#include "writebmp.h"
+#include "ImageWriter.h"
+#include "Distributed.h"
+#include "Checkpoint.h"
+#include "Denoiser.h"
+#include "Profiler.h"
 
 Material make_diffuse_mat(const Color &color){
     Material m;
@@ -53,7 +61,7 @@ Scene mat1_test_scene(){
     return scene;
 }
 
-Scene mat2_test_scene() {
+Scene mat2_test_scene(EnvStorage env_storage) {
     std::vector<Vec3d> sphere_posns = {
         {2,0,-1},
         {0,0,-0.5},
@@ -96,20 +104,20 @@ Scene mat2_test_scene() {
     for (int i = 0; i < num_spheres; ++i) {
         if(!std::count(include.begin(), include.end(), i)) continue;
         if(i != 6) continue;
-        scene.add_object(new Sphere{sphere_posns[i], sphere_r[i], mats[i]});
+        scene.add_object(new Sphere{sphere_posns[i], sphere_r[i], scene.add_material(mats[i])});
     }
 
     // Mat2 floor_mat = { Mat2::Diffuse, Vec3d(1.f, 1.0f, 1.0f), Vec3d(0,0,0), 0, 0 };
-    // scene.add_object(new Plane({ 0.0,      1, 0.0}, {0, -0.5, 0}, floor_mat, 100)); 
+    // scene.add_object(new Plane({ 0.0,      1, 0.0}, {0, -0.5, 0}, scene.add_material(floor_mat), 100)); 
 
-    // scene.add_object(new Mesh("../assets/monkey_low.obj", mats[0]));  
+    // scene.add_object(new Mesh("../assets/monkey_low.obj", scene.add_material(mats[0])));  
 
     // Vec3d big_sphere_posn = Vec3d(0,-100.5,-1);
     // double big_sphere_radius = 100;
     // Mat2 big_sphere_mat = { Mat2::Diffuse, Vec3d(0.8f, 0.8f, 0.8f), Vec3d(0,0,0), 0, 0 };
-    // scene.add_object(new Sphere{big_sphere_posn, big_sphere_radius, big_sphere_mat});
+    // scene.add_object(new Sphere{big_sphere_posn, big_sphere_radius, scene.add_material(big_sphere_mat)});
 
-    scene.set_HDRI("../assets/hdrs/sunny.hdr");
+    scene.set_HDRI("../assets/hdrs/sunny.hdr", env_storage);
 
     return scene;
 }
@@ -119,14 +127,14 @@ void zoom(double factor, Vec3d &from, const Vec3d &to) {
     from = to + dir * factor;
 }
 
-Scene HDRI_test_scene() {
+Scene HDRI_test_scene(EnvStorage env_storage) {
     Scene scene{0};
-    scene.set_HDRI("../assets/hdrs/night.hdr");
+    scene.set_HDRI("../assets/hdrs/night.hdr", env_storage);
     scene.set_env_rotation(-0.1);
 
     // Vec3d sun_pos(0, 10, 0);
     // Mat2 sun_mat = { Mat2::Diffuse, Vec3d(0.8f, 0.8f, 0.8f), 1, 0, 0 };
-    // scene.add_object(new Sphere{sun_pos, 1, sun_mat});
+    // scene.add_object(new Sphere{sun_pos, 1, scene.add_material(sun_mat)});
 
     std::vector<Mat2> sphere_mats = {
         { Mat2::Metal, 1, 0, 0, 0 },
@@ -134,6 +142,8 @@ Scene HDRI_test_scene() {
         { Mat2::Metal, {0.86f, 0.66f, 0.26f}, 0, 0.1, 0 },
         { Mat2::Dielectric, Vec3d(0.8f, 0.f, 0.8f), 0, 0, 1.5 }
     };
+    std::vector<int> sphere_ids;
+    for (const Mat2 &m : sphere_mats) sphere_ids.push_back(scene.add_material(m));
 
     double theta = 0 / 180.0 * M_PI;
     double sphere_r = 0.5;
@@ -141,40 +151,264 @@ Scene HDRI_test_scene() {
     for (int i = 0; i < 4; ++i) {
         if(i != 0 && i != 3) continue;
         double off = (i - 1.5) * spacing;
-        scene.add_object(new Sphere{{off*cos(theta), 0, off*sin(theta)}, sphere_r, sphere_mats[i]});
+        scene.add_object(new Sphere{{off*cos(theta), 0, off*sin(theta)}, sphere_r, sphere_ids[i]});
     }
 
     // table
     Mat2 table_mat = {Mat2::Metal, 0.8, 0, 0.12, 0};
-    scene.add_object(new Plane{{0, 1, 0}, {0, -sphere_r-0.05, 0}, table_mat, 3});
+    scene.add_object(new Plane{{0, 1, 0}, {0, -sphere_r-0.05, 0}, scene.add_material(table_mat), 3});
 
-    scene.add_object(new Mesh{"../assets/meshes/monkey_low.obj", sphere_mats[2]});
+    scene.add_object(new Mesh{"../assets/meshes/monkey_low.obj", sphere_ids[2]});
 
     return scene;
 }
 
 
-void render_turntable(Scene &s, Camera &cam, const std::string &name, const Vec3d &center, double h_off, double rot_r, int num_angles) {
-    std::vector<Color> pixels;
+// frames with fewer pixels than this are batched so that several of them
+// are rendered at once and no core sits idle at a frame boundary
+constexpr int small_frame_pixels = 640 * 360;
+
+// false if any frame could not be written
+bool render_turntable(const Scene &s, const Camera &cam, const std::string &name, const Vec3d &center, double h_off, double rot_r, int num_angles) {
+    int width = cam.get_width(), height = cam.get_height();
+    int frame_pixels = width * height;
+
+    std::vector<Camera> cams(num_angles, cam);
     for(int i = 0; i < num_angles; ++i) {
         double pct = double(i) / num_angles;
         double theta = 2 * M_PI * pct;
         Vec3d from = {rot_r * sin(theta), h_off, rot_r * cos(theta)};
-        cam.move_from_to(from, center);
-        pixels = s.render(cam);
+        cams[i].move_from_to(from, center);
+    }
 
-        std::string filename = "anim/ " + std::to_string(i) + name + ".bmp";
-        drawbmp(filename.c_str(), cam.get_width(), cam.get_height(), pixels.data());
+    int batch_size = std::max(1, std::min(omp_get_max_threads(), small_frame_pixels / frame_pixels));
+
+    mkdir("anim", 0755); // frames go next to stills/, which is kept in the repo
+
+    // frame N is encoded and written on the writer thread while frame N+1 renders
+    AsyncImageWriter writer;
+
+    for(int first = 0; first < num_angles; first += batch_size) {
+        int batch = std::min(batch_size, num_angles - first);
+        std::vector<std::vector<Color>> frames(batch, std::vector<Color>(frame_pixels));
+
+        if(batch == 1) {
+            frames[0] = s.render(cams[first]);
+        } else {
+            // one flat loop over every pixel of every frame in the batch
+            #pragma omp parallel for schedule(dynamic, 64)
+            for(int i = 0; i < batch * frame_pixels; ++i) {
+                int f = i / frame_pixels, p = i % frame_pixels;
+                frames[f][p] = s.render_pixel(cams[first + f], p % width, p / width);
+            }
+        }
+
+        for(int f = 0; f < batch; ++f) {
+            std::string filename = "anim/ " + std::to_string(first + f) + name + ".bmp";
+            writer.submit(filename, width, height, std::move(frames[f]));
+        }
+        std::cout << "frame " << first + batch << "/" << num_angles << std::endl;
     }
+    return writer.flush();
 }
 
-void render_still(Scene &s, Camera &cam, const std::string &name) {
-    std::vector<Color> pixels = s.render(cam);
-    std::string filename = "stills/ " + name + ".bmp";
-    drawbmp(filename.c_str(), cam.get_width(), cam.get_height(), pixels.data());
+void render_still(const Scene &s, const Camera &cam, const std::string &name,
+                  bool denoised = false, bool write_aov = false, bool stats = false) {
+    AOVBuffer aovs;
+    std::vector<TraversalStats> pixel_stats;
+    bool count = stats && traversal_stats_enabled;
+    std::vector<Color> pixels = s.render(cam, denoised || write_aov ? &aovs : nullptr, count ? &pixel_stats : nullptr);
+    std::string filename = "stills/ " + name;
+    if (count) {
+        TraversalStats total;
+        for (const TraversalStats &p : pixel_stats) total += p;
+        print_traversal_stats(total);
+        write_cost_heatmap(filename + "_cost.bmp", cam.get_width(), cam.get_height(), pixel_stats);
+    } else if (stats) {
+        std::cout << "traversal counts are compiled out, build with make STATS=1" << std::endl;
+    }
+    write_image(filename + ".bmp", cam.get_width(), cam.get_height(), pixels.data());
+    // linear half float copy for changing the exposure later
+    write_image(filename + ".exr", cam.get_width(), cam.get_height(), pixels.data());
+    // float beauty with every AOV as extra channels
+    if (write_aov) write_aovs(filename + "_aovs.exr", pixels, aovs);
+
+    if (denoised) {
+        pixels = denoise(pixels, aovs);
+        write_image(filename + "_denoised.bmp", cam.get_width(), cam.get_height(), pixels.data());
+        write_image(filename + "_denoised.exr", cam.get_width(), cam.get_height(), pixels.data());
+    }
+}
+
+static std::atomic<bool> stop_requested{false};
+
+// Renders in passes and saves a checkpoint every interval_s seconds, when
+// interrupted (SIGINT / SIGTERM, e.g. node preemption) and at the end. With
+// resume, picks up the samples already in the checkpoint, which also adds
+// samples to a finished render when spp is raised. A checkpoint of another
+// render (see checkpoint_render_id) is left alone rather than overwritten.
+bool render_still_checkpointed(const Scene &s, const Camera &cam, const std::string &name, uint64_t render_id,
+                               const std::string &checkpoint, double interval_s, bool resume, int pass_samples) {
+    RenderBuffer buf{cam.get_width(), cam.get_height()};
+    if (resume) {
+        if (load_checkpoint(checkpoint, buf, s.sampler_type, render_id)) {
+            std::cout << "Resuming from " << checkpoint << std::endl;
+        } else if (FILE *existing = fopen(checkpoint.c_str(), "rb")) {
+            fclose(existing);
+            std::cerr << "Not resuming from or overwriting " << checkpoint << std::endl;
+            return false;
+        } else {
+            buf = RenderBuffer{cam.get_width(), cam.get_height()};
+        }
+    }
+
+    auto on_stop = [](int){ stop_requested = true; };
+    std::signal(SIGINT, on_stop);
+    std::signal(SIGTERM, on_stop);
+
+    auto last_save = std::chrono::steady_clock::now();
+    s.render_progressive(cam, buf, s.samples, pass_samples, [&](const RenderBuffer &b){
+        auto now = std::chrono::steady_clock::now();
+        if (stop_requested || std::chrono::duration<double>(now - last_save).count() >= interval_s) {
+            save_checkpoint(checkpoint, b, s.sampler_type, render_id);
+            last_save = now;
+        }
+        return !stop_requested;
+    });
+    save_checkpoint(checkpoint, buf, s.sampler_type, render_id);
+    if (stop_requested) {
+        std::cout << "Interrupted, progress saved to " << checkpoint << std::endl;
+        return false;
+    }
+
+    std::vector<Color> pixels = buf.resolve();
+    std::string filename = "stills/ " + name;
+    write_image(filename + ".bmp", cam.get_width(), cam.get_height(), pixels.data());
+    write_image(filename + ".exr", cam.get_width(), cam.get_height(), pixels.data());
+    return true;
 }
 
-int main(){
+// scenes the distributed workers can rebuild by name
+const SceneRegistry scene_registry = {
+    {"mat2_test", mat2_test_scene},
+    {"hdri_test", HDRI_test_scene}
+};
+
+int main(int argc, char **argv){
+    // distributed rendering:
+    //   main --workers N             fork N local workers
+    //   main --connect host:port     use a worker started with --worker-listen (repeatable)
+    //   main --worker-listen port    serve coordinators on this host
+    // --texture-cache-mb and --mesh-budget-mb apply to every worker
+    // checkpointing:
+    //   main --checkpoint file [--checkpoint-interval s] [--resume] [--pass-samples n]
+    // sampling:
+    //   main --sampler random|sobol|bluenoise
+    // radiance cache (ends paths in a prebuilt cache after the first bounce):
+    //   main --radiance-cache
+    // environment texels in 12 (default), 6 or 4 bytes:
+    //   main --env-storage float|half|rgbe
+    // meshes (writes a binary .cmesh with the KD tree, which Mesh maps directly):
+    //   main --convert-mesh in.obj out.cmesh
+    // keep at most n MB of every .cmesh's treelets resident, paging the rest (default 0, no paging):
+    //   main --mesh-budget-mb n
+    // textures (writes a tiled, mipmapped .ctex; the cache holds up to 256 MB of tiles by default):
+    //   main --convert-texture in.bmp|in.pfm out.ctex
+    //   main --texture-cache-mb n
+    // denoising and AOVs (local renders without checkpoints):
+    //   main [--denoise] [--aovs]
+    // KD tree shape of every mesh, and with a make STATS=1 build the traversal
+    // work per ray and a cost heatmap (local renders without checkpoints):
+    //   main --traversal-stats
+    // phase timings as Chrome trace JSON (chrome://tracing, Perfetto) and a summary:
+    //   main --trace trace.json
+    // n frames circling the scene, written to anim/ (local renders without checkpoints):
+    //   main --turntable n
+    std::string scene_name = "hdri_test", checkpoint, trace;
+    int num_local_workers = 0, sample_chunk = 0, spp = 6000, pass_samples = 8, texture_cache_mb = 256, mesh_budget_mb = 0;
+    int turntable_frames = 0;
+    double checkpoint_interval = 300;
+    bool resume = false, denoised = false, write_aov = false, radiance_cache = false, stats = false;
+    SamplerType sampler = SamplerType::Sobol;
+    EnvStorage env_storage = EnvStorage::Float;
+    std::vector<std::string> remote_workers;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_val = i + 1 < argc;
+        if (arg == "--worker-fd" && has_val) return run_worker(std::stoi(argv[++i]), scene_registry);
+        else if (arg == "--worker-listen" && has_val) return run_worker_server(std::stoi(argv[++i]), scene_registry);
+        else if (arg == "--convert-mesh" && i + 2 < argc) {
+            Mesh mesh{argv[i + 1], -1};
+            return mesh.save(argv[i + 2]) ? 0 : 1;
+        }
+        else if (arg == "--convert-texture" && i + 2 < argc) return convert_texture(argv[i + 1], argv[i + 2]) ? 0 : 1;
+        else if (arg == "--workers" && has_val) num_local_workers = std::stoi(argv[++i]);
+        else if (arg == "--connect" && has_val) remote_workers.push_back(argv[++i]);
+        else if (arg == "--sample-chunk" && has_val) sample_chunk = std::stoi(argv[++i]);
+        else if (arg == "--spp" && has_val) spp = std::stoi(argv[++i]);
+        else if (arg == "--scene" && has_val) scene_name = argv[++i];
+        else if (arg == "--checkpoint" && has_val) checkpoint = argv[++i];
+        else if (arg == "--checkpoint-interval" && has_val) checkpoint_interval = std::stod(argv[++i]);
+        else if (arg == "--pass-samples" && has_val) {
+            pass_samples = std::stoi(argv[++i]);
+            if (pass_samples <= 0) {
+                std::cerr << "--pass-samples must be positive" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--texture-cache-mb" && has_val) texture_cache_mb = std::stoi(argv[++i]);
+        else if (arg == "--mesh-budget-mb" && has_val) mesh_budget_mb = std::stoi(argv[++i]);
+        else if (arg == "--resume") resume = true;
+        else if (arg == "--denoise") denoised = true;
+        else if (arg == "--aovs") write_aov = true;
+        else if (arg == "--traversal-stats") stats = true;
+        else if (arg == "--trace" && has_val) trace = argv[++i];
+        else if (arg == "--turntable" && has_val) {
+            turntable_frames = std::stoi(argv[++i]);
+            if (turntable_frames <= 0) {
+                std::cerr << "--turntable must be positive" << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--radiance-cache") radiance_cache = true;
+        else if (arg == "--sampler" && has_val) {
+            if (!sampler_type_from_name(argv[++i], sampler)) {
+                std::cerr << "unknown sampler " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else if (arg == "--env-storage" && has_val) {
+            if (!env_storage_from_name(argv[++i], env_storage)) {
+                std::cerr << "unknown environment storage " << argv[i] << std::endl;
+                return 1;
+            }
+        }
+        else {
+            std::cerr << "unknown argument " << arg << std::endl;
+            return 1;
+        }
+    }
+
+    if (!scene_registry.count(scene_name)) {
+        std::cerr << "unknown scene " << scene_name << ", known scenes:";
+        for (auto &entry : scene_registry) std::cerr << " " << entry.first;
+        std::cerr << std::endl;
+        return 1;
+    }
+
+    bool distributed = num_local_workers > 0 || !remote_workers.empty();
+    if (distributed && (!checkpoint.empty() || denoised || write_aov || stats)) {
+        // workers only send back radiance sums
+        std::cerr << "distributed renders take no --checkpoint, --denoise, --aovs or --traversal-stats" << std::endl;
+        return 1;
+    }
+    if (turntable_frames > 0 && (num_local_workers > 0 || !remote_workers.empty() || !checkpoint.empty() || denoised || write_aov || stats)) {
+        std::cerr << "--turntable renders plain local frames, without workers, checkpoints, --denoise, --aovs or --traversal-stats" << std::endl;
+        return 1;
+    }
+
+    if (!trace.empty()) enable_profiling();
+
     int width = 1280, height = 720;
     double factor = 1.5;
     width *= factor; height *= factor;
@@ -182,22 +416,69 @@ int main(){
     double fov = 45;
     Camera cam{width, height, fov};
     
-    Scene scene = HDRI_test_scene();
     Vec3d lookfrom(0,.6,3);
     Vec3d lookat(0,0.3,0);
     zoom(1, lookfrom, lookat);
     cam.move_from_to(lookfrom, lookat);
 
     auto start = std::chrono::high_resolution_clock::now();
-    render_still(scene, cam, "path");
-    // render_turntable(scene, cam, "path_anim", 0, 3, 3, 60);
+    if (distributed) {
+        std::vector<WorkerConnection> workers = spawn_local_workers(num_local_workers);
+        for (auto &host : remote_workers) {
+            WorkerConnection conn;
+            if (connect_worker(host, conn)) workers.push_back(conn);
+            else std::cerr << "cannot connect to worker " << host << std::endl;
+        }
+
+        RenderBuffer buf;
+        bool ok = render_distributed(scene_name, cam, spp, sampler, radiance_cache, env_storage,
+                                     size_t(texture_cache_mb) << 20, size_t(mesh_budget_mb) << 20,
+                                     workers, buf, 64, sample_chunk);
+        close_workers(workers);
+        if (!ok) return 1;
+
+        std::vector<Color> pixels = buf.resolve();
+        write_image("stills/ " + scene_name + ".bmp", width, height, pixels.data());
+        write_image("stills/ " + scene_name + ".exr", width, height, pixels.data());
+    } else {
+        Scene scene = [&] {
+            ScopedTimer timer{"scene setup"};
+            return scene_registry.at(scene_name)(env_storage);
+        }();
+        scene.samples = spp;
+        scene.sampler_type = sampler;
+        scene.textures->set_budget(size_t(texture_cache_mb) << 20);
+        if (mesh_budget_mb > 0) scene.set_mesh_budget(size_t(mesh_budget_mb) << 20);
+        if (stats) {
+            for (auto &obj : scene.objects)
+                if (const Mesh *mesh = dynamic_cast<const Mesh *>(obj.get())) mesh->tree_quality().print("mesh " + std::to_string(obj->id));
+        }
+        if (radiance_cache) {
+            scene.use_radiance_cache = true;
+            scene.build_radiance_cache(cam);
+        }
+        if (!checkpoint.empty()) {
+            std::string options = "radiance_cache=" + std::to_string(radiance_cache) + " env_storage=" + env_storage_name(env_storage);
+            uint64_t render_id = checkpoint_render_id(scene_name, cam, options);
+            if (!render_still_checkpointed(scene, cam, "path", render_id, checkpoint, checkpoint_interval, resume, pass_samples)) return 2;
+        } else if (turntable_frames > 0) {
+            // circle at the still camera's height and distance from the vertical axis
+            if (!render_turntable(scene, cam, "path_anim", lookat, lookfrom[1], std::hypot(lookfrom[0], lookfrom[2]), turntable_frames)) return 1;
+        } else {
+            render_still(scene, cam, "path", denoised, write_aov, stats);
+        }
+    }
     auto stop = std::chrono::high_resolution_clock::now();
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start); 
     std::cout << "took: " << duration.count() / 1000.0 << std::endl;
+    if (!trace.empty()) {
+        print_profile_summary();
+        if (!write_chrome_trace(trace)) return 1;
+    }
 
     // Vec3d to = {0, 2, 0};
     // cam.move_from_to({0, 4, 6}, to);
     // Scene scene = mat1_test_scene();
     // render_turntable(scene, cam, "simple", to, 4, 6, 20);
     // render_still(scene, cam, "simple");
-}
\ No newline at end of file
+}